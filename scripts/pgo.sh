@@ -0,0 +1,25 @@
+#!/bin/sh
+# Two stage profile guided build of voxel-bench on Linux.
+#
+#   scripts/pgo.sh [gcc|clang]
+#
+# Measures a plain LTO release build first, then builds with instrumentation,
+# trains it on the voxel-bench scenes, rebuilds with the profile and reruns
+# the benchmark against the first measurement. The speedup is recorded in
+# out/pgo-<compiler>.json.
+set -e
+
+compiler=${1:-gcc}
+cd "$(dirname "$0")/.."
+mkdir -p out
+
+cmake --preset "linux-$compiler-release"
+cmake --build "out/build/linux-$compiler-release" --target voxel-bench
+"out/build/linux-$compiler-release/voxel-bench" --out "out/pgo-$compiler-baseline.json"
+
+cmake --preset "linux-$compiler-pgo-generate"
+cmake --build "out/build/linux-$compiler-pgo" --target pgo-train
+
+cmake --preset "linux-$compiler-pgo-use"
+cmake --build "out/build/linux-$compiler-pgo" --target voxel-bench
+"out/build/linux-$compiler-pgo/voxel-bench" --baseline "out/pgo-$compiler-baseline.json" --out "out/pgo-$compiler.json"
@@ -0,0 +1,76 @@
+#include "alloc_counter.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+thread_local uint64_t thread_allocations = 0;
+std::atomic<uint64_t> total_allocations = 0;
+
+void count_allocation() {
+	thread_allocations++;
+	total_allocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+void* aligned_malloc(std::size_t size, std::size_t alignment) {
+#ifdef _WIN32
+	return _aligned_malloc(size, alignment);
+#else
+	void* ptr = nullptr;
+	return posix_memalign(&ptr, alignment, size) == 0 ? ptr : nullptr;
+#endif
+}
+
+void aligned_free(void* ptr) {
+#ifdef _WIN32
+	_aligned_free(ptr);
+#else
+	std::free(ptr);
+#endif
+}
+
+}
+
+uint64_t thread_heap_allocations() {
+	return thread_allocations;
+}
+
+uint64_t total_heap_allocations() {
+	return total_allocations.load(std::memory_order_relaxed);
+}
+
+void* operator new(std::size_t size) {
+	count_allocation();
+	if (void* ptr = std::malloc(size ? size : 1)) {
+		return ptr;
+	}
+
+	throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+	count_allocation();
+	if (void* ptr = aligned_malloc(size ? size : 1, static_cast<std::size_t>(alignment))) {
+		return ptr;
+	}
+
+	throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+	aligned_free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+	aligned_free(ptr);
+}
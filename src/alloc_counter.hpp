@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+ * Global operator new is replaced to count heap allocations, so hot loops can
+ * check that they stay allocation free.
+ */
+uint64_t thread_heap_allocations();
+uint64_t total_heap_allocations();
@@ -0,0 +1,43 @@
+#include "arena.hpp"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <cstdint>
+
+frame_arena::frame_arena(size_t capacity)
+	: m_memory(new std::byte[capacity]), m_capacity(capacity) {
+}
+
+void* frame_arena::allocate(size_t size, size_t alignment) {
+	const uintptr_t base = reinterpret_cast<uintptr_t>(m_memory.get());
+	const size_t offset = ((base + m_offset + alignment - 1) & ~(alignment - 1)) - base;
+
+	if (offset + size <= m_capacity) {
+		m_offset = offset + size;
+		m_peak = std::max(m_peak, m_offset + m_overflow_bytes);
+		return m_memory.get() + offset;
+	}
+
+	// Over-allocate so that the block can be aligned by hand.
+	m_overflow.emplace_back(new std::byte[size + alignment]);
+	m_overflow_bytes += size + alignment;
+	m_peak = std::max(m_peak, m_offset + m_overflow_bytes);
+
+	const uintptr_t overflow = reinterpret_cast<uintptr_t>(m_overflow.back().get());
+	return reinterpret_cast<void*>((overflow + alignment - 1) & ~(alignment - 1));
+}
+
+void frame_arena::reset() {
+	if (!m_overflow.empty()) {
+		m_overflow.clear();
+		m_overflow_bytes = 0;
+
+		m_capacity = m_peak + m_peak / 2;
+		m_memory.reset(new std::byte[m_capacity]);
+		spdlog::warn("Frame arena overflowed, grew to {} bytes", m_capacity);
+	}
+
+	m_offset = 0;
+	m_peak = 0;
+}
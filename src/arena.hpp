@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+/*
+ * Bump allocator for data that only lives for one frame. Memory is handed out
+ * linearly from one block and released all at once by reset(). Nothing is
+ * ever destructed, so only trivially destructible types may be allocated.
+ *
+ * Allocations that do not fit fall back to separate heap blocks. reset() then
+ * grows the main block to the frame's peak usage, so a steady workload stops
+ * touching the heap after its first frame.
+ */
+class frame_arena {
+public:
+	explicit frame_arena(size_t capacity);
+
+	frame_arena(const frame_arena&) = delete;
+	frame_arena& operator=(const frame_arena&) = delete;
+
+	void* allocate(size_t size, size_t alignment);
+
+	template<typename T>
+	T* allocate(size_t count) {
+		static_assert(std::is_trivially_destructible_v<T>, "frame_arena never runs destructors");
+		return static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+	}
+
+	/* Scoped reuse within a frame: everything allocated after mark() is released by rewind(). */
+	size_t mark() const { return m_offset; }
+	void rewind(size_t mark) { m_offset = mark; }
+
+	void reset();
+
+	size_t capacity() const { return m_capacity; }
+	size_t peak() const { return m_peak; }
+
+private:
+	std::unique_ptr<std::byte[]> m_memory;
+	size_t m_capacity;
+	size_t m_offset = 0;
+	size_t m_peak = 0;
+	size_t m_overflow_bytes = 0;
+	std::vector<std::unique_ptr<std::byte[]>> m_overflow;
+};
@@ -0,0 +1,954 @@
+#include "collision.hpp"
+#include "cpu_features.hpp"
+#include "noise.hpp"
+#include "perf_counters.hpp"
+#include "ray_query.hpp"
+#include "raytracer.hpp"
+#include "resolution.hpp"
+#include "sampling.hpp"
+#include "scenes.hpp"
+
+#include <spdlog/spdlog.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <spdlog/fmt/fmt.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <random>
+#include <string>
+#include <thread>
+
+// Set by CMake for voxel-bench so the results record how the binary was built.
+#ifndef VOXEL_BUILD_LTO
+#define VOXEL_BUILD_LTO 0
+#endif
+
+#ifndef VOXEL_BUILD_PGO
+#define VOXEL_BUILD_PGO "OFF"
+#endif
+
+namespace {
+
+struct bench_options {
+	int width = 640;
+	int height = 360;
+	int frames = 3;
+	unsigned threads = std::thread::hardware_concurrency();
+	const char* output = nullptr;
+	const char* isa = nullptr;
+	const char* baseline = nullptr;
+};
+
+struct bench_result {
+	double frame_ms;
+	trace_stats stats;
+};
+
+bench_options parse_options(int argc, char** argv) {
+	bench_options options;
+
+	for (int i = 1; i + 1 < argc; i += 2) {
+		if (std::strcmp(argv[i], "--width") == 0) {
+			options.width = std::atoi(argv[i + 1]);
+		}
+		else if (std::strcmp(argv[i], "--height") == 0) {
+			options.height = std::atoi(argv[i + 1]);
+		}
+		else if (std::strcmp(argv[i], "--frames") == 0) {
+			options.frames = std::max(std::atoi(argv[i + 1]), 1);
+		}
+		else if (std::strcmp(argv[i], "--threads") == 0) {
+			options.threads = static_cast<unsigned>(std::max(std::atoi(argv[i + 1]), 1));
+		}
+		else if (std::strcmp(argv[i], "--out") == 0) {
+			options.output = argv[i + 1];
+		}
+		else if (std::strcmp(argv[i], "--isa") == 0) {
+			options.isa = argv[i + 1];
+		}
+		else if (std::strcmp(argv[i], "--baseline") == 0) {
+			options.baseline = argv[i + 1];
+		}
+		else {
+			spdlog::warn("Unknown option {}", argv[i]);
+		}
+	}
+
+	return options;
+}
+
+bench_result run(const world& w, const camera& cam, const render_settings& settings, const bench_options& options, job_system& jobs) {
+	framebuffer target(options.width, options.height);
+	bench_result result{};
+
+	const auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < options.frames; i++) {
+		result.stats = render(w, nullptr, cam, settings, target, jobs);
+	}
+	const auto end = std::chrono::steady_clock::now();
+
+	result.frame_ms = std::chrono::duration<double, std::milli>(end - start).count() / options.frames;
+	return result;
+}
+
+void write_result(std::string& out, const char* name, const bench_result& result) {
+	const double rays = static_cast<double>(std::max<uint64_t>(result.stats.rays, 1));
+
+	fmt::format_to(std::back_inserter(out),
+		"      \"{}\": {{ \"frame_ms\": {:.3f}, \"rays\": {}, \"coarse_steps\": {}, \"fine_steps\": {}, "
+		"\"cone_steps\": {}, \"primary_steps_per_ray\": {:.3f}, \"hot_loop_heap_allocations\": {} }}",
+		name, result.frame_ms, result.stats.rays, result.stats.coarse_steps, result.stats.fine_steps,
+		result.stats.cone_steps, static_cast<double>(result.stats.primary_steps()) / rays, result.stats.heap_allocations);
+}
+
+}
+
+/*
+ * Scatters thousands of prop instances over the terrain, then measures the
+ * top level BVH build, a refit after moving every instance, and a frame.
+ * Also path traces the instanced scene under a ray budget, where every ray
+ * can go through many instances. Returns whether the budget held.
+ */
+bool write_instancing_result(std::string& out, const world& w, instance_set& instances, const camera& cam, const bench_options& options, job_system& jobs) {
+	const auto build_start = std::chrono::steady_clock::now();
+	instances.build(jobs);
+	const auto build_end = std::chrono::steady_clock::now();
+
+	for (uint32_t i = 0; i < instances.instance_count(); i++) {
+		const instance& inst = instances.get_instance(i);
+		glm::mat4 to_world = inst.to_world;
+		to_world[3] += glm::vec4(0.0f, 0.5f, 0.0f, 0.0f);
+		instances.set_transform(i, to_world);
+	}
+
+	const auto refit_start = std::chrono::steady_clock::now();
+	instances.refit();
+	const auto refit_end = std::chrono::steady_clock::now();
+
+	framebuffer target(options.width, options.height);
+	const render_settings settings;
+	trace_stats stats;
+
+	const auto render_start = std::chrono::steady_clock::now();
+	for (int i = 0; i < options.frames; i++) {
+		stats = render(w, &instances, cam, settings, target, jobs);
+	}
+	const auto render_end = std::chrono::steady_clock::now();
+
+	// Budget twice the rays of the base pass alone, which always runs in full.
+	adaptive_settings adaptive;
+	adaptive.max_samples = adaptive.base_samples;
+	const uint64_t base_rays = render_adaptive(w, &instances, cam, settings, adaptive, target, jobs).trace.rays;
+	adaptive.max_samples = adaptive_settings().max_samples;
+	adaptive.ray_budget = base_rays * 2;
+	const adaptive_stats budgeted = render_adaptive(w, &instances, cam, settings, adaptive, target, jobs);
+	const bool budget_respected = budgeted.trace.rays <= adaptive.ray_budget;
+
+	size_t copied_bytes = 0;
+	for (uint32_t i = 0; i < instances.instance_count(); i++) {
+		copied_bytes += instances.model(instances.get_instance(i).model).memory_usage();
+	}
+
+	fmt::format_to(std::back_inserter(out),
+		"  \"instancing\": {{\n"
+		"    \"instances\": {},\n"
+		"    \"unique_models\": {},\n"
+		"    \"bvh_nodes\": {},\n"
+		"    \"model_bytes\": {},\n"
+		"    \"instance_bytes\": {},\n"
+		"    \"bytes_if_copied\": {},\n"
+		"    \"build_ms\": {:.3f},\n"
+		"    \"refit_ms\": {:.3f},\n"
+		"    \"frame_ms\": {:.3f},\n"
+		"    \"tlas_steps_per_ray\": {:.3f},\n"
+		"    \"budgeted_path_trace\": {{ \"rays\": {}, \"ray_budget\": {}, \"budget_exhausted\": {}, \"budget_respected\": {} }}\n"
+		"  }},\n",
+		instances.instance_count(), instances.model_count(), instances.node_count(),
+		instances.model_memory_usage(), instances.instance_memory_usage(), copied_bytes,
+		std::chrono::duration<double, std::milli>(build_end - build_start).count(),
+		std::chrono::duration<double, std::milli>(refit_end - refit_start).count(),
+		std::chrono::duration<double, std::milli>(render_end - render_start).count() / options.frames,
+		static_cast<double>(stats.tlas_steps) / static_cast<double>(std::max<uint64_t>(stats.rays, 1)),
+		budgeted.trace.rays, adaptive.ray_budget, budgeted.budget_exhausted, budget_respected);
+
+	if (!budget_respected) {
+		spdlog::error("The instanced path traced frame went over its ray budget");
+	}
+
+	return budget_respected;
+}
+
+/*
+ * Throughput of the batched query API on a gameplay-like mix: half line of
+ * sight checks between points just above the surface, half picking rays from
+ * the camera through random screen positions.
+ */
+void write_ray_query_result(std::string& out, const world& w, const instance_set& instances, const camera& cam, const bench_options& options, job_system& jobs) {
+	constexpr int QUERY_COUNT = 100000;
+
+	std::mt19937 rng(99);
+	std::uniform_real_distribution<float> x_dist(0.0f, static_cast<float>(w.size().x));
+	std::uniform_real_distribution<float> z_dist(0.0f, static_cast<float>(w.size().z));
+	std::uniform_real_distribution<float> screen_dist(-1.0f, 1.0f);
+
+	auto above_surface = [&](float x, float z) {
+		for (int y = w.size().y - 1; y >= 0; y--) {
+			if (w.get(glm::ivec3(x, y, z)) != 0) {
+				return glm::vec3(x, y + 2.5f, z);
+			}
+		}
+
+		return glm::vec3(x, 2.5f, z);
+	};
+
+	std::vector<ray> rays(QUERY_COUNT);
+	for (int i = 0; i < QUERY_COUNT; i++) {
+		if (i % 2 == 0) {
+			const glm::vec3 from = above_surface(x_dist(rng), z_dist(rng));
+			const glm::vec3 to = above_surface(x_dist(rng), z_dist(rng));
+			rays[i] = { from, to - from, 0.0f, glm::length(to - from) };
+		}
+		else {
+			const float aspect = static_cast<float>(options.width) / static_cast<float>(options.height);
+			rays[i] = { cam.position, cam.ray_direction(glm::vec2(screen_dist(rng), screen_dist(rng)), aspect), 0.0f, 4096.0f };
+		}
+	}
+
+	std::vector<hit> hits(QUERY_COUNT);
+	trace_stats stats;
+
+	const auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < options.frames; i++) {
+		stats = trace_rays(w, &instances, rays, hits, jobs);
+	}
+	const auto end = std::chrono::steady_clock::now();
+
+	const double seconds = std::chrono::duration<double>(end - start).count() / options.frames;
+	const size_t hit_count = std::count_if(hits.begin(), hits.end(), [](const hit& h) { return h.material != 0; });
+
+	fmt::format_to(std::back_inserter(out),
+		"  \"ray_queries\": {{\n"
+		"    \"queries\": {},\n"
+		"    \"hits\": {},\n"
+		"    \"batch_ms\": {:.3f},\n"
+		"    \"queries_per_sec\": {:.0f},\n"
+		"    \"steps_per_query\": {:.3f}\n"
+		"  }},\n",
+		QUERY_COUNT, hit_count, seconds * 1000.0, QUERY_COUNT / seconds,
+		static_cast<double>(stats.primary_steps()) / QUERY_COUNT);
+}
+
+/*
+ * Character controller style sweeps: boxes and capsules resting a little
+ * above the surface, moving sideways and falling.
+ */
+void write_collision_result(std::string& out, const world& w, const bench_options& options, job_system& jobs) {
+	constexpr int QUERY_COUNT = 50000;
+
+	std::mt19937 rng(5);
+	std::uniform_real_distribution<float> x_dist(2.0f, static_cast<float>(w.size().x) - 2.0f);
+	std::uniform_real_distribution<float> z_dist(2.0f, static_cast<float>(w.size().z) - 2.0f);
+	std::uniform_real_distribution<float> move_dist(-1.5f, 1.5f);
+
+	std::vector<aabb_sweep> boxes(QUERY_COUNT);
+	std::vector<capsule_sweep> capsules(QUERY_COUNT);
+
+	for (int i = 0; i < QUERY_COUNT; i++) {
+		const float x = x_dist(rng);
+		const float z = z_dist(rng);
+
+		float ground = 0.0f;
+		for (int y = w.size().y - 1; y >= 0; y--) {
+			if (w.get(glm::ivec3(x, y, z)) != 0) {
+				ground = static_cast<float>(y + 1);
+				break;
+			}
+		}
+
+		const glm::vec3 feet(x, ground + 0.25f, z);
+		const glm::vec3 motion(move_dist(rng), -1.0f, move_dist(rng));
+
+		boxes[i] = { feet - glm::vec3(0.4f, 0.0f, 0.4f), feet + glm::vec3(0.4f, 1.8f, 0.4f), motion };
+		capsules[i] = { feet + glm::vec3(0.0f, 0.4f, 0.0f), feet + glm::vec3(0.0f, 1.4f, 0.0f), 0.4f, motion };
+	}
+
+	std::vector<sweep_result> box_results(QUERY_COUNT);
+	std::vector<sweep_result> capsule_results(QUERY_COUNT);
+
+	const auto box_start = std::chrono::steady_clock::now();
+	for (int i = 0; i < options.frames; i++) {
+		sweep_aabbs(w, boxes, box_results, jobs);
+	}
+	const auto box_end = std::chrono::steady_clock::now();
+
+	const auto capsule_start = std::chrono::steady_clock::now();
+	for (int i = 0; i < options.frames; i++) {
+		sweep_capsules(w, capsules, capsule_results, jobs);
+	}
+	const auto capsule_end = std::chrono::steady_clock::now();
+
+	auto hit_count = [](const std::vector<sweep_result>& results) {
+		return std::count_if(results.begin(), results.end(), [](const sweep_result& r) { return r.hit; });
+	};
+
+	// A point and a hair-thin capsule dropped from above the world onto the first query's column, where the ground is.
+	const glm::vec3 top(capsules[0].a.x, static_cast<float>(w.size().y) + 0.5f, capsules[0].a.z);
+	const glm::vec3 drop(0.0f, -static_cast<float>(w.size().y) - 8.0f, 0.0f);
+	const bool degenerate_hit = sweep_capsule(w, { top, top, 0.0f, drop }).hit && sweep_capsule(w, { top, top + glm::vec3(0.0f, 1.0f, 0.0f), 0.02f, drop }).hit;
+
+	const double box_seconds = std::chrono::duration<double>(box_end - box_start).count() / options.frames;
+	const double capsule_seconds = std::chrono::duration<double>(capsule_end - capsule_start).count() / options.frames;
+
+	fmt::format_to(std::back_inserter(out),
+		"  \"collision\": {{\n"
+		"    \"queries\": {},\n"
+		"    \"aabb_hits\": {},\n"
+		"    \"aabb_queries_per_sec\": {:.0f},\n"
+		"    \"capsule_hits\": {},\n"
+		"    \"capsule_queries_per_sec\": {:.0f},\n"
+		"    \"degenerate_capsules_hit\": {}\n"
+		"  }},\n",
+		QUERY_COUNT, hit_count(box_results), QUERY_COUNT / box_seconds, hit_count(capsule_results), QUERY_COUNT / capsule_seconds, degenerate_hit);
+}
+
+/*
+ * Carves craters to fragment the brick pool, then runs idle-frame compaction
+ * passes until it is dense again. The image is compared before and after to
+ * make sure every grid reference was patched.
+ */
+void write_pool_result(std::string& out, world& w, const camera& cam, const bench_options& options, job_system& jobs) {
+	constexpr uint32_t MOVES_PER_IDLE_FRAME = 1024;
+
+	spdlog::info("Fragmenting brick pool");
+	carve_craters(w, 400, 7);
+
+	const render_settings settings;
+	framebuffer before(options.width, options.height);
+	render(w, nullptr, cam, settings, before, jobs);
+
+	const uint32_t live = w.bricks().live_count();
+	const uint32_t slots_before = w.bricks().slot_count();
+	const size_t slabs_before = w.bricks().slab_count();
+	const float fragmentation_before = w.bricks().fragmentation();
+
+	uint32_t moves = 0;
+	int idle_frames = 0;
+	double worst_ms = 0.0;
+
+	const auto start = std::chrono::steady_clock::now();
+	while (true) {
+		const auto frame_start = std::chrono::steady_clock::now();
+		const uint32_t moved = w.compact_bricks(MOVES_PER_IDLE_FRAME);
+		const auto frame_end = std::chrono::steady_clock::now();
+
+		if (moved == 0) {
+			break;
+		}
+
+		moves += moved;
+		idle_frames++;
+		worst_ms = std::max(worst_ms, std::chrono::duration<double, std::milli>(frame_end - frame_start).count());
+	}
+	const auto end = std::chrono::steady_clock::now();
+
+	framebuffer after(options.width, options.height);
+	render(w, nullptr, cam, settings, after, jobs);
+
+	fmt::format_to(std::back_inserter(out),
+		"  \"brick_pool\": {{\n"
+		"    \"live_bricks\": {},\n"
+		"    \"slots_before\": {},\n"
+		"    \"slots_after\": {},\n"
+		"    \"slabs_before\": {},\n"
+		"    \"slabs_after\": {},\n"
+		"    \"fragmentation_before_pct\": {:.2f},\n"
+		"    \"fragmentation_after_pct\": {:.2f},\n"
+		"    \"moves\": {},\n"
+		"    \"idle_frames\": {},\n"
+		"    \"worst_idle_frame_ms\": {:.3f},\n"
+		"    \"total_compaction_ms\": {:.3f},\n"
+		"    \"image_unchanged\": {}\n"
+		"  }},\n",
+		live, slots_before, w.bricks().slot_count(), slabs_before, w.bricks().slab_count(),
+		fragmentation_before, w.bricks().fragmentation(), moves, idle_frames, worst_ms,
+		std::chrono::duration<double, std::milli>(end - start).count(), before.pixels == after.pixels);
+}
+
+/*
+ * Brings the distance field up to date after the crater carving, then clears
+ * one surface brick and checks that the bounded incremental update agrees
+ * with a full rebuild.
+ */
+void write_distance_field_result(std::string& out, world& w, job_system& jobs) {
+	const auto rebuild_start = std::chrono::steady_clock::now();
+	w.update_distance_field(jobs);
+	const auto rebuild_end = std::chrono::steady_clock::now();
+
+	const glm::ivec3 grid = w.grid_size();
+	glm::ivec3 edited(grid.x / 2, grid.y - 1, grid.z / 2);
+	while (edited.y > 0 && w.brick_index(edited) == EMPTY_BRICK) {
+		edited.y--;
+	}
+
+	for (int i = 0; i < BRICK_VOLUME; i++) {
+		w.set(edited * BRICK_SIZE + glm::ivec3(i & 7, (i >> 3) & 7, i >> 6), 0);
+	}
+
+	const auto update_start = std::chrono::steady_clock::now();
+	w.update_distance_field(jobs);
+	const auto update_end = std::chrono::steady_clock::now();
+
+	std::vector<uint8_t> incremental;
+	for (int z = 0; z < grid.z; z++) {
+		for (int y = 0; y < grid.y; y++) {
+			for (int x = 0; x < grid.x; x++) {
+				incremental.push_back(w.brick_distance(glm::ivec3(x, y, z)));
+			}
+		}
+	}
+
+	w.rebuild_distance_field(jobs);
+
+	bool matches = true;
+	size_t i = 0;
+	for (int z = 0; z < grid.z; z++) {
+		for (int y = 0; y < grid.y; y++) {
+			for (int x = 0; x < grid.x; x++) {
+				matches = matches && incremental[i++] == w.brick_distance(glm::ivec3(x, y, z));
+			}
+		}
+	}
+
+	fmt::format_to(std::back_inserter(out),
+		"  \"distance_field\": {{\n"
+		"    \"range_bricks\": {},\n"
+		"    \"rebuild_ms\": {:.3f},\n"
+		"    \"incremental_update_ms\": {:.3f},\n"
+		"    \"incremental_matches_rebuild\": {}\n"
+		"  }},\n",
+		DISTANCE_FIELD_RANGE,
+		std::chrono::duration<double, std::milli>(rebuild_end - rebuild_start).count(),
+		std::chrono::duration<double, std::milli>(update_end - update_start).count(), matches);
+}
+
+/*
+ * Renders the horizon view with each tile order. Every run gets its own job
+ * system, started after the cache counters so that its threads are counted.
+ */
+void write_tile_order_result(std::string& out, const world& w, const camera& cam, const bench_options& options) {
+	constexpr tile_order ORDERS[] = { tile_order::scanline, tile_order::morton, tile_order::hilbert };
+
+	out += "  \"tile_orders\": [\n";
+	for (size_t i = 0; i < std::size(ORDERS); i++) {
+		spdlog::info("Rendering with {} tile order", tile_order_name(ORDERS[i]));
+
+		cache_counters counters;
+		job_system jobs(options.threads);
+		render_settings settings;
+		settings.order = ORDERS[i];
+
+		counters.start();
+		const bench_result result = run(w, cam, settings, options, jobs);
+		counters.stop();
+
+		fmt::format_to(std::back_inserter(out),
+			"    {{ \"name\": \"{}\", \"frame_ms\": {:.3f}, \"stolen_tiles\": {}, \"counters_available\": {}, \"l1d_misses_per_frame\": {}, \"llc_misses_per_frame\": {} }}{}\n",
+			tile_order_name(ORDERS[i]), result.frame_ms, result.stats.stolen_tiles, counters.available(),
+			counters.l1d_misses() / options.frames, counters.llc_misses() / options.frames, i + 1 < std::size(ORDERS) ? "," : "");
+	}
+	out += "  ],\n";
+}
+
+/* Reads "total_frame_ms" back from an earlier run's output, or returns 0. */
+double read_baseline_frame_ms(const char* path) {
+	FILE* file = std::fopen(path, "r");
+	if (!file) {
+		spdlog::error("Failed to open baseline {}", path);
+		return 0.0;
+	}
+
+	std::string text;
+	char buffer[4096];
+	for (size_t read; (read = std::fread(buffer, 1, sizeof(buffer), file)) > 0;) {
+		text.append(buffer, read);
+	}
+
+	std::fclose(file);
+
+	const char* key = "\"total_frame_ms\": ";
+	const size_t position = text.find(key);
+	if (position == std::string::npos) {
+		spdlog::error("No total_frame_ms in baseline {}", path);
+		return 0.0;
+	}
+
+	return std::strtod(text.c_str() + position + std::strlen(key), nullptr);
+}
+
+/*
+ * Runs the traversal and noise kernels once per instruction set variant this
+ * CPU supports, checking that each renders the same image as the baseline.
+ */
+void write_isa_result(std::string& out, const world& w, const camera& cam, const bench_options& options, job_system& jobs) {
+	constexpr int NOISE_SAMPLES = 1 << 20;
+	constexpr cpu_isa CANDIDATES[] = { cpu_isa::baseline, cpu_isa::sse42, cpu_isa::avx2, cpu_isa::avx512, cpu_isa::neon };
+
+	const cpu_isa selected = active_cpu_isa();
+	const render_settings settings;
+	framebuffer reference(options.width, options.height);
+	bool first = true;
+
+	out += "  \"isa_variants\": [\n";
+	for (cpu_isa isa : CANDIDATES) {
+		if (!set_cpu_isa(isa)) {
+			continue;
+		}
+
+		spdlog::info("Running {} kernels", cpu_isa_name(isa));
+		const bench_result result = run(w, cam, settings, options, jobs);
+
+		framebuffer image(options.width, options.height);
+		render(w, nullptr, cam, settings, image, jobs);
+		if (isa == cpu_isa::baseline) {
+			reference = image;
+		}
+
+		float sum = 0.0f;
+		const auto noise_start = std::chrono::steady_clock::now();
+		for (int i = 0; i < NOISE_SAMPLES; i++) {
+			sum += fbm(glm::vec2(static_cast<float>(i & 1023), static_cast<float>(i >> 10)) * 0.01f, 5, 1337);
+		}
+		const auto noise_end = std::chrono::steady_clock::now();
+
+		fmt::format_to(std::back_inserter(out),
+			"{}    {{ \"name\": \"{}\", \"frame_ms\": {:.3f}, \"fbm_msamples_per_sec\": {:.2f}, \"fbm_checksum\": {:.3f}, \"image_matches_baseline\": {} }}",
+			first ? "" : ",\n", cpu_isa_name(isa), result.frame_ms,
+			NOISE_SAMPLES / std::chrono::duration<double, std::micro>(noise_end - noise_start).count(), sum, image.pixels == reference.pixels);
+		first = false;
+	}
+	out += "\n  ],\n";
+
+	set_cpu_isa(selected);
+}
+
+/* Mean absolute difference per color channel, in 0-255 steps. */
+double image_error(const framebuffer& a, const framebuffer& b) {
+	uint64_t total = 0;
+	for (size_t i = 0; i < a.pixels.size(); i++) {
+		for (int shift = 0; shift < 24; shift += 8) {
+			total += static_cast<uint64_t>(std::abs(static_cast<int>((a.pixels[i] >> shift) & 0xFF) - static_cast<int>((b.pixels[i] >> shift) & 0xFF)));
+		}
+	}
+
+	return static_cast<double>(total) / static_cast<double>(std::max<size_t>(a.pixels.size() * 3, 1));
+}
+
+/*
+ * Path traces the horizon view uniformly at max_samples as a reference, then
+ * adaptively and foveated at a fixed threshold, and finally lets the sampling
+ * controller chase half the adaptive frame time within its ray count.
+ * Returns whether every controller frame stayed within that count.
+ */
+bool write_adaptive_result(std::string& out, const world& w, const camera& cam, const bench_options& options, job_system& jobs) {
+	constexpr int CONTROLLER_FRAMES = 12;
+
+	const render_settings settings;
+	auto timed = [&](const adaptive_settings& adaptive, framebuffer& target, adaptive_stats& stats) {
+		const auto start = std::chrono::steady_clock::now();
+		stats = render_adaptive(w, nullptr, cam, settings, adaptive, target, jobs);
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	};
+
+	auto write_run = [&](const char* name, double frame_ms, const adaptive_stats& stats, const framebuffer& reference, const framebuffer& image) {
+		fmt::format_to(std::back_inserter(out),
+			"    \"{}\": {{ \"frame_ms\": {:.3f}, \"rays\": {}, \"samples\": {}, \"refined_tiles\": {}, \"periphery_tiles\": {}, \"mean_abs_error\": {:.3f}, \"hot_loop_heap_allocations\": {} }},\n",
+			name, frame_ms, stats.trace.rays, stats.samples, stats.refined_tiles, stats.periphery_tiles, image_error(reference, image), stats.trace.heap_allocations);
+	};
+
+	spdlog::info("Path tracing with adaptive sampling");
+	out += "  \"adaptive_sampling\": {\n";
+
+	adaptive_settings uniform;
+	uniform.base_samples = uniform.max_samples;
+	framebuffer reference(options.width, options.height);
+	adaptive_stats uniform_stats;
+	const double uniform_ms = timed(uniform, reference, uniform_stats);
+	write_run("uniform", uniform_ms, uniform_stats, reference, reference);
+
+	adaptive_settings adaptive;
+	framebuffer image(options.width, options.height);
+	adaptive_stats stats;
+	const double adaptive_ms = timed(adaptive, image, stats);
+	const uint64_t adaptive_rays = stats.trace.rays;
+	write_run("adaptive", adaptive_ms, stats, reference, image);
+
+	adaptive.foveated = true;
+	write_run("foveated", timed(adaptive, image, stats), stats, reference, image);
+
+	// Give the controller the fixed threshold run's rays as its budget and ask for half its frame time.
+	adaptive.foveated = false;
+	adaptive.ray_budget = adaptive_rays;
+	const double target_ms = adaptive_ms * 0.5;
+	sampling_controller controller(target_ms);
+	bool budget_respected = true;
+
+	out += "    \"controller\": {\n      \"frame_ms\": [";
+	for (int i = 0; i < CONTROLLER_FRAMES; i++) {
+		adaptive.frame = static_cast<uint32_t>(i);
+		const double frame_ms = timed(adaptive, image, stats);
+		controller.update(frame_ms, adaptive);
+		budget_respected = budget_respected && stats.trace.rays <= adaptive.ray_budget;
+		fmt::format_to(std::back_inserter(out), "{}{:.3f}", i > 0 ? ", " : "", frame_ms);
+	}
+
+	fmt::format_to(std::back_inserter(out),
+		"],\n"
+		"      \"target_ms\": {:.3f},\n"
+		"      \"smoothed_ms\": {:.3f},\n"
+		"      \"final_threshold\": {:.6g},\n"
+		"      \"ray_budget\": {},\n"
+		"      \"budget_respected\": {}\n"
+		"    }}\n"
+		"  }},\n",
+		target_ms, controller.smoothed_ms(), adaptive.variance_threshold, adaptive.ray_budget, budget_respected);
+
+	if (!budget_respected) {
+		spdlog::error("A sampling controller frame went over its ray budget");
+	}
+
+	return budget_respected;
+}
+
+/*
+ * Upscales the horizon view from reduced resolutions with both filters and
+ * compares against a full resolution render, then runs the resolution
+ * controller for a series of frames while competing threads load the CPUs
+ * during the middle third. Returns whether the controller settled near the
+ * target before the load and recovered after it.
+ */
+bool write_dynamic_resolution_result(std::string& out, const world& w, const camera& cam, const bench_options& options, job_system& jobs) {
+	constexpr float SCALES[] = { 0.5f, 0.75f };
+	constexpr upscale_filter FILTERS[] = { upscale_filter::bilinear, upscale_filter::lanczos };
+	constexpr int CONTROLLER_FRAMES = 30;
+	constexpr int SETTLED_FRAMES = 3;
+
+	spdlog::info("Rendering with dynamic resolution");
+
+	const render_settings settings;
+	framebuffer reference(options.width, options.height);
+	const bench_result full = run(w, cam, settings, options, jobs);
+	render(w, nullptr, cam, settings, reference, jobs);
+
+	out += "  \"dynamic_resolution\": {\n    \"upscale\": [\n";
+	bool first = true;
+	for (float scale : SCALES) {
+		framebuffer low(std::max(static_cast<int>(options.width * scale), 1), std::max(static_cast<int>(options.height * scale), 1));
+		framebuffer image(options.width, options.height);
+
+		const auto render_start = std::chrono::steady_clock::now();
+		render(w, nullptr, cam, settings, low, jobs);
+		const double render_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - render_start).count();
+
+		for (upscale_filter filter : FILTERS) {
+			const auto start = std::chrono::steady_clock::now();
+			upscale(low, image, filter, jobs);
+			const double upscale_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+			fmt::format_to(std::back_inserter(out),
+				"{}      {{ \"scale\": {}, \"filter\": \"{}\", \"render_ms\": {:.3f}, \"upscale_ms\": {:.3f}, \"mean_abs_error\": {:.3f} }}",
+				first ? "" : ",\n", scale, upscale_filter_name(filter), render_ms, upscale_ms, image_error(reference, image));
+			first = false;
+		}
+	}
+
+	// Aim for 70% of the full resolution frame time, so the controller has to scale down even without extra load.
+	const double target_ms = full.frame_ms * 0.7;
+	resolution_controller controller(glm::ivec2(options.width, options.height), target_ms);
+	framebuffer low(options.width, options.height);
+	framebuffer image(options.width, options.height);
+
+	std::atomic<bool> loaded = false;
+	std::atomic<bool> done = false;
+	std::vector<std::thread> load;
+	for (unsigned i = 0; i < jobs.thread_count(); i++) {
+		load.emplace_back([&] {
+			while (!done.load(std::memory_order_relaxed)) {
+				if (!loaded.load(std::memory_order_relaxed)) {
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				}
+			}
+		});
+	}
+
+	std::string frame_ms_list;
+	std::string scale_list;
+	int frames_over_target = 0;
+	glm::ivec2 size = controller.render_size();
+
+	// Frames in a row rendered at the minimum scale although the frame before was already under target, and the scale and
+	// mean frame time the controller had settled at just before the load.
+	int stuck_frames = 0;
+	int most_stuck_frames = 0;
+	bool previous_under_target = false;
+	float settled_scale = 0.0f;
+	double settled_ms = 0.0;
+
+	for (int i = 0; i < CONTROLLER_FRAMES; i++) {
+		loaded = i >= CONTROLLER_FRAMES / 3 && i < CONTROLLER_FRAMES * 2 / 3;
+
+		const auto start = std::chrono::steady_clock::now();
+		low.resize(size.x, size.y);
+		render(w, nullptr, cam, settings, low, jobs);
+		upscale(low, image, upscale_filter::lanczos, jobs);
+		const double frame_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+		frames_over_target += frame_ms > target_ms;
+		stuck_frames = controller.scale() <= controller.min_scale() && previous_under_target ? stuck_frames + 1 : 0;
+		most_stuck_frames = std::max(most_stuck_frames, stuck_frames);
+		previous_under_target = frame_ms <= target_ms;
+		if (i >= CONTROLLER_FRAMES / 3 - SETTLED_FRAMES && i < CONTROLLER_FRAMES / 3) {
+			settled_scale = controller.scale();
+			settled_ms += frame_ms / SETTLED_FRAMES;
+		}
+		fmt::format_to(std::back_inserter(frame_ms_list), "{}{:.3f}", i > 0 ? ", " : "", frame_ms);
+		fmt::format_to(std::back_inserter(scale_list), "{}{:.3f}", i > 0 ? ", " : "", controller.scale());
+		size = controller.update(frame_ms);
+	}
+
+	done = true;
+	for (std::thread& thread : load) {
+		thread.join();
+	}
+
+	// Before the load the frames have to settle close to the target rather than well under it, which is what a scale that
+	// overshot looks like. One frame at the minimum after the load lifts is the smoothing catching up; more means the scale
+	// overshot there too. A third of the run after the load, the scale has to be back near where it settled.
+	const bool settled = settled_ms >= target_ms * 0.85;
+	const bool recovered = most_stuck_frames < 2 && controller.scale() > controller.min_scale() && controller.scale() >= settled_scale * 0.9f;
+	if (!settled || !recovered) {
+		spdlog::error("Dynamic resolution settled at {:.3f} ms for a {:.3f} ms target, stayed at its minimum under target for {} frames "
+			"and ended at scale {:.3f} after settling at {:.3f}", settled_ms, target_ms, most_stuck_frames, controller.scale(), settled_scale);
+	}
+
+	fmt::format_to(std::back_inserter(out),
+		"\n    ],\n"
+		"    \"controller\": {{\n"
+		"      \"full_resolution_ms\": {:.3f},\n"
+		"      \"target_ms\": {:.3f},\n"
+		"      \"loaded_frames\": [{}, {}],\n"
+		"      \"frame_ms\": [{}],\n"
+		"      \"scale\": [{}],\n"
+		"      \"frames_over_target\": {},\n"
+		"      \"settled_ms\": {:.3f},\n"
+		"      \"settled_scale\": {:.3f},\n"
+		"      \"frames_stuck_at_min_scale\": {},\n"
+		"      \"check_passed\": {}\n"
+		"    }}\n"
+		"  }},\n",
+		full.frame_ms, target_ms, CONTROLLER_FRAMES / 3, CONTROLLER_FRAMES * 2 / 3, frame_ms_list, scale_list, frames_over_target, settled_ms, settled_scale, most_stuck_frames, settled && recovered);
+
+	return settled && recovered;
+}
+
+/*
+ * Renders the terrain from increasing distances at full resolution and with
+ * two level of detail biases, then reduces every brick that can only ever be
+ * seen at a coarser level from one of the views to its coarse levels.
+ */
+void write_lod_result(std::string& out, world& w, const bench_options& options, job_system& jobs) {
+	constexpr float BIASES[] = { 0.0f, 1.0f, 2.0f };
+
+	const std::vector<scene_view> views = distance_views(w);
+	out += "  \"lod\": {\n    \"views\": [\n";
+
+	for (size_t i = 0; i < views.size(); i++) {
+		const scene_view& view = views[i];
+		spdlog::info("Rendering {}", view.name);
+
+		framebuffer reference(options.width, options.height);
+		fmt::format_to(std::back_inserter(out), "      {{ \"name\": \"{}\"", view.name);
+
+		for (float bias : BIASES) {
+			render_settings settings;
+			settings.lod_bias = bias;
+
+			const bench_result result = run(w, view.cam, settings, options, jobs);
+			framebuffer image(options.width, options.height);
+			render(w, nullptr, view.cam, settings, bias == 0.0f ? reference : image, jobs);
+
+			fmt::format_to(std::back_inserter(out),
+				",\n        \"lod_bias_{}\": {{ \"frame_ms\": {:.3f}, \"primary_steps_per_ray\": {:.3f}, \"mean_abs_error\": {:.3f} }}",
+				bias, result.frame_ms, static_cast<double>(result.stats.primary_steps()) / static_cast<double>(std::max<uint64_t>(result.stats.rays, 1)),
+				bias == 0.0f ? 0.0 : image_error(reference, image));
+		}
+
+		fmt::format_to(std::back_inserter(out), "\n      }}{}\n", i + 1 < views.size() ? "," : "");
+	}
+
+	// Bricks whose nearest point is past the distance where level 1 takes over are never traced at full resolution.
+	const scene_view& view = views[1];
+	const render_settings settings;
+	const float lod_scale = settings.lod_bias * 2.0f * std::tan(view.cam.fov_y * 0.5f) / static_cast<float>(options.height);
+	const float coarse_distance = 2.0f / lod_scale;
+
+	framebuffer before(options.width, options.height);
+	render(w, nullptr, view.cam, settings, before, jobs);
+
+	const size_t bytes_before = w.memory_usage();
+	const glm::ivec3 grid = w.grid_size();
+	for (int z = 0; z < grid.z; z++) {
+		for (int y = 0; y < grid.y; y++) {
+			for (int x = 0; x < grid.x; x++) {
+				const glm::vec3 lo(glm::ivec3(x, y, z) * BRICK_SIZE);
+				const glm::vec3 nearest = glm::clamp(view.cam.position, lo, lo + static_cast<float>(BRICK_SIZE));
+				if (glm::length(nearest - view.cam.position) >= coarse_distance) {
+					w.coarsen_brick(glm::ivec3(x, y, z));
+				}
+			}
+		}
+	}
+
+	// Release the slabs the coarsened bricks left empty.
+	while (w.compact_bricks(UINT32_MAX) > 0) {
+	}
+
+	framebuffer after(options.width, options.height);
+	render(w, nullptr, view.cam, settings, after, jobs);
+
+	fmt::format_to(std::back_inserter(out),
+		"    ],\n"
+		"    \"coarse_only\": {{\n"
+		"      \"view\": \"{}\",\n"
+		"      \"coarse_distance\": {:.1f},\n"
+		"      \"full_bricks\": {},\n"
+		"      \"coarse_bricks\": {},\n"
+		"      \"bytes_before\": {},\n"
+		"      \"bytes_after\": {},\n"
+		"      \"image_unchanged\": {}\n"
+		"    }}\n"
+		"  }}\n",
+		view.name, coarse_distance, w.brick_count(), w.coarse_brick_count(), bytes_before, w.memory_usage(), before.pixels == after.pixels);
+}
+
+int main(int argc, char** argv) {
+	spdlog::set_default_logger(spdlog::stderr_color_mt("voxel-bench"));
+
+	const bench_options options = parse_options(argc, argv);
+	job_system jobs(options.threads);
+
+	cpu_isa isa;
+	if (options.isa && (!parse_cpu_isa(options.isa, isa) || !set_cpu_isa(isa))) {
+		spdlog::error("Instruction set {} is not available on this CPU", options.isa);
+		return 1;
+	}
+
+	spdlog::info("Using {} kernels", cpu_isa_name(active_cpu_isa()));
+
+	spdlog::info("Generating terrain");
+	world w = generate_terrain(glm::ivec3(64, 16, 64), 1337);
+	spdlog::info("{} bricks allocated", w.brick_count());
+
+	std::string out;
+#ifdef __VERSION__
+	const char* compiler = __VERSION__;
+#else
+	const char* compiler = "unknown";
+#endif
+
+	fmt::format_to(std::back_inserter(out), "{{\n  \"width\": {},\n  \"height\": {},\n  \"frames\": {},\n  \"threads\": {},\n  \"isa\": \"{}\",\n",
+		options.width, options.height, options.frames, jobs.thread_count(), cpu_isa_name(active_cpu_isa()));
+	fmt::format_to(std::back_inserter(out), "  \"build\": {{ \"compiler\": \"{}\", \"lto\": {}, \"pgo\": \"{}\" }},\n  \"scenes\": [\n",
+		compiler, VOXEL_BUILD_LTO != 0, VOXEL_BUILD_PGO);
+
+	double total_frame_ms = 0.0;
+
+	const std::vector<scene_view> views = terrain_views(w);
+	for (size_t i = 0; i < views.size(); i++) {
+		const scene_view& view = views[i];
+		spdlog::info("Rendering {}", view.name);
+
+		render_settings settings;
+		settings.cone_prepass = false;
+		const bench_result before = run(w, view.cam, settings, options, jobs);
+
+		settings.skip = empty_skip::distance_field;
+		const bench_result distance_field = run(w, view.cam, settings, options, jobs);
+
+		settings.skip = empty_skip::pyramid;
+		settings.cone_prepass = true;
+		const bench_result after = run(w, view.cam, settings, options, jobs);
+
+		total_frame_ms += after.frame_ms;
+
+		const double reduction = 1.0 - static_cast<double>(after.stats.primary_steps()) / static_cast<double>(std::max<uint64_t>(before.stats.primary_steps(), 1));
+		const double distance_field_reduction = 1.0 - static_cast<double>(distance_field.stats.primary_steps()) / static_cast<double>(std::max<uint64_t>(before.stats.primary_steps(), 1));
+
+		fmt::format_to(std::back_inserter(out), "    {{\n      \"name\": \"{}\",\n", view.name);
+		write_result(out, "cone_prepass_off", before);
+		out += ",\n";
+		write_result(out, "cone_prepass_on", after);
+		out += ",\n";
+		write_result(out, "distance_field", distance_field);
+		fmt::format_to(std::back_inserter(out), ",\n      \"primary_step_reduction\": {:.4f},\n      \"distance_field_step_reduction\": {:.4f}\n    }}{}\n",
+			reduction, distance_field_reduction, i + 1 < views.size() ? "," : "");
+	}
+
+	out += "  ],\n";
+
+	// Sum of the default-settings frame times, used to compare builds (e.g. before and after PGO).
+	fmt::format_to(std::back_inserter(out), "  \"total_frame_ms\": {:.3f},\n", total_frame_ms);
+	if (options.baseline) {
+		const double baseline_ms = read_baseline_frame_ms(options.baseline);
+		fmt::format_to(std::back_inserter(out), "  \"baseline_total_frame_ms\": {:.3f},\n  \"speedup\": {:.4f},\n",
+			baseline_ms, baseline_ms > 0.0 ? baseline_ms / total_frame_ms : 0.0);
+	}
+
+	write_isa_result(out, w, views.front().cam, options, jobs);
+	write_tile_order_result(out, w, views.front().cam, options);
+	bool checks_passed = write_adaptive_result(out, w, views.front().cam, options, jobs);
+	checks_passed = write_dynamic_resolution_result(out, w, views.front().cam, options, jobs) && checks_passed;
+
+	constexpr int INSTANCE_COUNT = 5000;
+	spdlog::info("Scattering {} instances", INSTANCE_COUNT);
+
+	instance_set instances;
+	for (world& prop : generate_props(11)) {
+		instances.add_model(std::move(prop));
+	}
+
+	scatter_instances(instances, w, INSTANCE_COUNT, 23);
+
+	checks_passed = write_instancing_result(out, w, instances, views.front().cam, options, jobs) && checks_passed;
+	write_ray_query_result(out, w, instances, views.front().cam, options, jobs);
+	write_collision_result(out, w, options, jobs);
+	write_pool_result(out, w, views.front().cam, options, jobs);
+	write_distance_field_result(out, w, jobs);
+	write_lod_result(out, w, options, jobs);
+	out += "}\n";
+
+	if (options.output) {
+		FILE* file = std::fopen(options.output, "w");
+		if (!file) {
+			spdlog::error("Failed to open {}", options.output);
+			return 1;
+		}
+
+		std::fputs(out.c_str(), file);
+		std::fclose(file);
+	}
+	else {
+		std::fputs(out.c_str(), stdout);
+	}
+
+	if (!checks_passed) {
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <array>
+#include <cstdint>
+
+constexpr int BRICK_SIZE = 8;
+constexpr int BRICK_SHIFT = 3;
+constexpr int BRICK_VOLUME = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+
+constexpr uint32_t EMPTY_BRICK = UINT32_MAX;
+
+/* Grid entries with this bit set (other than EMPTY_BRICK) refer to a coarse-only brick. */
+constexpr uint32_t COARSE_BRICK = 0x80000000u;
+
+/* Level 0 is the brick itself, level 3 a single cell covering the whole brick. */
+constexpr int BRICK_LOD_LEVELS = 4;
+
+struct lod_cell {
+	uint8_t material;
+	glm::u8vec3 color;
+};
+
+/*
+ * Coarser versions of a brick. A level 1 cell covers 2x2x2 voxels, level 2
+ * 4x4x4 and level 3 the whole brick. A cell is solid if any of its 2x2x2
+ * children is, and stores the majority material and averaged color of its
+ * solid children. Cells of levels 1, 2 and 3 are packed in that order.
+ */
+struct brick_lod {
+	uint64_t occupancy_l1;
+	uint8_t occupancy_l2;
+	std::array<lod_cell, 64 + 8 + 1> cells;
+};
+
+/*
+ * An 8x8x8 block of voxels. Each z slice of the occupancy mask is one 64 bit
+ * word with bit (x + y * 8) set for solid voxels. Material 0 is air.
+ */
+struct brick {
+	std::array<uint64_t, BRICK_SIZE> occupancy;
+	std::array<uint8_t, BRICK_VOLUME> materials;
+	brick_lod lod;
+};
+
+inline int brick_voxel_index(glm::ivec3 local) {
+	return local.x + (local.y << BRICK_SHIFT) + (local.z << (BRICK_SHIFT * 2));
+}
+
+inline bool brick_is_solid(const brick& b, glm::ivec3 local) {
+	return (b.occupancy[local.z] >> (local.x + (local.y << BRICK_SHIFT))) & 1;
+}
+
+inline int lod_cell_index(int level, glm::ivec3 cell) {
+	static constexpr int offsets[BRICK_LOD_LEVELS] = { 0, 0, 64, 72 };
+	const int shift = BRICK_SHIFT - level;
+	return offsets[level] + cell.x + (cell.y << shift) + (cell.z << (shift * 2));
+}
+
+/* Levels 1 and up; level 3 is solid whenever the brick has any solid voxel. */
+inline bool lod_is_solid(const brick_lod& lod, int level, glm::ivec3 cell) {
+	if (level == 1) {
+		return (lod.occupancy_l1 >> (cell.x + (cell.y << 2) + (cell.z << 4))) & 1;
+	}
+
+	if (level == 2) {
+		return (lod.occupancy_l2 >> (cell.x + (cell.y << 1) + (cell.z << 2))) & 1;
+	}
+
+	return lod.occupancy_l2 != 0;
+}
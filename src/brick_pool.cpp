@@ -0,0 +1,94 @@
+#include "brick_pool.hpp"
+
+#include <algorithm>
+#include <bit>
+
+uint32_t brick_pool::allocate(uint32_t owner) {
+	uint32_t slot = lowest_free();
+
+	if (slot < m_high_water) {
+		set_free(slot, false);
+	}
+	else {
+		slot = m_high_water++;
+
+		if (slot >= m_slabs.size() * BRICK_SLAB_SIZE) {
+			m_slabs.emplace_back(new brick[BRICK_SLAB_SIZE]);
+			m_owners.resize(m_slabs.size() * BRICK_SLAB_SIZE, NO_OWNER);
+			m_free_mask.resize(m_owners.size() / 64, 0);
+		}
+	}
+
+	m_owners[slot] = owner;
+	m_live++;
+	return slot;
+}
+
+void brick_pool::free(uint32_t slot) {
+	m_owners[slot] = NO_OWNER;
+	m_live--;
+
+	set_free(slot, true);
+	trim();
+}
+
+float brick_pool::fragmentation() const {
+	if (m_high_water == 0) {
+		return 0.0f;
+	}
+
+	return 100.0f * static_cast<float>(m_high_water - m_live) / static_cast<float>(m_high_water);
+}
+
+uint32_t brick_pool::lowest_free() const {
+	const uint32_t words = (m_high_water + 63) / 64;
+
+	for (; m_search_word < words; m_search_word++) {
+		if (const uint64_t word = m_free_mask[m_search_word]) {
+			return m_search_word * 64 + static_cast<uint32_t>(std::countr_zero(word));
+		}
+	}
+
+	return m_high_water;
+}
+
+void brick_pool::move(uint32_t from, uint32_t to) {
+	(*this)[to] = (*this)[from];
+	m_owners[to] = m_owners[from];
+	set_free(to, false);
+
+	m_owners[from] = NO_OWNER;
+	set_free(from, true);
+	trim();
+}
+
+void brick_pool::set_free(uint32_t slot, bool free) {
+	const uint64_t bit = uint64_t(1) << (slot & 63);
+
+	if (free) {
+		m_free_mask[slot / 64] |= bit;
+		m_search_word = std::min(m_search_word, slot / 64);
+	}
+	else {
+		m_free_mask[slot / 64] &= ~bit;
+	}
+}
+
+void brick_pool::trim() {
+	while (m_high_water > 0 && (m_free_mask[(m_high_water - 1) / 64] >> ((m_high_water - 1) & 63)) & 1) {
+		m_high_water--;
+		set_free(m_high_water, false);
+	}
+}
+
+void brick_pool::release_slabs() {
+	// Keep one spare slab above the live range so that a grow/shrink cycle at a slab boundary does not thrash.
+	const size_t needed = (m_high_water + BRICK_SLAB_SIZE - 1) / BRICK_SLAB_SIZE + 1;
+
+	if (m_slabs.size() > needed) {
+		m_slabs.resize(needed);
+		m_owners.resize(needed * BRICK_SLAB_SIZE);
+		m_free_mask.resize(m_owners.size() / 64);
+		m_search_word = std::min<uint32_t>(m_search_word, static_cast<uint32_t>(m_free_mask.size()));
+	}
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "brick.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+constexpr int BRICK_SLAB_SHIFT = 8;
+constexpr uint32_t BRICK_SLAB_SIZE = 1u << BRICK_SLAB_SHIFT;
+
+constexpr uint32_t NO_OWNER = UINT32_MAX;
+
+/*
+ * Slot allocator for bricks. Storage is split into fixed size slabs so that
+ * growing the pool never moves existing bricks, and every slot remembers its
+ * owner so that compaction can tell the caller which reference to patch.
+ *
+ * Free slots are tracked in a bitmask and allocation always takes the lowest
+ * free slot, which keeps the live range [0, slot_count()) dense. This range is
+ * what a GPU mirror of the pool has to cover.
+ */
+class brick_pool {
+public:
+	brick& operator[](uint32_t slot) { return m_slabs[slot >> BRICK_SLAB_SHIFT][slot & (BRICK_SLAB_SIZE - 1)]; }
+	const brick& operator[](uint32_t slot) const { return m_slabs[slot >> BRICK_SLAB_SHIFT][slot & (BRICK_SLAB_SIZE - 1)]; }
+
+	uint32_t allocate(uint32_t owner);
+	void free(uint32_t slot);
+
+	uint32_t owner(uint32_t slot) const { return m_owners[slot]; }
+
+	uint32_t live_count() const { return m_live; }
+	uint32_t slot_count() const { return m_high_water; }
+	size_t slab_count() const { return m_slabs.size(); }
+
+	/* Percentage of slots below the high water mark that are holes. */
+	float fragmentation() const;
+
+	/*
+	 * Moves up to `max_moves` bricks from the top of the pool down into the
+	 * lowest holes, calling on_move(owner, new_slot) for each, then releases
+	 * slabs that are no longer needed. Returns the number of bricks moved.
+	 */
+	template<typename F>
+	uint32_t compact(uint32_t max_moves, F&& on_move) {
+		uint32_t moves = 0;
+
+		while (moves < max_moves) {
+			const uint32_t hole = lowest_free();
+			if (hole >= m_high_water) {
+				break;
+			}
+
+			const uint32_t from = m_high_water - 1;
+			const uint32_t owner = m_owners[from];
+			move(from, hole);
+			on_move(owner, hole);
+			moves++;
+		}
+
+		release_slabs();
+		return moves;
+	}
+
+private:
+	uint32_t lowest_free() const;
+	void move(uint32_t from, uint32_t to);
+	void set_free(uint32_t slot, bool free);
+	void trim();
+	void release_slabs();
+
+	std::vector<std::unique_ptr<brick[]>> m_slabs;
+	std::vector<uint32_t> m_owners;
+	std::vector<uint64_t> m_free_mask;
+
+	uint32_t m_high_water = 0;
+	uint32_t m_live = 0;
+
+	// No free bits exist in words below this one.
+	mutable uint32_t m_search_word = 0;
+};
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cmath>
+
+struct camera {
+	glm::vec3 position;
+	glm::vec3 forward;
+	glm::vec3 right;
+	glm::vec3 up;
+	float fov_y;
+
+	static camera look_at(glm::vec3 position, glm::vec3 target, float fov_y) {
+		camera cam;
+		cam.position = position;
+		cam.forward = glm::normalize(target - position);
+		cam.right = glm::normalize(glm::cross(cam.forward, glm::vec3(0.0f, 1.0f, 0.0f)));
+		cam.up = glm::cross(cam.right, cam.forward);
+		cam.fov_y = fov_y;
+		return cam;
+	}
+
+	/* Unnormalized direction through a point in [-1, 1] screen space, y up. */
+	glm::vec3 ray_direction(glm::vec2 screen, float aspect) const {
+		const float half_height = std::tan(fov_y * 0.5f);
+		return forward + right * (screen.x * half_height * aspect) + up * (screen.y * half_height);
+	}
+};
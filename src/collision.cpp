@@ -0,0 +1,284 @@
+#include "collision.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace {
+
+constexpr uint32_t QUERIES_PER_JOB = 64;
+constexpr int SEGMENT_SEARCH_ITERATIONS = 24;
+constexpr int BISECTION_ITERATIONS = 10;
+
+// Capsules thinner than this are swept as the box around their segment; sampling a motion in half-radius steps breaks down near zero.
+constexpr float MIN_CAPSULE_RADIUS = 1.0f / 64.0f;
+
+// Upper bound on the samples along one capsule motion. Long motions of thin capsules take bigger steps than half the radius.
+constexpr int MAX_SWEEP_STEPS = 1024;
+
+glm::ivec3 first_voxel(glm::vec3 p) {
+	return glm::ivec3(glm::floor(p));
+}
+
+/* Last voxel touched by a box whose max corner is p; voxels are half open so a max on a boundary stays out. */
+glm::ivec3 last_voxel(glm::vec3 p) {
+	return glm::ivec3(glm::ceil(p)) - 1;
+}
+
+/* Distance from a segment to a box. The point-box distance is convex along the segment, so a ternary search finds its minimum. */
+float segment_box_distance(glm::vec3 a, glm::vec3 b, glm::vec3 box_lo, glm::vec3 box_hi, glm::vec3& on_segment, glm::vec3& on_box) {
+	auto distance_at = [&](float s) {
+		const glm::vec3 p = a + (b - a) * s;
+		return glm::length(p - glm::clamp(p, box_lo, box_hi));
+	};
+
+	float lo = 0.0f;
+	float hi = 1.0f;
+	for (int i = 0; i < SEGMENT_SEARCH_ITERATIONS; i++) {
+		const float m0 = lo + (hi - lo) / 3.0f;
+		const float m1 = hi - (hi - lo) / 3.0f;
+
+		if (distance_at(m0) < distance_at(m1)) {
+			hi = m1;
+		}
+		else {
+			lo = m0;
+		}
+	}
+
+	on_segment = a + (b - a) * ((lo + hi) * 0.5f);
+	on_box = glm::clamp(on_segment, box_lo, box_hi);
+	return glm::length(on_segment - on_box);
+}
+
+/* Finds the solid voxel closest to the capsule's axis, returning true if the capsule overlaps it. */
+bool capsule_overlap(const world& w, glm::vec3 a, glm::vec3 b, float radius, glm::ivec3& voxel, glm::vec3& normal) {
+	const glm::vec3 lo = glm::min(a, b) - radius;
+	const glm::vec3 hi = glm::max(a, b) + radius;
+	float closest = radius;
+	bool overlap = false;
+
+	const glm::vec3 axis = b - a;
+	const float axis_length2 = std::max(glm::dot(axis, axis), 1e-12f);
+
+	for_each_solid(w, first_voxel(lo), last_voxel(hi), [&](glm::ivec3 v) {
+		// Cheap reject: the voxel's bounding sphere against the capsule, before the exact segment-box search.
+		const glm::vec3 center = glm::vec3(v) + 0.5f;
+		const float s = glm::clamp(glm::dot(center - a, axis) / axis_length2, 0.0f, 1.0f);
+		if (glm::length(center - (a + axis * s)) > closest + 0.8660254f) {
+			return;
+		}
+
+		glm::vec3 on_segment;
+		glm::vec3 on_box;
+		const float distance = segment_box_distance(a, b, glm::vec3(v), glm::vec3(v + 1), on_segment, on_box);
+
+		if (distance < closest) {
+			closest = distance;
+			overlap = true;
+			voxel = v;
+			normal = distance > 0.0f ? (on_segment - on_box) / distance : glm::vec3(0.0f);
+		}
+	});
+
+	return overlap;
+}
+
+template<typename Query, typename Fn>
+void sweep_batch(std::span<const Query> queries, std::span<sweep_result> results, job_system& jobs, Fn&& sweep) {
+	const uint32_t job_count = static_cast<uint32_t>((queries.size() + QUERIES_PER_JOB - 1) / QUERIES_PER_JOB);
+
+	jobs.parallel_for(job_count, [&](uint32_t job, unsigned) {
+		const size_t end = std::min(queries.size(), static_cast<size_t>(job + 1) * QUERIES_PER_JOB);
+		for (size_t i = static_cast<size_t>(job) * QUERIES_PER_JOB; i < end; i++) {
+			results[i] = sweep(queries[i]);
+		}
+	});
+}
+
+}
+
+uint32_t count_solid(const world& w, glm::ivec3 lo, glm::ivec3 hi) {
+	lo = glm::max(lo, glm::ivec3(0));
+	hi = glm::min(hi, w.size() - 1);
+
+	if (lo.x > hi.x || lo.y > hi.y || lo.z > hi.z) {
+		return 0;
+	}
+
+	const glm::ivec3 brick_lo = lo >> BRICK_SHIFT;
+	const glm::ivec3 brick_hi = hi >> BRICK_SHIFT;
+
+	// Find the finest pyramid level at which the box spans at most two cells per axis and check those first.
+	int level = 0;
+	while (level + 1 < w.occupancy_levels()) {
+		const glm::ivec3 span = (brick_hi >> level) - (brick_lo >> level);
+		if (span.x <= 1 && span.y <= 1 && span.z <= 1) {
+			break;
+		}
+
+		level++;
+	}
+
+	bool occupied = false;
+	for (int i = 0; i < 8 && !occupied; i++) {
+		const glm::ivec3 corner((i & 1) ? brick_hi.x : brick_lo.x, (i & 2) ? brick_hi.y : brick_lo.y, (i & 4) ? brick_hi.z : brick_lo.z);
+		occupied = w.is_occupied(level, corner >> level);
+	}
+
+	if (!occupied) {
+		return 0;
+	}
+
+	uint32_t count = 0;
+	for (int bz = brick_lo.z; bz <= brick_hi.z; bz++) {
+		for (int by = brick_lo.y; by <= brick_hi.y; by++) {
+			for (int bx = brick_lo.x; bx <= brick_hi.x; bx++) {
+				const glm::ivec3 brick_coord(bx, by, bz);
+				const uint32_t index = w.brick_index(brick_coord);
+				if (index == EMPTY_BRICK) {
+					continue;
+				}
+
+				const glm::ivec3 base = brick_coord * BRICK_SIZE;
+				const glm::ivec3 local_lo = glm::max(lo - base, glm::ivec3(0));
+				const glm::ivec3 local_hi = glm::min(hi - base, glm::ivec3(BRICK_SIZE - 1));
+				const uint64_t mask = brick_slice_mask(local_lo.x, local_hi.x, local_lo.y, local_hi.y);
+
+				for (int z = local_lo.z; z <= local_hi.z; z++) {
+					count += static_cast<uint32_t>(std::popcount(w.occupancy_slice(index, z) & mask));
+				}
+			}
+		}
+	}
+
+	return count;
+}
+
+sweep_result sweep_aabb(const world& w, const aabb_sweep& query) {
+	sweep_result result = { 1.0f, glm::vec3(0.0f), glm::ivec3(-1), false, false };
+
+	const glm::vec3 swept_lo = glm::min(query.min, query.min + query.motion);
+	const glm::vec3 swept_hi = glm::max(query.max, query.max + query.motion);
+	if (count_solid(w, first_voxel(swept_lo), last_voxel(swept_hi)) == 0) {
+		return result;
+	}
+
+	// Sweeping the box against a voxel is a ray from the box center against the voxel grown by the box's half size.
+	const glm::vec3 half = (query.max - query.min) * 0.5f;
+	const glm::vec3 center = (query.min + query.max) * 0.5f;
+
+	for_each_solid(w, first_voxel(swept_lo), last_voxel(swept_hi), [&](glm::ivec3 v) {
+		const glm::vec3 lo = glm::vec3(v) - half;
+		const glm::vec3 hi = glm::vec3(v + 1) + half;
+
+		float t_enter = -std::numeric_limits<float>::infinity();
+		float t_exit = std::numeric_limits<float>::infinity();
+		int axis = -1;
+
+		for (int i = 0; i < 3; i++) {
+			const float d = query.motion[i];
+			if (std::abs(d) < 1e-12f) {
+				if (center[i] <= lo[i] || center[i] >= hi[i]) {
+					return;
+				}
+
+				continue;
+			}
+
+			float t0 = (lo[i] - center[i]) / d;
+			float t1 = (hi[i] - center[i]) / d;
+			if (t0 > t1) {
+				std::swap(t0, t1);
+			}
+
+			if (t0 > t_enter) {
+				t_enter = t0;
+				axis = i;
+			}
+
+			t_exit = std::min(t_exit, t1);
+		}
+
+		if (t_enter >= t_exit || t_exit <= 0.0f || t_enter >= 1.0f) {
+			return;
+		}
+
+		if (t_enter < 0.0f) {
+			result = { 0.0f, glm::vec3(0.0f), v, true, true };
+			return;
+		}
+
+		if (t_enter < result.fraction) {
+			result.fraction = t_enter;
+			result.normal = glm::vec3(0.0f);
+			result.normal[axis] = query.motion[axis] > 0.0f ? -1.0f : 1.0f;
+			result.voxel = v;
+			result.hit = true;
+		}
+	});
+
+	return result;
+}
+
+sweep_result sweep_capsule(const world& w, const capsule_sweep& query) {
+	if (query.radius < MIN_CAPSULE_RADIUS) {
+		return sweep_aabb(w, { glm::min(query.a, query.b), glm::max(query.a, query.b), query.motion });
+	}
+
+	sweep_result result = { 1.0f, glm::vec3(0.0f), glm::ivec3(-1), false, false };
+
+	const glm::vec3 swept_lo = glm::min(glm::min(query.a, query.b), glm::min(query.a, query.b) + query.motion) - query.radius;
+	const glm::vec3 swept_hi = glm::max(glm::max(query.a, query.b), glm::max(query.a, query.b) + query.motion) + query.radius;
+	if (count_solid(w, first_voxel(swept_lo), last_voxel(swept_hi)) == 0) {
+		return result;
+	}
+
+	if (capsule_overlap(w, query.a, query.b, query.radius, result.voxel, result.normal)) {
+		result.fraction = 0.0f;
+		result.hit = true;
+		result.started_inside = true;
+		return result;
+	}
+
+	// Sample the motion in steps of at most half the radius, then bisect the first blocked step. Sample positions come
+	// from the step index rather than a running sum, which stops advancing once the step is below the float spacing.
+	const float distance = glm::length(query.motion);
+	const float step = distance > 0.0f ? std::min(query.radius, 1.0f) * 0.5f / distance : 1.0f;
+	const int steps = static_cast<int>(std::min(std::ceil(1.0f / step), static_cast<float>(MAX_SWEEP_STEPS)));
+	float free = 0.0f;
+
+	for (int i = 1; i <= steps; i++) {
+		float blocked = i == steps ? 1.0f : static_cast<float>(i) / static_cast<float>(steps);
+		glm::ivec3 voxel;
+		glm::vec3 normal;
+
+		if (capsule_overlap(w, query.a + query.motion * blocked, query.b + query.motion * blocked, query.radius, voxel, normal)) {
+			for (int i = 0; i < BISECTION_ITERATIONS; i++) {
+				const float middle = (free + blocked) * 0.5f;
+				if (capsule_overlap(w, query.a + query.motion * middle, query.b + query.motion * middle, query.radius, voxel, normal)) {
+					blocked = middle;
+				}
+				else {
+					free = middle;
+				}
+			}
+
+			capsule_overlap(w, query.a + query.motion * blocked, query.b + query.motion * blocked, query.radius, voxel, normal);
+			result = { free, normal, voxel, true, false };
+			return result;
+		}
+
+		free = blocked;
+	}
+
+	return result;
+}
+
+void sweep_aabbs(const world& w, std::span<const aabb_sweep> queries, std::span<sweep_result> results, job_system& jobs) {
+	sweep_batch(queries, results, jobs, [&](const aabb_sweep& query) { return sweep_aabb(w, query); });
+}
+
+void sweep_capsules(const world& w, std::span<const capsule_sweep> queries, std::span<sweep_result> results, job_system& jobs) {
+	sweep_batch(queries, results, jobs, [&](const capsule_sweep& query) { return sweep_capsule(w, query); });
+}
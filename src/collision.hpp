@@ -0,0 +1,98 @@
+#pragma once
+
+#include "jobs.hpp"
+#include "world.hpp"
+
+#include <glm/glm.hpp>
+
+#include <bit>
+#include <cstdint>
+#include <span>
+
+struct aabb_sweep {
+	glm::vec3 min;
+	glm::vec3 max;
+	glm::vec3 motion;
+};
+
+struct capsule_sweep {
+	glm::vec3 a;
+	glm::vec3 b;
+	float radius;
+	glm::vec3 motion;
+};
+
+struct sweep_result {
+	/* Fraction of the motion that can be travelled before touching a solid voxel, 1 if unobstructed. */
+	float fraction;
+	glm::vec3 normal;
+	glm::ivec3 voxel;
+	bool hit;
+	bool started_inside;
+};
+
+/*
+ * Mask selecting voxels [x0, x1] x [y0, y1] of one brick z slice. The x run
+ * fits in a byte, so multiplying it by a byte-per-row selector copies it into
+ * every selected row without carries.
+ */
+inline uint64_t brick_slice_mask(int x0, int x1, int y0, int y1) {
+	const uint64_t row = ((uint64_t(1) << (x1 - x0 + 1)) - 1) << x0;
+	const uint64_t rows = (0x0101010101010101ull >> (8 * (7 - (y1 - y0)))) << (8 * y0);
+	return row * rows;
+}
+
+/*
+ * Calls fn(voxel) for every solid voxel in the inclusive box [lo, hi], going
+ * brick by brick and walking the set bits of each masked occupancy slice.
+ */
+template<typename F>
+void for_each_solid(const world& w, glm::ivec3 lo, glm::ivec3 hi, F&& fn) {
+	lo = glm::max(lo, glm::ivec3(0));
+	hi = glm::min(hi, w.size() - 1);
+
+	if (lo.x > hi.x || lo.y > hi.y || lo.z > hi.z) {
+		return;
+	}
+
+	const glm::ivec3 brick_lo = lo >> BRICK_SHIFT;
+	const glm::ivec3 brick_hi = hi >> BRICK_SHIFT;
+
+	for (int bz = brick_lo.z; bz <= brick_hi.z; bz++) {
+		for (int by = brick_lo.y; by <= brick_hi.y; by++) {
+			for (int bx = brick_lo.x; bx <= brick_hi.x; bx++) {
+				const glm::ivec3 brick_coord(bx, by, bz);
+				const uint32_t index = w.brick_index(brick_coord);
+				if (index == EMPTY_BRICK) {
+					continue;
+				}
+
+				const glm::ivec3 base = brick_coord * BRICK_SIZE;
+				const glm::ivec3 local_lo = glm::max(lo - base, glm::ivec3(0));
+				const glm::ivec3 local_hi = glm::min(hi - base, glm::ivec3(BRICK_SIZE - 1));
+				const uint64_t mask = brick_slice_mask(local_lo.x, local_hi.x, local_lo.y, local_hi.y);
+
+				for (int z = local_lo.z; z <= local_hi.z; z++) {
+					for (uint64_t bits = w.occupancy_slice(index, z) & mask; bits != 0; bits &= bits - 1) {
+						const int bit = std::countr_zero(bits);
+						fn(base + glm::ivec3(bit & 7, bit >> 3, z));
+					}
+				}
+			}
+		}
+	}
+}
+
+/* Number of solid voxels in the inclusive box [lo, hi]. Checks the occupancy pyramid first. */
+uint32_t count_solid(const world& w, glm::ivec3 lo, glm::ivec3 hi);
+
+sweep_result sweep_aabb(const world& w, const aabb_sweep& query);
+sweep_result sweep_capsule(const world& w, const capsule_sweep& query);
+
+/*
+ * Batched versions for character controllers, spread over the job system.
+ * They read the renderer's bricks directly, so there is no separate physics
+ * copy of the world to keep in sync.
+ */
+void sweep_aabbs(const world& w, std::span<const aabb_sweep> queries, std::span<sweep_result> results, job_system& jobs);
+void sweep_capsules(const world& w, std::span<const capsule_sweep> queries, std::span<sweep_result> results, job_system& jobs);
@@ -0,0 +1,115 @@
+#include "cpu_features.hpp"
+
+#include <spdlog/spdlog.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+namespace {
+
+constexpr cpu_isa ALL_ISAS[] = { cpu_isa::baseline, cpu_isa::sse42, cpu_isa::avx2, cpu_isa::avx512, cpu_isa::neon };
+
+cpu_isa initial_isa() {
+	const cpu_isa detected = detect_cpu_isa();
+
+	const char* forced = std::getenv("VOXEL_ISA");
+	if (!forced) {
+		return detected;
+	}
+
+	cpu_isa isa;
+	if (!parse_cpu_isa(forced, isa) || !cpu_isa_supported(isa)) {
+		spdlog::warn("VOXEL_ISA={} is not supported here, using {}", forced, cpu_isa_name(detected));
+		return detected;
+	}
+
+	return isa;
+}
+
+cpu_isa& current_isa() {
+	static cpu_isa isa = initial_isa();
+	return isa;
+}
+
+}
+
+const char* cpu_isa_name(cpu_isa isa) {
+	switch (isa) {
+	case cpu_isa::sse42: return "sse4.2";
+	case cpu_isa::avx2: return "avx2";
+	case cpu_isa::avx512: return "avx512";
+	case cpu_isa::neon: return "neon";
+	default: return "baseline";
+	}
+}
+
+bool parse_cpu_isa(const char* name, cpu_isa& isa) {
+	for (cpu_isa candidate : ALL_ISAS) {
+		if (std::strcmp(name, cpu_isa_name(candidate)) == 0) {
+			isa = candidate;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+cpu_isa detect_cpu_isa() {
+#if VOXEL_ISA_DISPATCH
+	// __builtin_cpu_supports reads cpuid and also checks that the OS saves the wider registers.
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512bw")
+		&& __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")) {
+		return cpu_isa::avx512;
+	}
+
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2")) {
+		return cpu_isa::avx2;
+	}
+
+	if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt")) {
+		return cpu_isa::sse42;
+	}
+#elif defined(__aarch64__) && defined(__linux__)
+	if (getauxval(AT_HWCAP) & HWCAP_ASIMD) {
+		return cpu_isa::neon;
+	}
+#elif defined(__aarch64__) || defined(_M_ARM64)
+	return cpu_isa::neon;
+#endif
+
+	return cpu_isa::baseline;
+}
+
+bool cpu_isa_supported(cpu_isa isa) {
+	const cpu_isa best = detect_cpu_isa();
+
+	if (isa == cpu_isa::baseline) {
+		return true;
+	}
+
+	if (isa == cpu_isa::neon || best == cpu_isa::neon) {
+		return isa == best;
+	}
+
+	return static_cast<int>(isa) <= static_cast<int>(best);
+}
+
+cpu_isa active_cpu_isa() {
+	return current_isa();
+}
+
+bool set_cpu_isa(cpu_isa isa) {
+	if (!cpu_isa_supported(isa)) {
+		return false;
+	}
+
+	current_isa() = isa;
+	return true;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+/*
+ * Runtime instruction set dispatch for the hot CPU kernels (traversal and
+ * noise). Each kernel is compiled once per variant inside the same
+ * translation unit using per-function target attributes, so no extra
+ * architecture flags are needed and code outside the kernels stays baseline.
+ *
+ * Only GCC and Clang on x86-64 get the SSE4.2, AVX2 and AVX-512 variants. On
+ * AArch64 Advanced SIMD is part of the baseline, so the single build is the
+ * NEON variant. Other targets and MSVC only have the baseline.
+ */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define VOXEL_ISA_DISPATCH 1
+#define VOXEL_TARGET_SSE42 __attribute__((target("sse4.2,popcnt")))
+#define VOXEL_TARGET_AVX2 __attribute__((target("avx2,bmi,bmi2,popcnt,lzcnt")))
+#define VOXEL_TARGET_AVX512 __attribute__((target("avx512f,avx512vl,avx512bw,avx512dq,avx2,bmi,bmi2,popcnt,lzcnt")))
+#else
+#define VOXEL_ISA_DISPATCH 0
+#endif
+
+/* Kernel bodies are force inlined into each variant's entry point so they are compiled for its target. */
+#if defined(__GNUC__) || defined(__clang__)
+#define VOXEL_KERNEL [[gnu::always_inline]] inline
+#elif defined(_MSC_VER)
+#define VOXEL_KERNEL __forceinline
+#else
+#define VOXEL_KERNEL inline
+#endif
+
+enum class cpu_isa {
+	baseline,
+	sse42,
+	avx2,
+	avx512,
+	neon,
+};
+
+const char* cpu_isa_name(cpu_isa isa);
+bool parse_cpu_isa(const char* name, cpu_isa& isa);
+
+/* Best variant both compiled into this binary and supported by the running CPU. */
+cpu_isa detect_cpu_isa();
+
+bool cpu_isa_supported(cpu_isa isa);
+
+/*
+ * Variant used by the kernels. Picked on first use from detect_cpu_isa(),
+ * unless the VOXEL_ISA environment variable names a supported one.
+ */
+cpu_isa active_cpu_isa();
+
+/*
+ * Forces a variant, e.g. to compare them in tests. Returns false and keeps the
+ * current one if it is not supported. Must not be called while kernels run.
+ */
+bool set_cpu_isa(cpu_isa isa);
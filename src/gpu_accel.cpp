@@ -0,0 +1,255 @@
+#include "gpu_accel.hpp"
+#include "world.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+namespace {
+
+constexpr uint32_t CHUNK_VOLUME = ACCEL_CHUNK_BRICKS * ACCEL_CHUNK_BRICKS * ACCEL_CHUNK_BRICKS;
+
+// At least minAccelerationStructureScratchOffsetAlignment on current drivers, so scratch ranges can share a buffer.
+constexpr VkDeviceSize SCRATCH_ALIGNMENT = 256;
+
+VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize alignment) {
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+}
+
+brick_acceleration::brick_acceleration(gpu_context& context, glm::ivec3 grid_size)
+	: m_context(context), m_grid_size(grid_size), m_chunk_counts((grid_size + ACCEL_CHUNK_BRICKS - 1) / ACCEL_CHUNK_BRICKS) {
+	const uint32_t chunk_count = static_cast<uint32_t>(m_chunk_counts.x * m_chunk_counts.y * m_chunk_counts.z);
+	m_chunks.resize(chunk_count);
+	m_dirty_flags.assign(chunk_count, 1);
+	for (uint32_t i = 0; i < chunk_count; i++) {
+		m_dirty.push_back(i);
+	}
+}
+
+brick_acceleration::~brick_acceleration() {
+	collect(std::numeric_limits<uint64_t>::max());
+
+	for (structure& chunk : m_chunks) {
+		destroy(chunk);
+	}
+	destroy(m_tlas);
+}
+
+void brick_acceleration::mark_dirty(glm::ivec3 brick_coord) {
+	const glm::ivec3 chunk = brick_coord / ACCEL_CHUNK_BRICKS;
+	const uint32_t index = static_cast<uint32_t>(chunk.x + m_chunk_counts.x * (chunk.y + m_chunk_counts.y * chunk.z));
+	if (!m_dirty_flags[index]) {
+		m_dirty_flags[index] = 1;
+		m_dirty.push_back(index);
+	}
+}
+
+bool brick_acceleration::build(VkCommandBuffer command_buffer, const std::vector<uint32_t>& cell_slots, uint64_t frame) {
+	if (m_dirty.empty()) {
+		return false;
+	}
+
+	const VkDevice device = m_context.device();
+	const acceleration_functions& functions = m_context.acceleration();
+
+	// Every AABB slot of a chunk exists so that primitive indices stay brick indices; a NaN minimum makes a slot inactive.
+	const uint32_t dirty_count = static_cast<uint32_t>(m_dirty.size());
+	std::vector<VkAccelerationStructureGeometryKHR> geometries(dirty_count);
+	std::vector<VkAccelerationStructureBuildGeometryInfoKHR> build_infos;
+	std::vector<VkDeviceSize> scratch_offsets;
+	std::vector<VkAabbPositionsKHR> aabbs(CHUNK_VOLUME);
+	VkDeviceSize scratch_size = 0;
+
+	for (uint32_t i = 0; i < dirty_count; i++) {
+		const uint32_t index = m_dirty[i];
+		m_dirty_flags[index] = 0;
+		retire(m_chunks[index], frame);
+
+		const glm::ivec3 chunk(index % m_chunk_counts.x, (index / m_chunk_counts.x) % m_chunk_counts.y, index / (m_chunk_counts.x * m_chunk_counts.y));
+		uint32_t occupied = 0;
+		for (uint32_t b = 0; b < CHUNK_VOLUME; b++) {
+			const glm::ivec3 cell = chunk * ACCEL_CHUNK_BRICKS + glm::ivec3(b % ACCEL_CHUNK_BRICKS, (b / ACCEL_CHUNK_BRICKS) % ACCEL_CHUNK_BRICKS, b / (ACCEL_CHUNK_BRICKS * ACCEL_CHUNK_BRICKS));
+			const bool inside = cell.x < m_grid_size.x && cell.y < m_grid_size.y && cell.z < m_grid_size.z;
+			if (!inside || cell_slots[cell.x + m_grid_size.x * (cell.y + static_cast<size_t>(m_grid_size.y) * cell.z)] == EMPTY_BRICK) {
+				aabbs[b] = { std::numeric_limits<float>::quiet_NaN(), 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+				continue;
+			}
+
+			const glm::vec3 min = glm::vec3(cell * BRICK_SIZE);
+			const glm::vec3 max = min + glm::vec3(static_cast<float>(BRICK_SIZE));
+			aabbs[b] = { min.x, min.y, min.z, max.x, max.y, max.z };
+			occupied++;
+		}
+
+		if (occupied == 0) {
+			continue;
+		}
+
+		gpu_buffer input = create_input(aabbs.data(), aabbs.size() * sizeof(VkAabbPositionsKHR));
+		VkAccelerationStructureGeometryKHR& geometry = geometries[build_infos.size()];
+		geometry = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR };
+		geometry.geometryType = VK_GEOMETRY_TYPE_AABBS_KHR;
+		geometry.geometry.aabbs = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_AABBS_DATA_KHR };
+		geometry.geometry.aabbs.data.deviceAddress = m_context.buffer_address(input);
+		geometry.geometry.aabbs.stride = sizeof(VkAabbPositionsKHR);
+		geometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+		retire(input, frame);
+
+		VkAccelerationStructureBuildGeometryInfoKHR build_info = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR };
+		build_info.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+		build_info.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+		build_info.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+		build_info.geometryCount = 1;
+		build_info.pGeometries = &geometry;
+
+		VkAccelerationStructureBuildSizesInfoKHR sizes = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR };
+		functions.get_build_sizes(device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &build_info, &CHUNK_VOLUME, &sizes);
+
+		m_chunks[index] = create_structure(VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, sizes.accelerationStructureSize);
+		build_info.dstAccelerationStructure = m_chunks[index].handle;
+		build_infos.push_back(build_info);
+		scratch_offsets.push_back(scratch_size);
+		scratch_size += align_up(sizes.buildScratchSize, SCRATCH_ALIGNMENT);
+	}
+	m_dirty.clear();
+
+	// The instances are rebuilt from every non-empty chunk, in world space.
+	std::vector<VkAccelerationStructureInstanceKHR> instances;
+	for (uint32_t index = 0; index < m_chunks.size(); index++) {
+		if (m_chunks[index].handle == VK_NULL_HANDLE) {
+			continue;
+		}
+
+		const glm::ivec3 chunk(index % m_chunk_counts.x, (index / m_chunk_counts.x) % m_chunk_counts.y, index / (m_chunk_counts.x * m_chunk_counts.y));
+		VkAccelerationStructureInstanceKHR instance = {};
+		instance.transform.matrix[0][0] = 1.0f;
+		instance.transform.matrix[1][1] = 1.0f;
+		instance.transform.matrix[2][2] = 1.0f;
+		instance.instanceCustomIndex = static_cast<uint32_t>(chunk.x | (chunk.y << 8) | (chunk.z << 16));
+		instance.mask = 0xFF;
+		instance.accelerationStructureReference = m_chunks[index].address;
+		instances.push_back(instance);
+	}
+
+	// An empty TLAS still needs a valid input address.
+	const uint32_t instance_count = static_cast<uint32_t>(instances.size());
+	instances.resize(std::max<size_t>(instances.size(), 1));
+	gpu_buffer instance_input = create_input(instances.data(), instances.size() * sizeof(VkAccelerationStructureInstanceKHR));
+
+	VkAccelerationStructureGeometryKHR tlas_geometry = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR };
+	tlas_geometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+	tlas_geometry.geometry.instances = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR };
+	tlas_geometry.geometry.instances.data.deviceAddress = m_context.buffer_address(instance_input);
+	retire(instance_input, frame);
+
+	VkAccelerationStructureBuildGeometryInfoKHR tlas_info = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR };
+	tlas_info.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+	tlas_info.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+	tlas_info.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+	tlas_info.geometryCount = 1;
+	tlas_info.pGeometries = &tlas_geometry;
+
+	VkAccelerationStructureBuildSizesInfoKHR tlas_sizes = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR };
+	functions.get_build_sizes(device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &tlas_info, &instance_count, &tlas_sizes);
+
+	retire(m_tlas, frame);
+	m_tlas = create_structure(VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR, tlas_sizes.accelerationStructureSize);
+	tlas_info.dstAccelerationStructure = m_tlas.handle;
+	const VkDeviceSize tlas_scratch_offset = scratch_size;
+	scratch_size += align_up(tlas_sizes.buildScratchSize, SCRATCH_ALIGNMENT);
+
+	gpu_buffer scratch = m_context.create_buffer(scratch_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, memory_pool::frame);
+	const VkDeviceAddress scratch_address = m_context.buffer_address(scratch);
+	retire(scratch, frame);
+
+	VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+	barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+
+	// All chunks build in one call, each with its own scratch range; the TLAS reads them, so it waits for the lot.
+	if (!build_infos.empty()) {
+		const VkAccelerationStructureBuildRangeInfoKHR chunk_range = { CHUNK_VOLUME, 0, 0, 0 };
+		std::vector<const VkAccelerationStructureBuildRangeInfoKHR*> ranges(build_infos.size(), &chunk_range);
+		for (size_t i = 0; i < build_infos.size(); i++) {
+			build_infos[i].scratchData.deviceAddress = scratch_address + scratch_offsets[i];
+		}
+
+		functions.cmd_build(command_buffer, static_cast<uint32_t>(build_infos.size()), build_infos.data(), ranges.data());
+		vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0,
+			1, &barrier, 0, nullptr, 0, nullptr);
+	}
+
+	const VkAccelerationStructureBuildRangeInfoKHR tlas_range = { instance_count, 0, 0, 0 };
+	const VkAccelerationStructureBuildRangeInfoKHR* tlas_ranges = &tlas_range;
+	tlas_info.scratchData.deviceAddress = scratch_address + tlas_scratch_offset;
+	functions.cmd_build(command_buffer, 1, &tlas_info, &tlas_ranges);
+
+	vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+	return true;
+}
+
+void brick_acceleration::collect(uint64_t completed_frame) {
+	std::erase_if(m_retired, [&](retired_resource& resource) {
+		if (resource.frame > completed_frame) {
+			return false;
+		}
+
+		destroy(resource.retired);
+		return true;
+	});
+}
+
+brick_acceleration::structure brick_acceleration::create_structure(VkAccelerationStructureTypeKHR type, VkDeviceSize size) {
+	structure s;
+	s.storage = m_context.create_buffer(size, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+	VkAccelerationStructureCreateInfoKHR create_info = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR };
+	create_info.buffer = s.storage.buffer;
+	create_info.size = size;
+	create_info.type = type;
+	vk_check(m_context.acceleration().create(m_context.device(), &create_info, nullptr, &s.handle), "vkCreateAccelerationStructureKHR");
+
+	VkAccelerationStructureDeviceAddressInfoKHR address_info = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR };
+	address_info.accelerationStructure = s.handle;
+	s.address = m_context.acceleration().get_device_address(m_context.device(), &address_info);
+	return s;
+}
+
+/* A host visible build input, written once and read by a build in the frame being recorded. */
+gpu_buffer brick_acceleration::create_input(const void* data, VkDeviceSize size) {
+	gpu_buffer buffer = m_context.create_buffer(size, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, memory_pool::staging);
+	std::memcpy(buffer.mapped, data, size);
+	return buffer;
+}
+
+void brick_acceleration::retire(structure& s, uint64_t frame) {
+	if (s.handle != VK_NULL_HANDLE || s.storage.buffer != VK_NULL_HANDLE) {
+		m_retired.push_back({ frame, s });
+	}
+
+	s = {};
+}
+
+void brick_acceleration::retire(gpu_buffer& buffer, uint64_t frame) {
+	structure s;
+	s.storage = buffer;
+	retire(s, frame);
+	buffer = {};
+}
+
+void brick_acceleration::destroy(structure& s) {
+	if (s.handle != VK_NULL_HANDLE) {
+		m_context.acceleration().destroy(m_context.device(), s.handle, nullptr);
+	}
+
+	if (s.storage.buffer != VK_NULL_HANDLE) {
+		m_context.destroy_buffer(s.storage);
+	}
+
+	s = {};
+}
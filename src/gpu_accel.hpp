@@ -0,0 +1,80 @@
+#pragma once
+
+#include "gpu_context.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+/* Edge of an acceleration structure chunk in bricks; raytrace.comp decodes brick coordinates with the same value. */
+constexpr int ACCEL_CHUNK_BRICKS = 8;
+
+/*
+ * Hardware ray tracing structures over the brick grid, for the ray query path
+ * of raytrace.comp. Every chunk of ACCEL_CHUNK_BRICKS^3 bricks is a bottom
+ * level structure of procedural AABBs, one per brick with the brick's index
+ * in the chunk as its primitive index and empty bricks left inactive. The top
+ * level structure has an instance per non-empty chunk whose custom index is
+ * the chunk's packed coordinate. A query reports the bricks a ray passes
+ * through and the shader runs the in-brick DDA on each of them.
+ *
+ * Edited chunks are rebuilt from scratch together with the TLAS, on the
+ * compute queue, in the command buffer of the frame that first sees the
+ * edit. Replaced structures and the build inputs are destroyed once that
+ * frame has finished.
+ */
+class brick_acceleration {
+public:
+	brick_acceleration(gpu_context& context, glm::ivec3 grid_size);
+	~brick_acceleration();
+
+	brick_acceleration(const brick_acceleration&) = delete;
+	brick_acceleration& operator=(const brick_acceleration&) = delete;
+
+	/* Queues the chunk holding `brick_coord` for a rebuild. */
+	void mark_dirty(glm::ivec3 brick_coord);
+
+	/*
+	 * Records the rebuilds of the dirty chunks and the TLAS into `frame`'s
+	 * command buffer, ending with a barrier for ray queries in compute
+	 * shaders. `cell_slots` is the grid as that frame sees it: a cell is
+	 * occupied unless it is EMPTY_BRICK. Returns false if nothing was dirty.
+	 */
+	bool build(VkCommandBuffer command_buffer, const std::vector<uint32_t>& cell_slots, uint64_t frame);
+
+	/* Destroys what was replaced by frames up to `completed_frame`. */
+	void collect(uint64_t completed_frame);
+
+	VkAccelerationStructureKHR tlas() const { return m_tlas.handle; }
+
+private:
+	struct structure {
+		VkAccelerationStructureKHR handle = VK_NULL_HANDLE;
+		gpu_buffer storage;
+		VkDeviceAddress address = 0;
+	};
+
+	struct retired_resource {
+		uint64_t frame;
+		structure retired;
+	};
+
+	structure create_structure(VkAccelerationStructureTypeKHR type, VkDeviceSize size);
+	gpu_buffer create_input(const void* data, VkDeviceSize size);
+	void retire(structure& s, uint64_t frame);
+	void retire(gpu_buffer& buffer, uint64_t frame);
+	void destroy(structure& s);
+
+	gpu_context& m_context;
+	glm::ivec3 m_grid_size;
+	glm::ivec3 m_chunk_counts;
+
+	// Empty chunks have no structure.
+	std::vector<structure> m_chunks;
+	std::vector<uint32_t> m_dirty;
+	std::vector<uint8_t> m_dirty_flags;
+
+	structure m_tlas;
+	std::vector<retired_resource> m_retired;
+};
@@ -0,0 +1,421 @@
+#include "gpu_context.hpp"
+
+#include <spdlog/spdlog.h>
+#include <vulkan/vk_enum_string_helper.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+// Loaded through vkGetInstanceProcAddr in extensions.cpp.
+VkResult vkCreateDebugUtilsMessengerEXT(VkInstance instance, const VkDebugUtilsMessengerCreateInfoEXT* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkDebugUtilsMessengerEXT* pDebugMessenger);
+void vkDestroyDebugUtilsMessengerEXT(VkInstance instance, VkDebugUtilsMessengerEXT debugMessenger, const VkAllocationCallbacks* pAllocator);
+
+namespace {
+
+constexpr const char* VALIDATION_LAYER = "VK_LAYER_KHRONOS_validation";
+
+VKAPI_ATTR VkBool32 VKAPI_CALL debug_callback(VkDebugUtilsMessageSeverityFlagBitsEXT severity, VkDebugUtilsMessageTypeFlagsEXT, const VkDebugUtilsMessengerCallbackDataEXT* data, void*) {
+	if (severity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT) {
+		spdlog::error("{}", data->pMessage);
+	}
+	else if (severity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT) {
+		spdlog::warn("{}", data->pMessage);
+	}
+	else {
+		spdlog::debug("{}", data->pMessage);
+	}
+
+	return VK_FALSE;
+}
+
+bool has_layer(const char* name) {
+	uint32_t count = 0;
+	vkEnumerateInstanceLayerProperties(&count, nullptr);
+	std::vector<VkLayerProperties> layers(count);
+	vkEnumerateInstanceLayerProperties(&count, layers.data());
+
+	for (const VkLayerProperties& layer : layers) {
+		if (std::strcmp(layer.layerName, name) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* First queue family with compute support, preferring one that also does graphics (the usual "universal" family). */
+bool find_compute_family(VkPhysicalDevice device, uint32_t& family) {
+	uint32_t count = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(device, &count, nullptr);
+	std::vector<VkQueueFamilyProperties> families(count);
+	vkGetPhysicalDeviceQueueFamilyProperties(device, &count, families.data());
+
+	bool found = false;
+	for (uint32_t i = 0; i < count; i++) {
+		if (!(families[i].queueFlags & VK_QUEUE_COMPUTE_BIT)) {
+			continue;
+		}
+
+		if (!found || (families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+			family = i;
+			found = true;
+		}
+
+		if (families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+			break;
+		}
+	}
+
+	return found;
+}
+
+/* A family that can only transfer, which is served by the copy engines rather than the shader cores. */
+bool find_transfer_family(VkPhysicalDevice device, uint32_t& family) {
+	uint32_t count = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(device, &count, nullptr);
+	std::vector<VkQueueFamilyProperties> families(count);
+	vkGetPhysicalDeviceQueueFamilyProperties(device, &count, families.data());
+
+	for (uint32_t i = 0; i < count; i++) {
+		if ((families[i].queueFlags & VK_QUEUE_TRANSFER_BIT) && !(families[i].queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+			family = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool has_device_extension(VkPhysicalDevice device, const char* name) {
+	uint32_t count = 0;
+	vkEnumerateDeviceExtensionProperties(device, nullptr, &count, nullptr);
+	std::vector<VkExtensionProperties> extensions(count);
+	vkEnumerateDeviceExtensionProperties(device, nullptr, &count, extensions.data());
+
+	for (const VkExtensionProperties& extension : extensions) {
+		if (std::strcmp(extension.extensionName, name) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Timeline semaphores, and the descriptor indexing features the renderer's bindless brick pages need. */
+bool supports_required_features(VkPhysicalDevice device) {
+	VkPhysicalDeviceVulkan12Features features12 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES };
+	VkPhysicalDeviceFeatures2 features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2 };
+	features.pNext = &features12;
+	vkGetPhysicalDeviceFeatures2(device, &features);
+	return features12.timelineSemaphore && features12.runtimeDescriptorArray && features12.shaderStorageBufferArrayNonUniformIndexing
+		&& features12.descriptorBindingStorageBufferUpdateAfterBind && features12.descriptorBindingUpdateUnusedWhilePending
+		&& features12.descriptorBindingPartiallyBound && features12.descriptorBindingVariableDescriptorCount;
+}
+
+/* The extensions and features the renderer's ray query path needs, which are optional. */
+bool supports_ray_query(VkPhysicalDevice device) {
+	if (!has_device_extension(device, VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME) || !has_device_extension(device, VK_KHR_RAY_QUERY_EXTENSION_NAME)
+		|| !has_device_extension(device, VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME)) {
+		return false;
+	}
+
+	VkPhysicalDeviceRayQueryFeaturesKHR ray_query = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_QUERY_FEATURES_KHR };
+	VkPhysicalDeviceAccelerationStructureFeaturesKHR acceleration = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR };
+	VkPhysicalDeviceVulkan12Features features12 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES };
+	acceleration.pNext = &ray_query;
+	features12.pNext = &acceleration;
+
+	VkPhysicalDeviceFeatures2 features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2 };
+	features.pNext = &features12;
+	vkGetPhysicalDeviceFeatures2(device, &features);
+	return ray_query.rayQuery && acceleration.accelerationStructure && features12.bufferDeviceAddress;
+}
+
+template<typename F>
+void load_device_function(VkDevice device, const char* name, F& function) {
+	function = reinterpret_cast<F>(vkGetDeviceProcAddr(device, name));
+	if (!function) {
+		vk_check(VK_ERROR_EXTENSION_NOT_PRESENT, name);
+	}
+}
+
+}
+
+void vk_check(VkResult result, const char* what) {
+	if (result != VK_SUCCESS) {
+		spdlog::error("{} failed: {}", what, string_VkResult(result));
+		throw std::runtime_error(what);
+	}
+}
+
+gpu_context::gpu_context(bool validation, bool dedicated_transfer, bool ray_query, bool subgroup_ops) {
+	if (validation && !has_layer(VALIDATION_LAYER)) {
+		spdlog::warn("{} is not installed, continuing without validation", VALIDATION_LAYER);
+		validation = false;
+	}
+
+	VkApplicationInfo app_info = { VK_STRUCTURE_TYPE_APPLICATION_INFO };
+	app_info.pApplicationName = "voxel-raytracer";
+	app_info.applicationVersion = VK_MAKE_VERSION(0, 1, 0);
+	app_info.apiVersion = VK_API_VERSION_1_2;
+
+	std::vector<const char*> extensions;
+	std::vector<const char*> layers;
+	if (validation) {
+		extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+		layers.push_back(VALIDATION_LAYER);
+	}
+
+	VkInstanceCreateInfo instance_info = { VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO };
+	instance_info.pApplicationInfo = &app_info;
+	instance_info.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+	instance_info.ppEnabledExtensionNames = extensions.data();
+	instance_info.enabledLayerCount = static_cast<uint32_t>(layers.size());
+	instance_info.ppEnabledLayerNames = layers.data();
+	vk_check(vkCreateInstance(&instance_info, nullptr, &m_instance), "vkCreateInstance");
+
+	if (validation) {
+		VkDebugUtilsMessengerCreateInfoEXT messenger_info = { VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT };
+		messenger_info.messageSeverity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
+		messenger_info.messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
+		messenger_info.pfnUserCallback = debug_callback;
+		vk_check(vkCreateDebugUtilsMessengerEXT(m_instance, &messenger_info, nullptr, &m_messenger), "vkCreateDebugUtilsMessengerEXT");
+	}
+
+	uint32_t device_count = 0;
+	vkEnumeratePhysicalDevices(m_instance, &device_count, nullptr);
+	std::vector<VkPhysicalDevice> devices(device_count);
+	vkEnumeratePhysicalDevices(m_instance, &device_count, devices.data());
+
+	// Take the first discrete GPU with a compute queue, or any device with one.
+	for (VkPhysicalDevice device : devices) {
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(device, &properties);
+
+		uint32_t family;
+		if (properties.apiVersion < VK_API_VERSION_1_2 || !find_compute_family(device, family) || !supports_required_features(device)) {
+			continue;
+		}
+
+		if (m_physical_device == VK_NULL_HANDLE || properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) {
+			m_physical_device = device;
+			m_properties = properties;
+			m_compute_family = family;
+		}
+
+		if (properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) {
+			break;
+		}
+	}
+
+	if (m_physical_device == VK_NULL_HANDLE) {
+		vk_check(VK_ERROR_INCOMPATIBLE_DRIVER, "Finding a Vulkan 1.2 device with a compute queue, timeline semaphores and descriptor indexing");
+	}
+
+	spdlog::info("Using {}", m_properties.deviceName);
+
+	VkPhysicalDeviceSubgroupProperties subgroup_properties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES };
+	VkPhysicalDeviceVulkan12Properties properties12 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_PROPERTIES };
+	VkPhysicalDeviceProperties2 properties2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2 };
+	properties12.pNext = &subgroup_properties;
+	properties2.pNext = &properties12;
+	vkGetPhysicalDeviceProperties2(m_physical_device, &properties2);
+	m_max_bindless_storage_buffers = std::min(properties12.maxPerStageDescriptorUpdateAfterBindStorageBuffers, properties12.maxDescriptorSetUpdateAfterBindStorageBuffers);
+
+	const VkSubgroupFeatureFlags subgroup_features = VK_SUBGROUP_FEATURE_BASIC_BIT | VK_SUBGROUP_FEATURE_VOTE_BIT | VK_SUBGROUP_FEATURE_BALLOT_BIT | VK_SUBGROUP_FEATURE_SHUFFLE_BIT;
+	const bool has_subgroup_features = (subgroup_properties.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) != 0
+		&& (subgroup_properties.supportedOperations & subgroup_features) == subgroup_features;
+	m_subgroup_ops = subgroup_ops && has_subgroup_features;
+	if (m_subgroup_ops) {
+		spdlog::info("Traversing with subgroup operations, {} lanes", subgroup_properties.subgroupSize);
+	}
+	else {
+		spdlog::info("Traversing without subgroup operations{}", subgroup_ops ? ", the device lacks some" : "");
+	}
+
+	m_transfer_family = m_compute_family;
+	if (dedicated_transfer && find_transfer_family(m_physical_device, m_transfer_family)) {
+		spdlog::info("Uploading through transfer queue family {}", m_transfer_family);
+	}
+	else {
+		spdlog::info("No dedicated transfer queue, uploading through the compute queue");
+	}
+
+	const float priority = 1.0f;
+	VkDeviceQueueCreateInfo queue_infos[2] = {};
+	for (VkDeviceQueueCreateInfo& queue_info : queue_infos) {
+		queue_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+		queue_info.queueCount = 1;
+		queue_info.pQueuePriorities = &priority;
+	}
+	queue_infos[0].queueFamilyIndex = m_compute_family;
+	queue_infos[1].queueFamilyIndex = m_transfer_family;
+
+	VkPhysicalDeviceVulkan12Features features12 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES };
+	features12.timelineSemaphore = VK_TRUE;
+	features12.runtimeDescriptorArray = VK_TRUE;
+	features12.shaderStorageBufferArrayNonUniformIndexing = VK_TRUE;
+	features12.descriptorBindingStorageBufferUpdateAfterBind = VK_TRUE;
+	features12.descriptorBindingUpdateUnusedWhilePending = VK_TRUE;
+	features12.descriptorBindingPartiallyBound = VK_TRUE;
+	features12.descriptorBindingVariableDescriptorCount = VK_TRUE;
+
+	// Without the budget extension the allocator falls back to a fixed share of each heap.
+	std::vector<const char*> device_extensions;
+	const bool memory_budget = has_device_extension(m_physical_device, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+	if (memory_budget) {
+		device_extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+	}
+
+	VkPhysicalDeviceRayQueryFeaturesKHR ray_query_features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_QUERY_FEATURES_KHR };
+	VkPhysicalDeviceAccelerationStructureFeaturesKHR acceleration_features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR };
+	m_ray_query = ray_query && supports_ray_query(m_physical_device);
+	if (m_ray_query) {
+		device_extensions.push_back(VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME);
+		device_extensions.push_back(VK_KHR_RAY_QUERY_EXTENSION_NAME);
+		device_extensions.push_back(VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME);
+
+		ray_query_features.rayQuery = VK_TRUE;
+		acceleration_features.accelerationStructure = VK_TRUE;
+		acceleration_features.pNext = &ray_query_features;
+		features12.bufferDeviceAddress = VK_TRUE;
+		features12.pNext = &acceleration_features;
+		spdlog::info("Tracing with ray queries");
+	}
+	else {
+		spdlog::info("Tracing with the compute DDA{}", ray_query ? ", ray queries are not supported" : "");
+	}
+
+	VkDeviceCreateInfo device_info = { VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO };
+	device_info.pNext = &features12;
+	device_info.enabledExtensionCount = static_cast<uint32_t>(device_extensions.size());
+	device_info.ppEnabledExtensionNames = device_extensions.data();
+	device_info.queueCreateInfoCount = has_dedicated_transfer() ? 2 : 1;
+	device_info.pQueueCreateInfos = queue_infos;
+	vk_check(vkCreateDevice(m_physical_device, &device_info, nullptr, &m_device), "vkCreateDevice");
+
+	vkGetDeviceQueue(m_device, m_compute_family, 0, &m_compute_queue);
+	vkGetDeviceQueue(m_device, m_transfer_family, 0, &m_transfer_queue);
+
+	if (m_ray_query) {
+		load_device_function(m_device, "vkGetAccelerationStructureBuildSizesKHR", m_acceleration.get_build_sizes);
+		load_device_function(m_device, "vkCreateAccelerationStructureKHR", m_acceleration.create);
+		load_device_function(m_device, "vkDestroyAccelerationStructureKHR", m_acceleration.destroy);
+		load_device_function(m_device, "vkCmdBuildAccelerationStructuresKHR", m_acceleration.cmd_build);
+		load_device_function(m_device, "vkGetAccelerationStructureDeviceAddressKHR", m_acceleration.get_device_address);
+	}
+
+	m_allocator = std::make_unique<gpu_allocator>(m_physical_device, m_device, memory_budget, m_ray_query);
+}
+
+gpu_context::~gpu_context() {
+	m_allocator.reset();
+	vkDestroyDevice(m_device, nullptr);
+
+	if (m_messenger != VK_NULL_HANDLE) {
+		vkDestroyDebugUtilsMessengerEXT(m_instance, m_messenger, nullptr);
+	}
+
+	vkDestroyInstance(m_instance, nullptr);
+}
+
+gpu_buffer gpu_context::create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, memory_pool pool) {
+	gpu_buffer buffer;
+	buffer.size = size;
+
+	VkBufferCreateInfo buffer_info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+	buffer_info.size = size;
+	buffer_info.usage = usage;
+	buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	vk_check(vkCreateBuffer(m_device, &buffer_info, nullptr, &buffer.buffer), "vkCreateBuffer");
+
+	VkMemoryRequirements requirements;
+	vkGetBufferMemoryRequirements(m_device, buffer.buffer, &requirements);
+
+	buffer.allocation = m_allocator->allocate(pool, requirements, properties);
+	buffer.mapped = buffer.allocation.mapped;
+	vk_check(vkBindBufferMemory(m_device, buffer.buffer, buffer.allocation.memory, buffer.allocation.offset), "vkBindBufferMemory");
+
+	return buffer;
+}
+
+VkDeviceAddress gpu_context::buffer_address(const gpu_buffer& buffer) const {
+	VkBufferDeviceAddressInfo address_info = { VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO };
+	address_info.buffer = buffer.buffer;
+	return vkGetBufferDeviceAddress(m_device, &address_info);
+}
+
+void gpu_context::destroy_buffer(gpu_buffer& buffer) {
+	vkDestroyBuffer(m_device, buffer.buffer, nullptr);
+	m_allocator->free(buffer.allocation);
+	buffer = {};
+}
+
+gpu_image gpu_context::create_storage_image(uint32_t width, uint32_t height, VkFormat format, memory_pool pool) {
+	gpu_image image;
+	image.extent = { width, height };
+
+	VkImageCreateInfo image_info = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
+	image_info.imageType = VK_IMAGE_TYPE_2D;
+	image_info.format = format;
+	image_info.extent = { width, height, 1 };
+	image_info.mipLevels = 1;
+	image_info.arrayLayers = 1;
+	image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+	image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+	image_info.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+	image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	vk_check(vkCreateImage(m_device, &image_info, nullptr, &image.image), "vkCreateImage");
+
+	VkMemoryRequirements requirements;
+	vkGetImageMemoryRequirements(m_device, image.image, &requirements);
+
+	image.allocation = m_allocator->allocate(pool, requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	vk_check(vkBindImageMemory(m_device, image.image, image.allocation.memory, image.allocation.offset), "vkBindImageMemory");
+
+	VkImageViewCreateInfo view_info = { VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO };
+	view_info.image = image.image;
+	view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+	view_info.format = format;
+	view_info.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+	vk_check(vkCreateImageView(m_device, &view_info, nullptr, &image.view), "vkCreateImageView");
+
+	return image;
+}
+
+void gpu_context::destroy_image(gpu_image& image) {
+	vkDestroyImageView(m_device, image.view, nullptr);
+	vkDestroyImage(m_device, image.image, nullptr);
+	m_allocator->free(image.allocation);
+	image = {};
+}
+
+VkSemaphore gpu_context::create_timeline_semaphore(uint64_t initial_value) {
+	VkSemaphoreTypeCreateInfo type_info = { VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO };
+	type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+	type_info.initialValue = initial_value;
+
+	VkSemaphoreCreateInfo semaphore_info = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO };
+	semaphore_info.pNext = &type_info;
+
+	VkSemaphore semaphore;
+	vk_check(vkCreateSemaphore(m_device, &semaphore_info, nullptr, &semaphore), "vkCreateSemaphore");
+	return semaphore;
+}
+
+void gpu_context::wait_timeline(VkSemaphore semaphore, uint64_t value) const {
+	VkSemaphoreWaitInfo wait_info = { VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO };
+	wait_info.semaphoreCount = 1;
+	wait_info.pSemaphores = &semaphore;
+	wait_info.pValues = &value;
+	vk_check(vkWaitSemaphores(m_device, &wait_info, UINT64_MAX), "vkWaitSemaphores");
+}
+
+uint64_t gpu_context::timeline_value(VkSemaphore semaphore) const {
+	uint64_t value = 0;
+	vk_check(vkGetSemaphoreCounterValue(m_device, semaphore, &value), "vkGetSemaphoreCounterValue");
+	return value;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "gpu_memory.hpp"
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <memory>
+
+/* Logs the failing call and throws. Failures while setting up the device are not recoverable. */
+void vk_check(VkResult result, const char* what);
+
+struct gpu_buffer {
+	VkBuffer buffer = VK_NULL_HANDLE;
+	gpu_allocation allocation;
+	VkDeviceSize size = 0;
+
+	// Persistently mapped for host visible buffers, null otherwise.
+	void* mapped = nullptr;
+};
+
+/* Entry points of VK_KHR_acceleration_structure, which the loader does not export. */
+struct acceleration_functions {
+	PFN_vkGetAccelerationStructureBuildSizesKHR get_build_sizes = nullptr;
+	PFN_vkCreateAccelerationStructureKHR create = nullptr;
+	PFN_vkDestroyAccelerationStructureKHR destroy = nullptr;
+	PFN_vkCmdBuildAccelerationStructuresKHR cmd_build = nullptr;
+	PFN_vkGetAccelerationStructureDeviceAddressKHR get_device_address = nullptr;
+};
+
+struct gpu_image {
+	VkImage image = VK_NULL_HANDLE;
+	gpu_allocation allocation;
+	VkImageView view = VK_NULL_HANDLE;
+	VkExtent2D extent = {};
+};
+
+/*
+ * Vulkan instance, device and the compute queue the renderer submits to.
+ * There is no window: frames are rendered into storage images and read back.
+ * The device is required to support timeline semaphores and the descriptor
+ * indexing features for update-after-bind storage buffer arrays, which are
+ * enabled.
+ *
+ * If the device has a transfer only queue family (the DMA engines on most
+ * discrete GPUs) a queue of it is created for uploads. Otherwise, or with
+ * `dedicated_transfer` off, transfer_queue() is the compute queue.
+ *
+ * With `ray_query` on, acceleration structures, ray queries and buffer device
+ * addresses are enabled if the device has all of them; has_ray_query() says
+ * whether it did. Renderers fall back to their compute paths otherwise.
+ * Likewise has_subgroup_ops() says whether `subgroup_ops` was on and compute
+ * shaders have the basic, vote, ballot and shuffle subgroup operations, which
+ * need nothing enabled.
+ *
+ * Buffers and images are placed in one of the allocator's pools rather than
+ * getting a VkDeviceMemory each.
+ *
+ * With validation enabled the Khronos validation layer is loaded and its
+ * messages are forwarded to spdlog.
+ */
+class gpu_context {
+public:
+	explicit gpu_context(bool validation, bool dedicated_transfer = true, bool ray_query = true, bool subgroup_ops = true);
+	~gpu_context();
+
+	gpu_context(const gpu_context&) = delete;
+	gpu_context& operator=(const gpu_context&) = delete;
+
+	VkInstance instance() const { return m_instance; }
+	VkPhysicalDevice physical_device() const { return m_physical_device; }
+	VkDevice device() const { return m_device; }
+	const VkPhysicalDeviceProperties& properties() const { return m_properties; }
+
+	/* How many storage buffers an update-after-bind descriptor set may hold. */
+	uint32_t max_bindless_storage_buffers() const { return m_max_bindless_storage_buffers; }
+
+	VkQueue compute_queue() const { return m_compute_queue; }
+	uint32_t compute_family() const { return m_compute_family; }
+
+	VkQueue transfer_queue() const { return m_transfer_queue; }
+	uint32_t transfer_family() const { return m_transfer_family; }
+	bool has_dedicated_transfer() const { return m_transfer_family != m_compute_family; }
+
+	gpu_allocator& allocator() { return *m_allocator; }
+
+	bool has_ray_query() const { return m_ray_query; }
+	bool has_subgroup_ops() const { return m_subgroup_ops; }
+
+	/* Loaded only with ray queries enabled. */
+	const acceleration_functions& acceleration() const { return m_acceleration; }
+
+	gpu_buffer create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, memory_pool pool = memory_pool::world);
+	void destroy_buffer(gpu_buffer& buffer);
+
+	/* Needs ray queries enabled, and a buffer created with VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT. */
+	VkDeviceAddress buffer_address(const gpu_buffer& buffer) const;
+
+	gpu_image create_storage_image(uint32_t width, uint32_t height, VkFormat format, memory_pool pool = memory_pool::frame);
+	void destroy_image(gpu_image& image);
+
+	VkSemaphore create_timeline_semaphore(uint64_t initial_value);
+
+	/* Blocks until `semaphore` reaches `value`. */
+	void wait_timeline(VkSemaphore semaphore, uint64_t value) const;
+	uint64_t timeline_value(VkSemaphore semaphore) const;
+
+private:
+	VkInstance m_instance = VK_NULL_HANDLE;
+	VkDebugUtilsMessengerEXT m_messenger = VK_NULL_HANDLE;
+	VkPhysicalDevice m_physical_device = VK_NULL_HANDLE;
+	VkPhysicalDeviceProperties m_properties = {};
+	uint32_t m_max_bindless_storage_buffers = 0;
+	VkDevice m_device = VK_NULL_HANDLE;
+	std::unique_ptr<gpu_allocator> m_allocator;
+
+	bool m_ray_query = false;
+	acceleration_functions m_acceleration;
+	bool m_subgroup_ops = false;
+
+	VkQueue m_compute_queue = VK_NULL_HANDLE;
+	uint32_t m_compute_family = 0;
+
+	VkQueue m_transfer_queue = VK_NULL_HANDLE;
+	uint32_t m_transfer_family = 0;
+};
@@ -0,0 +1,332 @@
+#include "gpu_memory.hpp"
+#include "gpu_context.hpp"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <bit>
+
+namespace {
+
+constexpr VkDeviceSize MIB = 1 << 20;
+
+/* Block size a pool grows by, before clamping to the heap. */
+VkDeviceSize pool_block_size(memory_pool pool) {
+	switch (pool) {
+	case memory_pool::world:
+		return 64 * MIB;
+	case memory_pool::staging:
+	case memory_pool::frame:
+		return 32 * MIB;
+	}
+
+	return 32 * MIB;
+}
+
+double to_mib(VkDeviceSize bytes) {
+	return static_cast<double>(bytes) / static_cast<double>(MIB);
+}
+
+}
+
+buddy_allocator::buddy_allocator(uint64_t size, uint64_t min_block)
+	: m_size(size), m_min_block(min_block) {
+	m_free.resize(static_cast<size_t>(std::countr_zero(size / min_block)) + 1);
+	m_free.back().insert(0);
+}
+
+bool buddy_allocator::allocate(uint64_t size, uint64_t alignment, uint64_t& offset) {
+	const uint64_t needed = std::bit_ceil(std::max({ size, alignment, m_min_block }));
+	if (needed > m_size) {
+		return false;
+	}
+
+	const uint32_t order = static_cast<uint32_t>(std::countr_zero(needed / m_min_block));
+	uint32_t available = order;
+	while (available < m_free.size() && m_free[available].empty()) {
+		available++;
+	}
+
+	if (available == m_free.size()) {
+		return false;
+	}
+
+	offset = *m_free[available].begin();
+	m_free[available].erase(m_free[available].begin());
+
+	// Keep the lower half and free the upper one until the block is the right size.
+	while (available > order) {
+		available--;
+		m_free[available].insert(offset + block_size(available));
+	}
+
+	m_allocated.emplace(offset, order);
+	m_used += block_size(order);
+	return true;
+}
+
+void buddy_allocator::free(uint64_t offset) {
+	const auto it = m_allocated.find(offset);
+	if (it == m_allocated.end()) {
+		return;
+	}
+
+	uint32_t order = it->second;
+	m_allocated.erase(it);
+	m_used -= block_size(order);
+
+	while (order + 1 < m_free.size()) {
+		const auto buddy = m_free[order].find(offset ^ block_size(order));
+		if (buddy == m_free[order].end()) {
+			break;
+		}
+
+		offset = std::min(offset, *buddy);
+		m_free[order].erase(buddy);
+		order++;
+	}
+
+	m_free[order].insert(offset);
+}
+
+uint64_t buddy_allocator::largest_free() const {
+	for (size_t order = m_free.size(); order > 0; order--) {
+		if (!m_free[order - 1].empty()) {
+			return block_size(static_cast<uint32_t>(order - 1));
+		}
+	}
+
+	return 0;
+}
+
+const char* memory_pool_name(memory_pool pool) {
+	switch (pool) {
+	case memory_pool::world:
+		return "world";
+	case memory_pool::staging:
+		return "staging";
+	case memory_pool::frame:
+		return "frame";
+	}
+
+	return "unknown";
+}
+
+gpu_allocator::gpu_allocator(VkPhysicalDevice physical_device, VkDevice device, bool memory_budget, bool device_address)
+	: m_physical_device(physical_device), m_device(device), m_memory_budget(memory_budget), m_device_address(device_address) {
+	vkGetPhysicalDeviceMemoryProperties(m_physical_device, &m_memory_properties);
+	m_heap_allocated.resize(m_memory_properties.memoryHeapCount, 0);
+
+	// Blocks never share a granularity page, so buffers and optimally tiled images can sit side by side.
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(m_physical_device, &properties);
+	m_min_block = std::bit_ceil(std::max<VkDeviceSize>(m_min_block, properties.limits.bufferImageGranularity));
+}
+
+gpu_allocator::~gpu_allocator() {
+	for (uint32_t i = 0; i < m_blocks.size(); i++) {
+		if (m_blocks[i]) {
+			destroy_block(i);
+		}
+	}
+}
+
+uint32_t gpu_allocator::find_memory_type(uint32_t type_bits, VkMemoryPropertyFlags properties) const {
+	for (uint32_t i = 0; i < m_memory_properties.memoryTypeCount; i++) {
+		if ((type_bits & (1u << i)) && (m_memory_properties.memoryTypes[i].propertyFlags & properties) == properties) {
+			return i;
+		}
+	}
+
+	vk_check(VK_ERROR_FEATURE_NOT_PRESENT, "Finding a suitable memory type");
+	return 0;
+}
+
+gpu_allocation gpu_allocator::allocate(memory_pool pool, const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties) {
+	const uint32_t memory_type = find_memory_type(requirements.memoryTypeBits, properties);
+	const uint32_t heap = m_memory_properties.memoryTypes[memory_type].heapIndex;
+
+	std::lock_guard lock(m_mutex);
+
+	const VkDeviceSize heap_size = m_memory_properties.memoryHeaps[heap].size;
+	const VkDeviceSize block_size = std::min(pool_block_size(pool), std::max(std::bit_floor(heap_size / 8), MIB));
+	const VkDeviceSize needed = std::bit_ceil(std::max({ requirements.size, requirements.alignment, m_min_block }));
+
+	gpu_allocation allocation;
+	allocation.size = requirements.size;
+
+	auto take = [&](uint32_t index) {
+		const block& b = *m_blocks[index];
+		allocation.block = index;
+		allocation.memory = b.memory;
+		allocation.mapped = b.mapped ? static_cast<uint8_t*>(b.mapped) + allocation.offset : nullptr;
+	};
+
+	// More than half a block would waste most of it; those get their own memory.
+	if (needed > block_size / 2) {
+		if (!fits_budget(heap, requirements.size)) {
+			vk_check(VK_ERROR_OUT_OF_DEVICE_MEMORY, "Allocating within the heap budget");
+		}
+
+		allocation.offset = 0;
+		take(create_block(pool, memory_type, requirements.size, true));
+		return allocation;
+	}
+
+	for (uint32_t i = 0; i < m_blocks.size(); i++) {
+		block* b = m_blocks[i].get();
+		if (b && b->pool == pool && b->memory_type == memory_type && b->range && b->range->allocate(requirements.size, requirements.alignment, allocation.offset)) {
+			take(i);
+			return allocation;
+		}
+	}
+
+	VkDeviceSize size = block_size;
+	while (size > needed && !fits_budget(heap, size)) {
+		size /= 2;
+	}
+
+	if (!fits_budget(heap, size)) {
+		vk_check(VK_ERROR_OUT_OF_DEVICE_MEMORY, "Growing a memory pool within the heap budget");
+	}
+
+	const uint32_t index = create_block(pool, memory_type, size, false);
+	m_blocks[index]->range->allocate(requirements.size, requirements.alignment, allocation.offset);
+	take(index);
+	return allocation;
+}
+
+void gpu_allocator::free(const gpu_allocation& allocation) {
+	if (allocation.block == UINT32_MAX) {
+		return;
+	}
+
+	std::lock_guard lock(m_mutex);
+
+	block& b = *m_blocks[allocation.block];
+	if (!b.range) {
+		destroy_block(allocation.block);
+		return;
+	}
+
+	b.range->free(allocation.offset);
+	if (b.range->allocation_count() > 0) {
+		return;
+	}
+
+	// Keep one block around per pool and memory type so a pool that drains and refills does not thrash.
+	for (uint32_t i = 0; i < m_blocks.size(); i++) {
+		const block* other = m_blocks[i].get();
+		if (i != allocation.block && other && other->range && other->pool == b.pool && other->memory_type == b.memory_type) {
+			destroy_block(allocation.block);
+			return;
+		}
+	}
+}
+
+memory_pool_stats gpu_allocator::stats(memory_pool pool) const {
+	std::lock_guard lock(m_mutex);
+	memory_pool_stats stats;
+
+	for (const std::unique_ptr<block>& b : m_blocks) {
+		if (!b || b->pool != pool) {
+			continue;
+		}
+
+		stats.blocks++;
+		stats.reserved += b->size;
+		if (b->range) {
+			stats.allocations += b->range->allocation_count();
+			stats.used += b->range->used();
+			stats.largest_free = std::max(stats.largest_free, b->range->largest_free());
+		}
+		else {
+			stats.dedicated_blocks++;
+			stats.allocations++;
+			stats.used += b->size;
+		}
+	}
+
+	return stats;
+}
+
+void gpu_allocator::log_stats() const {
+	for (int i = 0; i < MEMORY_POOL_COUNT; i++) {
+		const memory_pool pool = static_cast<memory_pool>(i);
+		const memory_pool_stats s = stats(pool);
+		spdlog::info("Memory pool {}: {} allocations in {} blocks ({} dedicated), {:.1f} of {:.1f} MiB used, largest free {:.1f} MiB",
+			memory_pool_name(pool), s.allocations, s.blocks, s.dedicated_blocks, to_mib(s.used), to_mib(s.reserved), to_mib(s.largest_free));
+	}
+
+	if (!m_memory_budget) {
+		return;
+	}
+
+	VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT };
+	VkPhysicalDeviceMemoryProperties2 properties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2 };
+	properties.pNext = &budget;
+	vkGetPhysicalDeviceMemoryProperties2(m_physical_device, &properties);
+
+	for (uint32_t heap = 0; heap < m_memory_properties.memoryHeapCount; heap++) {
+		spdlog::info("Memory heap {}: {:.1f} MiB used of a {:.1f} MiB budget", heap, to_mib(budget.heapUsage[heap]), to_mib(budget.heapBudget[heap]));
+	}
+}
+
+bool gpu_allocator::fits_budget(uint32_t heap, VkDeviceSize size) const {
+	if (!m_memory_budget) {
+		return m_heap_allocated[heap] + size <= m_memory_properties.memoryHeaps[heap].size / 10 * 8;
+	}
+
+	// The budget covers every process on the device and changes at run time, so it is queried each time a block is needed.
+	VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT };
+	VkPhysicalDeviceMemoryProperties2 properties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2 };
+	properties.pNext = &budget;
+	vkGetPhysicalDeviceMemoryProperties2(m_physical_device, &properties);
+	return budget.heapUsage[heap] + size <= budget.heapBudget[heap];
+}
+
+uint32_t gpu_allocator::create_block(memory_pool pool, uint32_t memory_type, VkDeviceSize size, bool dedicated) {
+	VkMemoryAllocateInfo allocate_info = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO };
+	allocate_info.allocationSize = size;
+	allocate_info.memoryTypeIndex = memory_type;
+
+	VkMemoryAllocateFlagsInfo flags_info = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO };
+	flags_info.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+	if (m_device_address) {
+		allocate_info.pNext = &flags_info;
+	}
+
+	VkDeviceMemory memory;
+	vk_check(vkAllocateMemory(m_device, &allocate_info, nullptr, &memory), "vkAllocateMemory");
+
+	void* mapped = nullptr;
+	if (m_memory_properties.memoryTypes[memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+		vk_check(vkMapMemory(m_device, memory, 0, VK_WHOLE_SIZE, 0, &mapped), "vkMapMemory");
+	}
+
+	auto b = std::make_unique<block>(block{ pool, memory_type, memory, size, mapped, nullptr });
+	if (!dedicated) {
+		b->range = std::make_unique<buddy_allocator>(size, m_min_block);
+	}
+
+	m_heap_allocated[m_memory_properties.memoryTypes[memory_type].heapIndex] += size;
+	spdlog::debug("Memory pool {} allocated a {:.1f} MiB{} block", memory_pool_name(pool), to_mib(size), dedicated ? " dedicated" : "");
+
+	const auto slot = std::find(m_blocks.begin(), m_blocks.end(), nullptr);
+	if (slot != m_blocks.end()) {
+		*slot = std::move(b);
+		return static_cast<uint32_t>(slot - m_blocks.begin());
+	}
+
+	m_blocks.push_back(std::move(b));
+	return static_cast<uint32_t>(m_blocks.size() - 1);
+}
+
+void gpu_allocator::destroy_block(uint32_t index) {
+	block& b = *m_blocks[index];
+	m_heap_allocated[m_memory_properties.memoryTypes[b.memory_type].heapIndex] -= b.size;
+
+	// Freeing mapped memory unmaps it.
+	vkFreeMemory(m_device, b.memory, nullptr);
+	m_blocks[index].reset();
+}
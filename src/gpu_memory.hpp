@@ -0,0 +1,138 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Power of two buddy allocator over the range [0, size). Blocks are split in
+ * halves down to `min_block`, and a freed block merges with its buddy when
+ * both are free, so the range is one block again once everything is freed.
+ * Every allocation is aligned to its block size.
+ */
+class buddy_allocator {
+public:
+	buddy_allocator(uint64_t size, uint64_t min_block);
+
+	/* Returns false if no free block is large enough. */
+	bool allocate(uint64_t size, uint64_t alignment, uint64_t& offset);
+	void free(uint64_t offset);
+
+	uint64_t size() const { return m_size; }
+
+	/* Bytes handed out, rounded up to block sizes. */
+	uint64_t used() const { return m_used; }
+
+	uint32_t allocation_count() const { return static_cast<uint32_t>(m_allocated.size()); }
+	uint64_t largest_free() const;
+
+private:
+	uint64_t block_size(uint32_t order) const { return m_min_block << order; }
+
+	uint64_t m_size;
+	uint64_t m_min_block;
+	uint64_t m_used = 0;
+
+	// Free block offsets per order, order 0 being min_block; ordered so the lowest address is reused first.
+	std::vector<std::set<uint64_t>> m_free;
+	std::unordered_map<uint64_t, uint32_t> m_allocated;
+};
+
+enum class memory_pool {
+	world,   // long lived device local data: the grid, bricks and palette
+	staging, // host visible upload rings
+	frame,   // per frame images and readback slices
+};
+
+constexpr int MEMORY_POOL_COUNT = 3;
+
+const char* memory_pool_name(memory_pool pool);
+
+/* A piece of a block; `mapped` already includes the offset. */
+struct gpu_allocation {
+	uint32_t block = UINT32_MAX;
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize offset = 0;
+	VkDeviceSize size = 0;
+	void* mapped = nullptr;
+};
+
+struct memory_pool_stats {
+	uint32_t blocks = 0;
+	uint32_t dedicated_blocks = 0;
+	uint32_t allocations = 0;
+
+	// VkDeviceMemory held, and how much of it is handed out.
+	VkDeviceSize reserved = 0;
+	VkDeviceSize used = 0;
+
+	VkDeviceSize largest_free = 0;
+};
+
+/*
+ * Sub-allocates VkDeviceMemory. Each pool takes large blocks per memory type
+ * and carves them up with a buddy_allocator, so a resource only costs a
+ * vkAllocateMemory call when its pool runs out of room; resources larger than
+ * the pool's block size get a dedicated block. Host visible blocks stay
+ * mapped for their lifetime. A pool keeps one empty block per memory type and
+ * releases the others.
+ *
+ * New blocks have to fit the heap budget reported by VK_EXT_memory_budget,
+ * which accounts for other processes, or 80% of the heap without it. A pool
+ * that does not fit tries smaller blocks before giving up.
+ *
+ * With `device_address` every block is allocated so that buffers in it can
+ * have a device address, which acceleration structures need.
+ */
+class gpu_allocator {
+public:
+	gpu_allocator(VkPhysicalDevice physical_device, VkDevice device, bool memory_budget, bool device_address);
+	~gpu_allocator();
+
+	gpu_allocator(const gpu_allocator&) = delete;
+	gpu_allocator& operator=(const gpu_allocator&) = delete;
+
+	/* Throws if no memory type matches or the pool cannot grow within budget. */
+	gpu_allocation allocate(memory_pool pool, const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties);
+	void free(const gpu_allocation& allocation);
+
+	uint32_t find_memory_type(uint32_t type_bits, VkMemoryPropertyFlags properties) const;
+
+	memory_pool_stats stats(memory_pool pool) const;
+
+	/* Logs every pool and the budget of every heap. */
+	void log_stats() const;
+
+private:
+	struct block {
+		memory_pool pool;
+		uint32_t memory_type;
+		VkDeviceMemory memory;
+		VkDeviceSize size;
+		void* mapped;
+
+		// Null for dedicated blocks.
+		std::unique_ptr<buddy_allocator> range;
+	};
+
+	bool fits_budget(uint32_t heap, VkDeviceSize size) const;
+	uint32_t create_block(memory_pool pool, uint32_t memory_type, VkDeviceSize size, bool dedicated);
+	void destroy_block(uint32_t index);
+
+	VkPhysicalDevice m_physical_device;
+	VkDevice m_device;
+	bool m_memory_budget;
+	bool m_device_address;
+	VkPhysicalDeviceMemoryProperties m_memory_properties = {};
+	VkDeviceSize m_min_block = 256;
+
+	// Indices are what gpu_allocation refers to; destroyed blocks leave a null entry for reuse.
+	std::vector<std::unique_ptr<block>> m_blocks;
+	std::vector<VkDeviceSize> m_heap_allocated;
+	mutable std::mutex m_mutex;
+};
@@ -0,0 +1,945 @@
+#include "gpu_renderer.hpp"
+
+#include <glm/glm.hpp>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+// A workgroup covers one 8x8 pixel tile.
+constexpr uint32_t WORKGROUP_SIZE = 8;
+
+// Edge of a dispatch region in tiles: 64x64 pixels.
+constexpr uint32_t REGION_GROUPS = 8;
+
+// Passes of raytrace.comp, and the tile lists every region gets from the classify pass, in list order.
+enum class trace_pass : uint32_t { trace, sky, classify };
+enum class tile_class : uint32_t { sky, simple, complex };
+constexpr uint32_t TILE_CLASS_COUNT = 3;
+constexpr VkFormat OUTPUT_FORMAT = VK_FORMAT_R8G8B8A8_UNORM;
+
+constexpr VkDeviceSize UPLOAD_STAGING_SIZE = 16 << 20;
+
+// Slots kept free for bricks streamed in after the initial upload; pages are added when they run out.
+constexpr uint32_t MIN_SPARE_SLOTS = 256;
+
+// Upper bound on the bindless brick page array, about 3.6 GB of bricks; devices with lower limits get fewer.
+constexpr uint32_t MAX_BRICK_PAGES = 1024;
+
+// Requested bricks uploaded per frame, about 900 KB; the rest are asked for again.
+constexpr uint32_t MAX_RESIDENCY_UPLOADS = 1024;
+
+// Feedback buffer layout, in words; see feedback_buffer in raytrace.comp.
+constexpr uint32_t FEEDBACK_LIST_WORDS = 1 + GPU_FEEDBACK_CAPACITY;
+
+/* Matches frame_constants in raytrace.comp. */
+struct frame_constants {
+	glm::vec4 position;
+	glm::vec4 forward;
+	glm::vec4 right;
+	glm::vec4 up;
+	glm::vec4 sun_direction;
+	glm::ivec4 grid_size;
+	glm::uvec4 tiles;
+};
+
+// Where the list an indirect pass reads is pushed, on its own for every dispatch.
+constexpr uint32_t TILE_LIST_OFFSET = offsetof(frame_constants, tiles) + 2 * sizeof(uint32_t);
+
+/* The build of raytrace.comp for the device: raytrace.comp, or raytrace_ + rq and/or sg + .comp as compiled by CMakeLists.txt. */
+std::string trace_shader_name(bool ray_query, bool subgroup_ops) {
+	if (!ray_query && !subgroup_ops) {
+		return "raytrace.comp";
+	}
+
+	return std::string("raytrace_") + (ray_query ? "rq" : "") + (ray_query && subgroup_ops ? "_" : "") + (subgroup_ops ? "sg" : "") + ".comp";
+}
+
+/* Specialization constants in constant_id order; see the top of raytrace.comp. */
+shader_variant trace_variant(const gpu_trace_features& features, trace_pass pass, bool on_demand) {
+	shader_variant variant;
+	variant.push(BRICK_SIZE);
+	variant.push(static_cast<uint32_t>(std::max(features.max_steps, 1)));
+	variant.push(static_cast<uint32_t>(std::clamp(features.lod_levels, 1, BRICK_LOD_LEVELS)));
+	variant.push(features.shadows ? VK_TRUE : VK_FALSE);
+	variant.push(features.ambient_occlusion ? VK_TRUE : VK_FALSE);
+	variant.push(features.global_illumination ? VK_TRUE : VK_FALSE);
+	variant.push(static_cast<uint32_t>(pass));
+	variant.push(on_demand ? VK_TRUE : VK_FALSE);
+	return variant;
+}
+
+bool is_resident(uint32_t entry) {
+	return entry != EMPTY_BRICK && (entry & GPU_PROXY_BRICK) == 0;
+}
+
+/* The page table entry of a brick that is not resident, colored like its level 3 cell. */
+uint32_t proxy_entry(const world& w, uint32_t index) {
+	const lod_cell& cell = w.get_brick_lod(index).cells[lod_cell_index(BRICK_LOD_LEVELS - 1, glm::ivec3(0))];
+	return GPU_PROXY_BRICK | cell.color.x | (cell.color.y << 8) | (cell.color.z << 16);
+}
+
+glm::ivec3 cell_coord(uint32_t cell, glm::ivec3 grid) {
+	return glm::ivec3(static_cast<int>(cell % grid.x), static_cast<int>(cell / grid.x % grid.y), static_cast<int>(cell / grid.x / grid.y));
+}
+
+/* Writes one brick in the layout raytrace.comp reads. Coarse bricks are expanded from their level 1 cells. */
+void pack_brick(const world& w, uint32_t index, uint32_t* out) {
+	static_assert(BRICK_SIZE == 8 && BRICK_LOD_LEVELS == 4, "the shader's level of detail layout assumes 8x8x8 bricks");
+
+	const brick_lod& lod = w.get_brick_lod(index);
+	uint32_t* lod_words = out + BRICK_SIZE * 2 + BRICK_VOLUME / 4;
+	lod_words[0] = static_cast<uint32_t>(lod.occupancy_l1);
+	lod_words[1] = static_cast<uint32_t>(lod.occupancy_l1 >> 32);
+	lod_words[2] = lod.occupancy_l2;
+	for (size_t i = 0; i < lod.cells.size(); i++) {
+		const lod_cell& cell = lod.cells[i];
+		lod_words[3 + i] = cell.color.x | (cell.color.y << 8) | (cell.color.z << 16) | (static_cast<uint32_t>(cell.material) << 24);
+	}
+
+	for (int z = 0; z < BRICK_SIZE; z++) {
+		const uint64_t slice = w.occupancy_slice(index, z);
+		out[z * 2] = static_cast<uint32_t>(slice);
+		out[z * 2 + 1] = static_cast<uint32_t>(slice >> 32);
+	}
+
+	uint8_t* materials = reinterpret_cast<uint8_t*>(out + BRICK_SIZE * 2);
+	if (!world::is_coarse(index)) {
+		std::memcpy(materials, w.get_brick(index).materials.data(), BRICK_VOLUME);
+		return;
+	}
+
+	for (int i = 0; i < BRICK_VOLUME; i++) {
+		const glm::ivec3 local(i & 7, (i >> 3) & 7, i >> 6);
+		materials[i] = lod.cells[lod_cell_index(1, local >> 1)].material;
+	}
+}
+
+}
+
+gpu_renderer::gpu_renderer(gpu_context& context, pipeline_library& pipelines, const std::filesystem::path& shader_dir, const world& w, int width, int height, job_system& jobs,
+	uint32_t frames_in_flight, uint32_t resident_brick_limit)
+	: m_context(context), m_pipelines(pipelines), m_jobs(jobs), m_world(w), m_width(width), m_height(height), m_grid_size(w.grid_size()),
+	  m_uploader(context, UPLOAD_STAGING_SIZE), m_on_demand(resident_brick_limit > 0), m_frames(std::max(frames_in_flight, 1u)), m_graph(context, static_cast<uint32_t>(m_frames.size())) {
+	const VkDevice device = m_context.device();
+	const uint32_t frame_count = static_cast<uint32_t>(m_frames.size());
+
+	m_tiles_x = (static_cast<uint32_t>(width) + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE;
+	m_tiles_y = (static_cast<uint32_t>(height) + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE;
+	m_regions_x = (m_tiles_x + REGION_GROUPS - 1) / REGION_GROUPS;
+	m_region_count = m_regions_x * ((m_tiles_y + REGION_GROUPS - 1) / REGION_GROUPS);
+
+	const bool ray_query = m_context.has_ray_query();
+	m_trace_shader = trace_shader_name(ray_query, m_context.has_subgroup_ops());
+	if (ray_query) {
+		m_acceleration = std::make_unique<brick_acceleration>(m_context, m_grid_size);
+	}
+
+	const VkDescriptorSetLayoutBinding frame_bindings[] = {
+		{ 0, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr },
+		{ 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr },
+		{ 2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr },
+		{ 3, VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr },
+	};
+
+	// Every storage buffer the pipeline layout binds counts against the compute stage's limit: the grid and the palette
+	// in the world set, and the frame set's tile lists and feedback. The page array gets the rest. On demand, the limit
+	// caps the atlas instead.
+	uint32_t fixed_storage_buffers = 2;
+	for (const VkDescriptorSetLayoutBinding& binding : frame_bindings) {
+		fixed_storage_buffers += binding.descriptorType == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER ? binding.descriptorCount : 0;
+	}
+	if (m_context.max_bindless_storage_buffers() <= fixed_storage_buffers) {
+		throw std::runtime_error("The device cannot bind enough storage buffers for the brick pages");
+	}
+	m_max_brick_pages = std::min(MAX_BRICK_PAGES, m_context.max_bindless_storage_buffers() - fixed_storage_buffers);
+	if (m_on_demand) {
+		m_max_brick_pages = std::min(m_max_brick_pages, (resident_brick_limit + GPU_PAGE_BRICKS - 1) / GPU_PAGE_BRICKS);
+		m_resident_limit = resident_brick_limit;
+	}
+
+	// Only the page array changes after creation, so only it is update-after-bind; unwritten pages are never read.
+	const VkDescriptorSetLayoutBinding world_bindings[] = {
+		{ 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr },
+		{ 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr },
+		{ 2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, m_max_brick_pages, VK_SHADER_STAGE_COMPUTE_BIT, nullptr },
+	};
+	const VkDescriptorBindingFlags world_binding_flags[] = {
+		0,
+		0,
+		VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT | VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT
+			| VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT,
+	};
+
+	VkDescriptorSetLayoutBindingFlagsCreateInfo binding_flags_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO };
+	binding_flags_info.bindingCount = 3;
+	binding_flags_info.pBindingFlags = world_binding_flags;
+
+	VkDescriptorSetLayoutCreateInfo set_layout_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
+	set_layout_info.pNext = &binding_flags_info;
+	set_layout_info.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
+	set_layout_info.bindingCount = 3;
+	set_layout_info.pBindings = world_bindings;
+	vk_check(vkCreateDescriptorSetLayout(device, &set_layout_info, nullptr, &m_world_set_layout), "vkCreateDescriptorSetLayout");
+
+	set_layout_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
+	set_layout_info.bindingCount = ray_query ? 4 : 3;
+	set_layout_info.pBindings = frame_bindings;
+	vk_check(vkCreateDescriptorSetLayout(device, &set_layout_info, nullptr, &m_frame_set_layout), "vkCreateDescriptorSetLayout");
+
+	const VkDescriptorSetLayout set_layouts[] = { m_world_set_layout, m_frame_set_layout };
+	const VkPushConstantRange push_range = { VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(frame_constants) };
+	VkPipelineLayoutCreateInfo layout_info = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
+	layout_info.setLayoutCount = 2;
+	layout_info.pSetLayouts = set_layouts;
+	layout_info.pushConstantRangeCount = 1;
+	layout_info.pPushConstantRanges = &push_range;
+	vk_check(vkCreatePipelineLayout(device, &layout_info, nullptr, &m_pipeline_layout), "vkCreatePipelineLayout");
+
+	m_pipelines.add(m_trace_shader, shader_dir / (m_trace_shader + ".spv"), m_pipeline_layout);
+
+	const VkDescriptorPoolSize pool_sizes[] = {
+		{ VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, frame_count },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2 + m_max_brick_pages + 2 * frame_count },
+		{ VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, frame_count },
+	};
+
+	VkDescriptorPoolCreateInfo pool_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
+	pool_info.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+	pool_info.maxSets = 1 + frame_count;
+	pool_info.poolSizeCount = ray_query ? 3 : 2;
+	pool_info.pPoolSizes = pool_sizes;
+	vk_check(vkCreateDescriptorPool(device, &pool_info, nullptr, &m_descriptor_pool), "vkCreateDescriptorPool");
+
+	VkDescriptorSetVariableDescriptorCountAllocateInfo variable_count_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_VARIABLE_DESCRIPTOR_COUNT_ALLOCATE_INFO };
+	variable_count_info.descriptorSetCount = 1;
+	variable_count_info.pDescriptorCounts = &m_max_brick_pages;
+
+	VkDescriptorSetAllocateInfo set_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+	set_info.pNext = &variable_count_info;
+	set_info.descriptorPool = m_descriptor_pool;
+	set_info.descriptorSetCount = 1;
+	set_info.pSetLayouts = &m_world_set_layout;
+	vk_check(vkAllocateDescriptorSets(device, &set_info, &m_world_set), "vkAllocateDescriptorSets");
+
+	upload_world(w);
+
+	const VkDeviceSize slice_size = static_cast<VkDeviceSize>(width) * height * 4;
+	const uint32_t list_count = m_region_count * TILE_CLASS_COUNT;
+	const VkDeviceSize tile_buffer_size = (static_cast<VkDeviceSize>(list_count) * 3 + static_cast<VkDeviceSize>(list_count) * REGION_GROUPS * REGION_GROUPS) * sizeof(uint32_t);
+	m_staging = m_context.create_buffer(slice_size * frame_count, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, memory_pool::frame);
+
+	// The request list, a request bit per cell and a bit per atlas slot; only the list and the slot bits are read back.
+	// Without residency the shader never writes it, so a word keeps the binding valid.
+	const size_t cell_count = m_cell_slots.size();
+	const VkDeviceSize request_words = (cell_count + 31) / 32;
+	const VkDeviceSize touched_words = static_cast<VkDeviceSize>(m_max_brick_pages) * GPU_PAGE_BRICKS / 32;
+	const VkDeviceSize feedback_size = m_on_demand ? (FEEDBACK_LIST_WORDS + request_words + touched_words) * sizeof(uint32_t) : sizeof(uint32_t);
+	const VkDeviceSize readback_size = m_on_demand ? (FEEDBACK_LIST_WORDS + touched_words) * sizeof(uint32_t) : sizeof(uint32_t);
+	build_graph(tile_buffer_size, feedback_size);
+
+	for (uint32_t f = 0; f < frame_count; f++) {
+		frame_resources& resources = m_frames[f];
+		resources.slot = f;
+		resources.staging_offset = slice_size * f;
+		resources.feedback_readback = m_context.create_buffer(readback_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, memory_pool::frame);
+
+		set_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+		set_info.descriptorPool = m_descriptor_pool;
+		set_info.descriptorSetCount = 1;
+		set_info.pSetLayouts = &m_frame_set_layout;
+		vk_check(vkAllocateDescriptorSets(device, &set_info, &resources.descriptor_set), "vkAllocateDescriptorSets");
+
+		const VkDescriptorImageInfo image_info = { VK_NULL_HANDLE, m_graph.image(m_output, f).view, VK_IMAGE_LAYOUT_GENERAL };
+		const VkDescriptorBufferInfo tiles_info = { m_graph.buffer(m_tiles, f), 0, VK_WHOLE_SIZE };
+		const VkDescriptorBufferInfo feedback_info = { m_graph.buffer(m_feedback, f), 0, VK_WHOLE_SIZE };
+		VkWriteDescriptorSet writes[3] = {};
+		for (uint32_t i = 0; i < 3; i++) {
+			writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			writes[i].dstSet = resources.descriptor_set;
+			writes[i].dstBinding = i;
+			writes[i].descriptorCount = 1;
+			writes[i].descriptorType = frame_bindings[i].descriptorType;
+		}
+		writes[0].pImageInfo = &image_info;
+		writes[1].pBufferInfo = &tiles_info;
+		writes[2].pBufferInfo = &feedback_info;
+		vkUpdateDescriptorSets(device, 3, writes, 0, nullptr);
+
+		// One pool per frame, reset wholesale once the frame has finished instead of resetting buffers one by one.
+		VkCommandPoolCreateInfo command_pool_info = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
+		command_pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+		command_pool_info.queueFamilyIndex = m_context.compute_family();
+		vk_check(vkCreateCommandPool(device, &command_pool_info, nullptr, &resources.command_pool), "vkCreateCommandPool");
+
+		VkCommandBufferAllocateInfo command_buffer_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+		command_buffer_info.commandPool = resources.command_pool;
+		command_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		command_buffer_info.commandBufferCount = 1;
+		vk_check(vkAllocateCommandBuffers(device, &command_buffer_info, &resources.command_buffer), "vkAllocateCommandBuffers");
+
+		// Command pools are externally synchronized, so every recording thread gets its own.
+		resources.recorders.resize(m_jobs.thread_count());
+		for (thread_recorder& recorder : resources.recorders) {
+			vk_check(vkCreateCommandPool(device, &command_pool_info, nullptr, &recorder.pool), "vkCreateCommandPool");
+		}
+	}
+
+	m_run_buffers.resize(m_jobs.thread_count());
+	m_run_results.resize(m_jobs.thread_count());
+
+	m_timeline = m_context.create_timeline_semaphore(0);
+}
+
+gpu_renderer::~gpu_renderer() {
+	const VkDevice device = m_context.device();
+	vkDeviceWaitIdle(device);
+
+	for (frame_resources& resources : m_frames) {
+		for (thread_recorder& recorder : resources.recorders) {
+			vkDestroyCommandPool(device, recorder.pool, nullptr);
+		}
+		vkDestroyCommandPool(device, resources.command_pool, nullptr);
+		m_context.destroy_buffer(resources.feedback_readback);
+	}
+
+	vkDestroySemaphore(device, m_timeline, nullptr);
+	vkDestroyDescriptorPool(device, m_descriptor_pool, nullptr);
+	vkDestroyPipelineLayout(device, m_pipeline_layout, nullptr);
+	vkDestroyDescriptorSetLayout(device, m_frame_set_layout, nullptr);
+	vkDestroyDescriptorSetLayout(device, m_world_set_layout, nullptr);
+
+	m_context.destroy_buffer(m_staging);
+	for (gpu_buffer& page : m_brick_pages) {
+		m_context.destroy_buffer(page);
+	}
+	m_acceleration.reset();
+	m_context.destroy_buffer(m_palette);
+	m_context.destroy_buffer(m_grid);
+}
+
+/*
+ * Declares a frame's passes in recording order. Only the grid patches are
+ * switched on and off per frame; the staging slice and feedback readback are
+ * rebound by render() to the frame's own.
+ */
+void gpu_renderer::build_graph(VkDeviceSize tile_buffer_size, VkDeviceSize feedback_size) {
+	m_output = m_graph.create_image("output", static_cast<uint32_t>(m_width), static_cast<uint32_t>(m_height), OUTPUT_FORMAT,
+		VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
+	m_tiles = m_graph.create_buffer("tiles", tile_buffer_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+	m_feedback = m_graph.create_buffer("feedback", feedback_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+	m_grid_resource = m_graph.import_buffer("grid");
+	m_graph.bind_buffer(m_grid_resource, m_grid.buffer, 0, VK_WHOLE_SIZE);
+	m_staging_slice = m_graph.import_buffer("staging slice");
+	if (m_on_demand) {
+		m_feedback_readback = m_graph.import_buffer("feedback readback");
+	}
+
+	constexpr VkPipelineStageFlags compute = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+	constexpr VkPipelineStageFlags transfer = VK_PIPELINE_STAGE_TRANSFER_BIT;
+
+	m_patch_pass = m_graph.add_pass("grid patches", { { m_grid_resource, transfer, VK_ACCESS_TRANSFER_WRITE_BIT } }, [this](VkCommandBuffer command_buffer) {
+		for (const grid_patch& patch : m_grid_patches) {
+			vkCmdUpdateBuffer(command_buffer, m_grid.buffer, static_cast<VkDeviceSize>(patch.cell) * sizeof(uint32_t), sizeof(uint32_t), &patch.slot);
+		}
+		m_grid_patches.clear();
+	});
+
+	// The counts start at zero; the classify pass fills in the rest of each command it appends to. The feedback's count and bits start at zero too.
+	std::vector<graph_access> clear_accesses = { { m_tiles, transfer, VK_ACCESS_TRANSFER_WRITE_BIT } };
+	if (m_on_demand) {
+		clear_accesses.push_back({ m_feedback, transfer, VK_ACCESS_TRANSFER_WRITE_BIT });
+	}
+	m_graph.add_pass("clear", std::move(clear_accesses), [this](VkCommandBuffer command_buffer) {
+		const uint32_t slot = m_pass_inputs.resources->slot;
+		const VkDeviceSize commands_size = static_cast<VkDeviceSize>(m_region_count) * TILE_CLASS_COUNT * sizeof(VkDispatchIndirectCommand);
+		vkCmdFillBuffer(command_buffer, m_graph.buffer(m_tiles, slot), 0, commands_size, 0);
+		if (m_on_demand) {
+			vkCmdFillBuffer(command_buffer, m_graph.buffer(m_feedback, slot), 0, VK_WHOLE_SIZE, 0);
+		}
+	});
+
+	// Classify only asks the output image for its size, but the image has to be in the layout its descriptor names.
+	m_graph.add_pass("classify",
+		{
+			{ m_grid_resource, compute, VK_ACCESS_SHADER_READ_BIT },
+			{ m_tiles, compute, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT },
+			{ m_output, compute, 0, VK_IMAGE_LAYOUT_GENERAL },
+		},
+		[this](VkCommandBuffer command_buffer) {
+			const VkDescriptorSet sets[] = { m_world_set, m_pass_inputs.resources->descriptor_set };
+			vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_pass_inputs.classify);
+			vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipeline_layout, 0, 2, sets, 0, nullptr);
+			vkCmdPushConstants(command_buffer, m_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, m_pass_inputs.constants_size, m_pass_inputs.constants);
+			vkCmdDispatch(command_buffer, m_tiles_x, m_tiles_y, 1);
+		});
+
+	std::vector<graph_access> trace_accesses = {
+		{ m_grid_resource, compute, VK_ACCESS_SHADER_READ_BIT },
+		{ m_tiles, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | compute, VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT },
+		{ m_output, compute, VK_ACCESS_SHADER_WRITE_BIT, VK_IMAGE_LAYOUT_GENERAL },
+	};
+	if (m_on_demand) {
+		trace_accesses.push_back({ m_feedback, compute, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT });
+	}
+	m_graph.add_pass("trace", std::move(trace_accesses), [this](VkCommandBuffer command_buffer) {
+		record_regions(*m_pass_inputs.resources, m_pass_inputs.trace, m_pass_inputs.sky, m_pass_inputs.constants, m_pass_inputs.constants_size);
+		vkCmdExecuteCommands(command_buffer, m_timings.recording_threads, m_run_buffers.data());
+	});
+
+	std::vector<graph_access> readback_accesses = {
+		{ m_output, transfer, VK_ACCESS_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL },
+		{ m_staging_slice, transfer, VK_ACCESS_TRANSFER_WRITE_BIT },
+	};
+	std::vector<graph_access> host_accesses = { { m_staging_slice, VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT } };
+	if (m_on_demand) {
+		readback_accesses.push_back({ m_feedback, transfer, VK_ACCESS_TRANSFER_READ_BIT });
+		readback_accesses.push_back({ m_feedback_readback, transfer, VK_ACCESS_TRANSFER_WRITE_BIT });
+		host_accesses.push_back({ m_feedback_readback, VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT });
+	}
+	m_graph.add_pass("readback", std::move(readback_accesses), [this](VkCommandBuffer command_buffer) {
+		const frame_resources& resources = *m_pass_inputs.resources;
+		if (m_on_demand) {
+			const uint32_t request_words = static_cast<uint32_t>((m_cell_slots.size() + 31) / 32);
+			const VkBufferCopy feedback_regions[] = {
+				{ 0, 0, FEEDBACK_LIST_WORDS * sizeof(uint32_t) },
+				{ (FEEDBACK_LIST_WORDS + request_words) * sizeof(uint32_t), FEEDBACK_LIST_WORDS * sizeof(uint32_t), resources.touched_words * sizeof(uint32_t) },
+			};
+			vkCmdCopyBuffer(command_buffer, m_graph.buffer(m_feedback, resources.slot), resources.feedback_readback.buffer, resources.touched_words > 0 ? 2 : 1, feedback_regions);
+		}
+
+		VkBufferImageCopy region = {};
+		region.bufferOffset = resources.staging_offset;
+		region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+		region.imageExtent = { static_cast<uint32_t>(m_width), static_cast<uint32_t>(m_height), 1 };
+		vkCmdCopyImageToBuffer(command_buffer, m_graph.image(m_output, resources.slot).image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, m_staging.buffer, 1, &region);
+	});
+
+	// Records nothing; its barrier makes the copies visible to read_back() and process_feedback().
+	m_graph.add_pass("host", std::move(host_accesses), nullptr);
+
+	m_graph.compile();
+}
+
+void gpu_renderer::upload_world(const world& w) {
+	const glm::ivec3 grid = w.grid_size();
+	const size_t cell_count = static_cast<size_t>(grid.x) * grid.y * grid.z;
+
+	// GPU slots are handed out densely in grid order, independent of the world's pool slots. Coarse bricks are expanded like any other.
+	// On demand every occupied cell starts as a proxy and the atlas starts empty.
+	m_cell_slots.assign(cell_count, EMPTY_BRICK);
+	std::vector<uint32_t> brick_words;
+
+	for (int z = 0; z < grid.z; z++) {
+		for (int y = 0; y < grid.y; y++) {
+			for (int x = 0; x < grid.x; x++) {
+				const uint32_t index = w.brick_index(glm::ivec3(x, y, z));
+				if (index == EMPTY_BRICK) {
+					continue;
+				}
+
+				if (m_on_demand) {
+					m_cell_slots[x + grid.x * (y + static_cast<size_t>(grid.y) * z)] = proxy_entry(w, index);
+					continue;
+				}
+
+				const uint32_t slot = static_cast<uint32_t>(brick_words.size() / GPU_BRICK_WORDS);
+				brick_words.resize(brick_words.size() + GPU_BRICK_WORDS);
+				m_cell_slots[x + grid.x * (y + static_cast<size_t>(grid.y) * z)] = slot;
+				pack_brick(w, index, brick_words.data() + static_cast<size_t>(slot) * GPU_BRICK_WORDS);
+			}
+		}
+	}
+
+	// Enough pages for every brick plus some spare slots; streaming adds more as it needs them.
+	const uint32_t brick_count = static_cast<uint32_t>(brick_words.size() / GPU_BRICK_WORDS);
+	while (!m_on_demand && static_cast<uint64_t>(m_brick_pages.size()) * GPU_PAGE_BRICKS < brick_count + MIN_SPARE_SLOTS) {
+		if (!add_brick_page()) {
+			vk_check(VK_ERROR_OUT_OF_DEVICE_MEMORY, "Fitting the world into the bindless brick pages");
+		}
+	}
+
+	const uint32_t capacity = static_cast<uint32_t>(m_brick_pages.size()) * GPU_PAGE_BRICKS;
+	for (uint32_t slot = capacity; slot > brick_count; slot--) {
+		m_free_slots.push_back(slot - 1);
+	}
+
+	for (size_t cell = 0; cell < cell_count; cell++) {
+		if (is_resident(m_cell_slots[cell])) {
+			m_slot_cells[m_cell_slots[cell]] = static_cast<uint32_t>(cell);
+		}
+	}
+	m_residency.resident = brick_count;
+
+	glm::vec4 palette[256];
+	for (int i = 0; i < 256; i++) {
+		palette[i] = glm::vec4(material_color(static_cast<uint8_t>(i)), 1.0f);
+	}
+
+	const VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	m_grid = m_context.create_buffer(cell_count * sizeof(uint32_t), usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	m_palette = m_context.create_buffer(sizeof(palette), usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+	const VkDescriptorBufferInfo buffer_infos[] = {
+		{ m_grid.buffer, 0, VK_WHOLE_SIZE },
+		{ m_palette.buffer, 0, VK_WHOLE_SIZE },
+	};
+
+	VkWriteDescriptorSet writes[2] = {};
+	for (uint32_t i = 0; i < 2; i++) {
+		writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writes[i].dstSet = m_world_set;
+		writes[i].dstBinding = i;
+		writes[i].descriptorCount = 1;
+		writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		writes[i].pBufferInfo = &buffer_infos[i];
+	}
+	vkUpdateDescriptorSets(m_context.device(), 2, writes, 0, nullptr);
+
+	m_uploader.write(m_grid, 0, m_cell_slots.data(), cell_count * sizeof(uint32_t));
+	for (uint32_t first = 0; first < brick_count; first += GPU_PAGE_BRICKS) {
+		const uint32_t count = std::min(brick_count - first, GPU_PAGE_BRICKS);
+		m_uploader.write(m_brick_pages[first / GPU_PAGE_BRICKS], 0, brick_words.data() + static_cast<size_t>(first) * GPU_BRICK_WORDS,
+			static_cast<VkDeviceSize>(count) * GPU_BRICK_WORDS * sizeof(uint32_t));
+	}
+	m_uploader.write(m_palette, 0, palette, sizeof(palette));
+	m_upload_value = m_uploader.flush();
+}
+
+/* Creates the next brick page and writes its element of the page array. Returns false once the array is full. */
+bool gpu_renderer::add_brick_page() {
+	if (m_brick_pages.size() >= m_max_brick_pages) {
+		return false;
+	}
+
+	const VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	m_brick_pages.push_back(m_context.create_buffer(static_cast<VkDeviceSize>(GPU_PAGE_BRICKS) * GPU_BRICK_WORDS * sizeof(uint32_t), usage,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT));
+	m_slot_cells.resize(m_brick_pages.size() * GPU_PAGE_BRICKS, EMPTY_BRICK);
+	m_slot_used.resize(m_brick_pages.size() * GPU_PAGE_BRICKS, 0);
+	m_residency.slots = std::min(static_cast<uint32_t>(m_slot_cells.size()), m_resident_limit);
+
+	// No submitted frame can reach this element yet: the grid only points into it once bricks have been streamed there.
+	const VkDescriptorBufferInfo buffer_info = { m_brick_pages.back().buffer, 0, VK_WHOLE_SIZE };
+	VkWriteDescriptorSet write = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+	write.dstSet = m_world_set;
+	write.dstBinding = 2;
+	write.dstArrayElement = static_cast<uint32_t>(m_brick_pages.size() - 1);
+	write.descriptorCount = 1;
+	write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	write.pBufferInfo = &buffer_info;
+	vkUpdateDescriptorSets(m_context.device(), 1, &write, 0, nullptr);
+	return true;
+}
+
+/* Frees the slots retired by frames that have finished since. */
+void gpu_renderer::reclaim_slots() {
+	std::erase_if(m_retired_slots, [&](const retired_slot& retired) {
+		if (retired.frame > m_completed_frame) {
+			return false;
+		}
+
+		m_free_slots.push_back(retired.slot);
+		return true;
+	});
+}
+
+/* Repoints a page table cell from the next frame on. A slot it pointed at is retired: frames in flight may still read it. */
+void gpu_renderer::set_cell(uint32_t cell, uint32_t entry) {
+	const uint32_t old = m_cell_slots[cell];
+	if (is_resident(old)) {
+		m_retired_slots.push_back({ old, m_frame });
+		m_slot_cells[old] = EMPTY_BRICK;
+		m_residency.resident--;
+	}
+
+	m_cell_slots[cell] = entry;
+	m_grid_patches.push_back({ cell, entry });
+}
+
+/* Writes brick `index` of `w` into a free slot for `cell`, never in place. Returns false when the atlas has no slot left. */
+bool gpu_renderer::upload_brick(const world& w, uint32_t cell, uint32_t index, std::vector<uint32_t>& words) {
+	// The last page may hold more slots than the limit leaves; those are never handed out, so eviction starts at the limit.
+	if (m_free_slots.empty() && add_brick_page()) {
+		const uint32_t first = static_cast<uint32_t>(m_brick_pages.size() - 1) * GPU_PAGE_BRICKS;
+		for (uint32_t page_slot = std::min(first + GPU_PAGE_BRICKS, m_resident_limit); page_slot > first; page_slot--) {
+			m_free_slots.push_back(page_slot - 1);
+		}
+	}
+
+	if (m_free_slots.empty()) {
+		return false;
+	}
+
+	const uint32_t slot = m_free_slots.back();
+	m_free_slots.pop_back();
+	pack_brick(w, index, words.data());
+	m_uploader.write(m_brick_pages[slot / GPU_PAGE_BRICKS], static_cast<VkDeviceSize>(slot % GPU_PAGE_BRICKS) * GPU_BRICK_WORDS * sizeof(uint32_t), words.data(),
+		GPU_BRICK_WORDS * sizeof(uint32_t));
+
+	set_cell(cell, slot);
+	m_slot_cells[slot] = cell;
+	m_slot_used[slot] = m_frame + 1;
+	m_residency.resident++;
+	return true;
+}
+
+uint32_t gpu_renderer::stream_bricks(const world& w, const std::vector<glm::ivec3>& brick_coords) {
+	reclaim_slots();
+
+	std::vector<uint32_t> words(GPU_BRICK_WORDS);
+	uint32_t streamed = 0;
+
+	for (const glm::ivec3& coord : brick_coords) {
+		const uint32_t cell = static_cast<uint32_t>(coord.x + m_grid_size.x * (coord.y + m_grid_size.y * coord.z));
+		const uint32_t index = w.brick_index(coord);
+		if (m_acceleration) {
+			m_acceleration->mark_dirty(coord);
+		}
+
+		// On demand, a brick that is not resident only gets a new proxy; it is uploaded once a ray asks for it.
+		if (index == EMPTY_BRICK || (m_on_demand && !is_resident(m_cell_slots[cell]))) {
+			set_cell(cell, index == EMPTY_BRICK ? EMPTY_BRICK : proxy_entry(w, index));
+			streamed++;
+			continue;
+		}
+
+		if (upload_brick(w, cell, index, words)) {
+			streamed++;
+		}
+		else if (m_on_demand) {
+			// The atlas is full. Drop the stale brick to a proxy and free its slot; feedback asks for the edited one again.
+			set_cell(cell, proxy_entry(w, index));
+			streamed++;
+		}
+	}
+
+	if (streamed < brick_coords.size()) {
+		spdlog::warn("Out of GPU brick pages, {} bricks keep their old contents", brick_coords.size() - streamed);
+	}
+
+	m_upload_value = m_uploader.flush();
+	return streamed;
+}
+
+/*
+ * Reads the feedback of the frame that last used `resources`, which has
+ * finished. The slots it entered count as used by it, and the bricks it asked
+ * for are uploaded, up to MAX_RESIDENCY_UPLOADS. When the atlas is out of
+ * slots, as many bricks as are still missing are evicted for later frames.
+ */
+void gpu_renderer::process_feedback(frame_resources& resources) {
+	if (resources.feedback_frame == 0) {
+		return;
+	}
+
+	const uint64_t feedback_frame = resources.feedback_frame;
+	const uint32_t* data = static_cast<const uint32_t*>(resources.feedback_readback.mapped);
+	resources.feedback_frame = 0;
+
+	const uint32_t* touched = data + FEEDBACK_LIST_WORDS;
+	for (uint32_t word = 0; word < resources.touched_words; word++) {
+		for (uint32_t bits = touched[word]; bits != 0; bits &= bits - 1) {
+			uint64_t& used = m_slot_used[word * 32 + static_cast<uint32_t>(std::countr_zero(bits))];
+			used = std::max(used, feedback_frame);
+		}
+	}
+
+	m_residency.frame = feedback_frame;
+	reclaim_slots();
+
+	std::vector<uint32_t> words(GPU_BRICK_WORDS);
+	const uint32_t requested = std::min(data[0], GPU_FEEDBACK_CAPACITY);
+	uint32_t uploaded = 0;
+	uint32_t missing = 0;
+	for (uint32_t i = 0; i < requested && uploaded < MAX_RESIDENCY_UPLOADS; i++) {
+		// Later frames may have asked for the same brick, or an edit may have removed it since.
+		const uint32_t cell = data[1 + i];
+		if (cell >= m_cell_slots.size() || m_cell_slots[cell] == EMPTY_BRICK || is_resident(m_cell_slots[cell])) {
+			continue;
+		}
+
+		const uint32_t index = m_world.brick_index(cell_coord(cell, m_grid_size));
+		if (index == EMPTY_BRICK) {
+			continue;
+		}
+
+		if (upload_brick(m_world, cell, index, words)) {
+			uploaded++;
+		}
+		else {
+			missing++;
+		}
+	}
+
+	if (missing > 0) {
+		evict_bricks(missing);
+	}
+
+	if (uploaded > 0) {
+		m_upload_value = m_uploader.flush();
+	}
+
+	m_residency.requested = data[0];
+	m_residency.uploaded += uploaded;
+}
+
+/*
+ * Turns up to `count` resident bricks back into proxies, least recently
+ * entered first. Bricks entered by the latest frame with feedback or uploaded
+ * since are kept. Their slots are freed once the frames in flight finish.
+ */
+void gpu_renderer::evict_bricks(uint32_t count) {
+	std::vector<uint32_t> candidates;
+	for (uint32_t slot = 0; slot < m_slot_cells.size(); slot++) {
+		if (m_slot_cells[slot] != EMPTY_BRICK && m_slot_used[slot] < m_residency.frame) {
+			candidates.push_back(slot);
+		}
+	}
+
+	count = std::min(count, static_cast<uint32_t>(candidates.size()));
+	std::partial_sort(candidates.begin(), candidates.begin() + count, candidates.end(), [&](uint32_t a, uint32_t b) {
+		return m_slot_used[a] < m_slot_used[b];
+	});
+
+	for (uint32_t i = 0; i < count; i++) {
+		const uint32_t cell = m_slot_cells[candidates[i]];
+		const uint32_t index = m_world.brick_index(cell_coord(cell, m_grid_size));
+		set_cell(cell, index == EMPTY_BRICK ? EMPTY_BRICK : proxy_entry(m_world, index));
+	}
+
+	m_residency.evicted += count;
+}
+
+void gpu_renderer::wait_for_frame(uint64_t frame) {
+	if (m_completed_frame < frame) {
+		m_context.wait_timeline(m_timeline, frame);
+	}
+
+	m_completed_frame = m_context.timeline_value(m_timeline);
+}
+
+void gpu_renderer::render(const camera& cam, const render_settings& settings, const gpu_trace_features& features) {
+	using clock = std::chrono::steady_clock;
+	auto elapsed_ms = [](clock::time_point from, clock::time_point to) {
+		return std::chrono::duration<double, std::milli>(to - from).count();
+	};
+
+	// Looked up before waiting so a first use compiles while earlier frames are still running.
+	const clock::time_point start = clock::now();
+	const VkPipeline classify_pipeline = m_pipelines.get(m_trace_shader, trace_variant(features, trace_pass::classify, m_on_demand));
+	const VkPipeline trace_pipeline = m_pipelines.get(m_trace_shader, trace_variant(features, trace_pass::trace, m_on_demand));
+	const VkPipeline sky_pipeline = m_pipelines.get(m_trace_shader, trace_variant(features, trace_pass::sky, m_on_demand));
+
+	// The slot's previous frame is the one submitted frames_in_flight() frames ago; this only blocks if that many are still queued.
+	const uint64_t frame = m_frame + 1;
+	const uint32_t frame_count = static_cast<uint32_t>(m_frames.size());
+	frame_resources& resources = m_frames[frame % frame_count];
+	const clock::time_point wait_start = clock::now();
+	wait_for_frame(frame > frame_count ? frame - frame_count : 0);
+	const clock::time_point wait_end = clock::now();
+
+	// The slot's previous frame has finished, so its feedback is ready without waiting on anything else.
+	if (m_on_demand) {
+		process_feedback(resources);
+	}
+
+	const VkCommandBuffer command_buffer = resources.command_buffer;
+	vk_check(vkResetCommandPool(m_context.device(), resources.command_pool, 0), "vkResetCommandPool");
+	for (thread_recorder& recorder : resources.recorders) {
+		vk_check(vkResetCommandPool(m_context.device(), recorder.pool, 0), "vkResetCommandPool");
+		recorder.used = 0;
+	}
+
+	VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+	begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	vk_check(vkBeginCommandBuffer(command_buffer, &begin_info), "vkBeginCommandBuffer");
+
+	// Take over what the transfer queue wrote since the last frame; the graph's first pass points the grid at the new bricks.
+	m_uploader.acquire(command_buffer, m_upload_value);
+
+	// Rebuild the chunks the patches touch from the same cell slots; the first frame builds them all.
+	if (m_acceleration) {
+		m_acceleration->collect(m_completed_frame);
+		m_acceleration->build(command_buffer, m_cell_slots, frame);
+		bind_tlas(resources);
+	}
+
+	// The footprint of one pixel at unit distance, as in render_frame().
+	const float aspect = static_cast<float>(m_width) / static_cast<float>(m_height);
+	const float tan_half_fov = std::tan(cam.fov_y * 0.5f);
+	const float lod_scale = settings.lod_bias * 2.0f * tan_half_fov / static_cast<float>(m_height);
+	const frame_constants constants = {
+		glm::vec4(cam.position, settings.max_distance),
+		glm::vec4(cam.forward, tan_half_fov),
+		glm::vec4(cam.right, aspect),
+		glm::vec4(cam.up, lod_scale),
+		glm::vec4(settings.sun_direction, 0.0f),
+		glm::ivec4(m_grid_size, static_cast<int>(m_frame)),
+		glm::uvec4(m_regions_x, m_region_count, 0, 0),
+	};
+
+	// The request list and the bits of the slots that exist; render() reads them when it next uses this frame's slot.
+	if (m_on_demand) {
+		resources.touched_words = static_cast<uint32_t>(m_slot_cells.size() / 32);
+		resources.feedback_frame = frame;
+		m_graph.bind_buffer(m_feedback_readback, resources.feedback_readback.buffer, 0, VK_WHOLE_SIZE);
+	}
+
+	m_graph.bind_buffer(m_staging_slice, m_staging.buffer, resources.staging_offset, static_cast<VkDeviceSize>(m_width) * m_height * 4);
+	m_graph.set_enabled(m_patch_pass, !m_grid_patches.empty());
+	m_pass_inputs = { &resources, classify_pipeline, trace_pipeline, sky_pipeline, &constants, sizeof(constants) };
+	m_graph.execute(command_buffer, resources.slot);
+	m_pass_inputs = {};
+
+	vk_check(vkEndCommandBuffer(command_buffer), "vkEndCommandBuffer");
+	const clock::time_point record_end = clock::now();
+
+	// Only the dispatch waits for uploads; a value the upload timeline has already passed costs nothing.
+	const VkSemaphore upload_semaphore = m_uploader.timeline();
+	const VkPipelineStageFlags upload_stage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+
+	VkTimelineSemaphoreSubmitInfo timeline_info = { VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO };
+	timeline_info.waitSemaphoreValueCount = 1;
+	timeline_info.pWaitSemaphoreValues = &m_upload_value;
+	timeline_info.signalSemaphoreValueCount = 1;
+	timeline_info.pSignalSemaphoreValues = &frame;
+
+	VkSubmitInfo submit_info = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
+	submit_info.pNext = &timeline_info;
+	submit_info.waitSemaphoreCount = 1;
+	submit_info.pWaitSemaphores = &upload_semaphore;
+	submit_info.pWaitDstStageMask = &upload_stage;
+	submit_info.commandBufferCount = 1;
+	submit_info.pCommandBuffers = &command_buffer;
+	submit_info.signalSemaphoreCount = 1;
+	submit_info.pSignalSemaphores = &m_timeline;
+	vk_check(vkQueueSubmit(m_context.compute_queue(), 1, &submit_info, VK_NULL_HANDLE), "vkQueueSubmit");
+	m_frame = frame;
+
+	m_timings.wait_ms = elapsed_ms(wait_start, wait_end);
+	m_timings.record_ms = elapsed_ms(start, wait_start) + elapsed_ms(wait_end, record_end);
+	m_timings.submit_ms = elapsed_ms(record_end, clock::now());
+}
+
+/* Points the frame's set at the current TLAS. The frame that last used the set has finished, so it can be written in place. */
+void gpu_renderer::bind_tlas(frame_resources& resources) {
+	const VkAccelerationStructureKHR tlas = m_acceleration->tlas();
+	if (resources.bound_tlas == tlas) {
+		return;
+	}
+
+	VkWriteDescriptorSetAccelerationStructureKHR tlas_info = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR };
+	tlas_info.accelerationStructureCount = 1;
+	tlas_info.pAccelerationStructures = &tlas;
+
+	VkWriteDescriptorSet write = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+	write.pNext = &tlas_info;
+	write.dstSet = resources.descriptor_set;
+	write.dstBinding = 3;
+	write.descriptorCount = 1;
+	write.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+	vkUpdateDescriptorSets(m_context.device(), 1, &write, 0, nullptr);
+	resources.bound_tlas = tlas;
+}
+
+/*
+ * Records the indirect trace and sky dispatches of every region, one per
+ * tile list the classify pass fills. The regions are split into one
+ * contiguous run per job thread, each recorded into a secondary command
+ * buffer from that thread's pool; m_run_buffers ends up holding them in image
+ * order.
+ */
+void gpu_renderer::record_regions(frame_resources& resources, VkPipeline trace_pipeline, VkPipeline sky_pipeline, const void* constants, uint32_t constants_size) {
+	const uint32_t run_count = std::min(m_region_count, static_cast<uint32_t>(m_run_buffers.size()));
+
+	m_jobs.parallel_for(run_count, [&](uint32_t run, unsigned thread_index) {
+		thread_recorder& recorder = resources.recorders[thread_index];
+		VkResult& result = m_run_results[run];
+
+		if (recorder.used == recorder.secondaries.size()) {
+			VkCommandBufferAllocateInfo allocate_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+			allocate_info.commandPool = recorder.pool;
+			allocate_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+			allocate_info.commandBufferCount = 1;
+
+			VkCommandBuffer secondary;
+			result = vkAllocateCommandBuffers(m_context.device(), &allocate_info, &secondary);
+			if (result != VK_SUCCESS) {
+				return;
+			}
+			recorder.secondaries.push_back(secondary);
+		}
+
+		const VkCommandBuffer secondary = recorder.secondaries[recorder.used++];
+		m_run_buffers[run] = secondary;
+
+		// Compute work is recorded outside render passes, so there is nothing to inherit.
+		VkCommandBufferInheritanceInfo inheritance = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO };
+		VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+		begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+		begin_info.pInheritanceInfo = &inheritance;
+		result = vkBeginCommandBuffer(secondary, &begin_info);
+		if (result != VK_SUCCESS) {
+			return;
+		}
+
+		// Bound state does not carry over from the primary, so every run sets it up again.
+		const VkDescriptorSet sets[] = { m_world_set, resources.descriptor_set };
+		vkCmdBindDescriptorSets(secondary, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipeline_layout, 0, 2, sets, 0, nullptr);
+		vkCmdPushConstants(secondary, m_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, constants_size, constants);
+
+		const uint32_t first = run * m_region_count / run_count;
+		const uint32_t last = (run + 1) * m_region_count / run_count;
+		auto dispatch_list = [&](uint32_t region, tile_class tiles) {
+			const uint32_t list = region * TILE_CLASS_COUNT + static_cast<uint32_t>(tiles);
+			vkCmdPushConstants(secondary, m_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, TILE_LIST_OFFSET, sizeof(list), &list);
+			vkCmdDispatchIndirect(secondary, m_graph.buffer(m_tiles, resources.slot), static_cast<VkDeviceSize>(list) * sizeof(VkDispatchIndirectCommand));
+		};
+
+		// Empty lists dispatch no workgroups, so sky-only regions cost a few indirect commands and no traversal.
+		vkCmdBindPipeline(secondary, VK_PIPELINE_BIND_POINT_COMPUTE, trace_pipeline);
+		for (uint32_t region = first; region < last; region++) {
+			dispatch_list(region, tile_class::simple);
+			dispatch_list(region, tile_class::complex);
+		}
+
+		vkCmdBindPipeline(secondary, VK_PIPELINE_BIND_POINT_COMPUTE, sky_pipeline);
+		for (uint32_t region = first; region < last; region++) {
+			dispatch_list(region, tile_class::sky);
+		}
+
+		result = vkEndCommandBuffer(secondary);
+	});
+
+	// Vulkan errors are raised here rather than on the job threads.
+	for (uint32_t run = 0; run < run_count; run++) {
+		vk_check(m_run_results[run], "Recording a dispatch region");
+	}
+
+	m_timings.regions = m_region_count;
+	m_timings.recording_threads = run_count;
+}
+
+void gpu_renderer::read_back(framebuffer& target) {
+	target.resize(m_width, m_height);
+	if (m_frame == 0) {
+		return;
+	}
+
+	wait_for_frame(m_frame);
+
+	const frame_resources& resources = m_frames[m_frame % m_frames.size()];
+	std::memcpy(target.pixels.data(), static_cast<const char*>(m_staging.mapped) + resources.staging_offset, target.pixels.size() * sizeof(uint32_t));
+}
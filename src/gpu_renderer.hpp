@@ -0,0 +1,322 @@
+#pragma once
+
+#include "camera.hpp"
+#include "gpu_accel.hpp"
+#include "gpu_context.hpp"
+#include "gpu_uploader.hpp"
+#include "jobs.hpp"
+#include "pipeline_library.hpp"
+#include "raytracer.hpp"
+#include "render_graph.hpp"
+#include "world.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+ * Words per brick in the GPU brick buffer: 8 occupancy slices as word pairs,
+ * 512 material bytes, then the level of detail chain as the level 1 mask
+ * word pair, the level 2 mask and one packed rgb + material word per cell.
+ */
+constexpr uint32_t GPU_LOD_WORDS = 3 + 64 + 8 + 1;
+constexpr uint32_t GPU_BRICK_WORDS = BRICK_SIZE * 2 + BRICK_VOLUME / 4 + GPU_LOD_WORDS;
+
+/* Bricks per GPU brick page buffer; slot s lives in page s / GPU_PAGE_BRICKS. */
+constexpr uint32_t GPU_PAGE_BRICKS = 4096;
+
+/*
+ * Page table entries with this bit set, other than EMPTY_BRICK, are occupied
+ * bricks that are not resident. Their low 24 bits are the brick's level 3
+ * color, which the shader draws as a solid cube until the brick arrives.
+ */
+constexpr uint32_t GPU_PROXY_BRICK = 0x80000000u;
+
+/* Missing bricks one frame's feedback can list; more are asked for again by later frames. */
+constexpr uint32_t GPU_FEEDBACK_CAPACITY = 4096;
+
+/*
+ * Traversal parameters baked into the raytrace.comp pipeline as
+ * specialization constants. Each distinct value is its own pipeline, built
+ * the first time a frame renders with it.
+ */
+struct gpu_trace_features {
+	int max_steps = 512;
+
+	// 1 traces every brick at full resolution.
+	int lod_levels = BRICK_LOD_LEVELS;
+
+	bool shadows = false;
+	bool ambient_occlusion = false;
+	bool global_illumination = false;
+};
+
+/* Where the CPU side of the last frame went. */
+struct gpu_frame_timings {
+	// Blocked on the GPU before the frame's slot could be reused.
+	double wait_ms = 0.0;
+
+	// Pipeline lookup and command recording, the parallel secondary buffers included.
+	double record_ms = 0.0;
+	double submit_ms = 0.0;
+
+	uint32_t regions = 0;
+	uint32_t recording_threads = 0;
+};
+
+/* On demand residency as of the last feedback the renderer read. */
+struct gpu_residency_stats {
+	// The frame the feedback came from, 0 before the first.
+	uint64_t frame = 0;
+
+	// Bricks that frame asked for, and how many are resident in how many atlas slots now.
+	uint32_t requested = 0;
+	uint32_t resident = 0;
+	uint32_t slots = 0;
+
+	uint64_t uploaded = 0;
+	uint64_t evicted = 0;
+};
+
+/*
+ * Ray traces a world on the GPU with the raytrace.comp compute shader. The
+ * brick grid, the bricks and the material palette live in device local
+ * buffers filled through a gpu_uploader; each frame dispatches one
+ * invocation per pixel into a storage image and copies it into a host
+ * visible staging slice for read_back().
+ *
+ * The grid is a page table from brick coordinates to slots in an atlas of
+ * brick pages. Bricks have their own GPU slots, with spare ones for streaming.
+ * stream_bricks() writes changed bricks into free slots on the transfer
+ * queue while frames keep rendering from the old ones; the next frame waits
+ * for the upload, then repoints the grid cells on the compute queue. Old
+ * slots are reused once the frames that could read them have finished.
+ *
+ * Slots are spread over fixed size brick page buffers, all bound through one
+ * bindless descriptor array in the world set that every frame shares. When
+ * streaming runs out of slots a page is added and only its own descriptor is
+ * written, which update-after-bind allows while frames using the set are in
+ * flight; no set or pipeline is rebuilt as the world grows.
+ *
+ * Up to `frames_in_flight` frames are queued at once. Each has its own
+ * command pool, descriptor set, staging slice and feedback readback, so
+ * recording a frame never touches anything the GPU may still be using. Frames
+ * are numbered from 1 and signal their number on a timeline semaphore;
+ * render() only blocks when the frame that last used its slot is still
+ * running.
+ *
+ * A frame's passes (grid patches, clears, classify, trace, readback) are
+ * declared once in a render_graph with the resources each reads and writes,
+ * and the graph records the barriers between them. The output image, the
+ * tile lists and the feedback buffer only live within a frame on the GPU, so
+ * they are graph transients with a copy per frame slot. Frames in flight
+ * never wait for each other's transients.
+ *
+ * Each frame starts with a classify pass that sorts the image's 8x8 pixel
+ * tiles into sky, simple and complex lists per 64x64 pixel region, writing a
+ * VkDispatchIndirectCommand for each list; a tile is sky when none of its
+ * rays reach an occupied brick. The trace pass then runs indirectly over the
+ * simple and complex lists only, and sky tiles are filled by a pass that does
+ * no traversal. The CPU never reads the lists back.
+ *
+ * With a `resident_brick_limit` the world is not uploaded up front. Every
+ * occupied cell starts as a proxy entry and the atlas holds at most that many
+ * bricks, in pages added as needed. Rays that reach a proxy request its brick
+ * in the frame's feedback buffer and rays that enter a resident brick mark its
+ * slot. The feedback is copied into a host visible buffer that render() reads
+ * when it reuses the frame's slot, so it never waits for it. The requested
+ * bricks are uploaded like streamed ones, and when the atlas is full the
+ * bricks no ray has entered for longest go back to being proxies.
+ *
+ * The indirect dispatches are recorded per region in parallel on the job
+ * system: each thread records a contiguous run of regions into a secondary
+ * command buffer from its own pool, and the primary executes them in order.
+ *
+ * When the context has ray queries the trace pass is the raytrace_rq.comp
+ * permutation, which finds bricks through a brick_acceleration TLAS bound in
+ * each frame's set instead of walking the grid; chunks touched by
+ * stream_bricks() are rebuilt at the start of the next frame. The classify
+ * pass and the fallback keep the grid walk.
+ *
+ * Devices with subgroup operations get the _sg builds, where a subgroup
+ * shares grid and brick mask reads between lanes in the same cell or brick,
+ * votes on the level of detail, and compacts the ambient occlusion rays of
+ * the lanes that hit onto every lane of the subgroup.
+ */
+class gpu_renderer {
+public:
+	/* `w` has to outlive the renderer when `resident_brick_limit` is set; missing bricks are read from it. */
+	gpu_renderer(gpu_context& context, pipeline_library& pipelines, const std::filesystem::path& shader_dir, const world& w, int width, int height, job_system& jobs,
+		uint32_t frames_in_flight = 2, uint32_t resident_brick_limit = 0);
+	~gpu_renderer();
+
+	gpu_renderer(const gpu_renderer&) = delete;
+	gpu_renderer& operator=(const gpu_renderer&) = delete;
+
+	void render(const camera& cam, const render_settings& settings, const gpu_trace_features& features = {});
+
+	/*
+	 * Re-uploads the bricks at `brick_coords` after they were edited in `w`. Returns how many were streamed; the rest are out
+	 * of slots. On demand, a resident brick that finds the atlas full becomes a proxy again and counts as streamed.
+	 */
+	uint32_t stream_bricks(const world& w, const std::vector<glm::ivec3>& brick_coords);
+
+	/* The page table entry of the cell at `coord`, as the next frame will see it. */
+	uint32_t cell_entry(glm::ivec3 coord) const {
+		return m_cell_slots[static_cast<size_t>(coord.x) + m_grid_size.x * (coord.y + static_cast<size_t>(m_grid_size.y) * coord.z)];
+	}
+
+	/* Waits for the last submitted frame and copies its pixels out. */
+	void read_back(framebuffer& target);
+
+	uint64_t frame() const { return m_frame; }
+
+	/* The newest frame the GPU has finished, as of the last render() or read_back(). */
+	uint64_t completed_frame() const { return m_completed_frame; }
+
+	uint32_t frames_in_flight() const { return static_cast<uint32_t>(m_frames.size()); }
+
+	const gpu_frame_timings& timings() const { return m_timings; }
+	const gpu_residency_stats& residency() const { return m_residency; }
+
+private:
+	// A recording thread's pool and the secondary buffers allocated from it so far, of which `used` are taken this frame.
+	struct thread_recorder {
+		VkCommandPool pool = VK_NULL_HANDLE;
+		std::vector<VkCommandBuffer> secondaries;
+		uint32_t used = 0;
+	};
+
+	struct frame_resources {
+		std::vector<thread_recorder> recorders;
+		VkCommandPool command_pool = VK_NULL_HANDLE;
+		VkCommandBuffer command_buffer = VK_NULL_HANDLE;
+		VkDescriptorSet descriptor_set = VK_NULL_HANDLE;
+
+		// The TLAS this frame's set points at, rewritten when a build replaces it.
+		VkAccelerationStructureKHR bound_tlas = VK_NULL_HANDLE;
+
+		// Host visible copy of the residency feedback, the frame that wrote it (0 once read) and how many words of slot
+		// bits it copied.
+		gpu_buffer feedback_readback;
+		uint64_t feedback_frame = 0;
+		uint32_t touched_words = 0;
+
+		// Byte offset of this frame's slice of m_staging.
+		VkDeviceSize staging_offset = 0;
+
+		// Index of this frame's copy of the graph transients.
+		uint32_t slot = 0;
+	};
+
+	struct grid_patch {
+		uint32_t cell;
+		uint32_t slot;
+	};
+
+	struct retired_slot {
+		uint32_t slot;
+		uint64_t frame;
+	};
+
+	// What the graph's passes record from, set by render() for the frame it is recording.
+	struct pass_inputs {
+		frame_resources* resources = nullptr;
+		VkPipeline classify = VK_NULL_HANDLE;
+		VkPipeline trace = VK_NULL_HANDLE;
+		VkPipeline sky = VK_NULL_HANDLE;
+		const void* constants = nullptr;
+		uint32_t constants_size = 0;
+	};
+
+	void build_graph(VkDeviceSize tile_buffer_size, VkDeviceSize feedback_size);
+	void upload_world(const world& w);
+	bool add_brick_page();
+	void reclaim_slots();
+	void set_cell(uint32_t cell, uint32_t entry);
+	bool upload_brick(const world& w, uint32_t cell, uint32_t index, std::vector<uint32_t>& words);
+	void process_feedback(frame_resources& resources);
+	void evict_bricks(uint32_t count);
+	void wait_for_frame(uint64_t frame);
+	void bind_tlas(frame_resources& resources);
+	void record_regions(frame_resources& resources, VkPipeline trace_pipeline, VkPipeline sky_pipeline, const void* constants, uint32_t constants_size);
+
+	gpu_context& m_context;
+	pipeline_library& m_pipelines;
+	job_system& m_jobs;
+	const world& m_world;
+	int m_width;
+	int m_height;
+	glm::ivec3 m_grid_size;
+
+	// The image in 8x8 pixel tiles, and in regions of 8x8 tiles.
+	uint32_t m_tiles_x = 0;
+	uint32_t m_tiles_y = 0;
+	uint32_t m_regions_x = 0;
+	uint32_t m_region_count = 0;
+
+	gpu_uploader m_uploader;
+	uint64_t m_upload_value = 0;
+
+	gpu_buffer m_grid;
+	gpu_buffer m_palette;
+	std::vector<gpu_buffer> m_brick_pages;
+	uint32_t m_max_brick_pages = 0;
+	gpu_buffer m_staging;
+
+	// Host copy of the page table: the GPU slot of each cell, EMPTY_BRICK or a proxy entry.
+	std::vector<uint32_t> m_cell_slots;
+
+	// The cell each slot holds or EMPTY_BRICK, and the last frame known to have entered it.
+	std::vector<uint32_t> m_slot_cells;
+	std::vector<uint64_t> m_slot_used;
+
+	// On demand, slots from the resident brick limit on are never handed out.
+	bool m_on_demand = false;
+	uint32_t m_resident_limit = UINT32_MAX;
+	gpu_residency_stats m_residency;
+	std::vector<uint32_t> m_free_slots;
+	std::vector<retired_slot> m_retired_slots;
+
+	// Grid writes for the next frame to apply once it has waited for the bricks they point at.
+	std::vector<grid_patch> m_grid_patches;
+
+	// Null without ray queries; m_trace_shader names the build of raytrace.comp for the paths in use.
+	std::unique_ptr<brick_acceleration> m_acceleration;
+	std::string m_trace_shader;
+
+	// Set 0 holds the world (grid, palette and the brick page array) for every frame, set 1 a frame's output image, tile lists and TLAS.
+	VkDescriptorSetLayout m_world_set_layout = VK_NULL_HANDLE;
+	VkDescriptorSetLayout m_frame_set_layout = VK_NULL_HANDLE;
+	VkPipelineLayout m_pipeline_layout = VK_NULL_HANDLE;
+	VkDescriptorPool m_descriptor_pool = VK_NULL_HANDLE;
+	VkDescriptorSet m_world_set = VK_NULL_HANDLE;
+
+	std::vector<frame_resources> m_frames;
+
+	// The output image, the indirect commands and tile lists of the classify pass and the residency feedback are
+	// transients with a copy per frame slot; the grid, the frame's staging slice and its feedback readback are imported.
+	render_graph m_graph;
+	graph_resource m_output = 0;
+	graph_resource m_tiles = 0;
+	graph_resource m_feedback = 0;
+	graph_resource m_grid_resource = 0;
+	graph_resource m_staging_slice = 0;
+	graph_resource m_feedback_readback = 0;
+	graph_pass m_patch_pass = 0;
+	pass_inputs m_pass_inputs;
+
+	// Signalled with each frame's number when it finishes.
+	VkSemaphore m_timeline = VK_NULL_HANDLE;
+
+	// Secondary buffer of each run of regions, in execution order, and what recording it returned.
+	std::vector<VkCommandBuffer> m_run_buffers;
+	std::vector<VkResult> m_run_results;
+
+	gpu_frame_timings m_timings;
+
+	uint64_t m_frame = 0;
+	uint64_t m_completed_frame = 0;
+};
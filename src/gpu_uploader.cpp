@@ -0,0 +1,216 @@
+#include "gpu_uploader.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+constexpr VkDeviceSize STAGING_ALIGNMENT = 16;
+
+}
+
+gpu_uploader::gpu_uploader(gpu_context& context, VkDeviceSize staging_size)
+	: m_context(context) {
+	staging_size = (std::max(staging_size, STAGING_ALIGNMENT * 2) + STAGING_ALIGNMENT - 1) & ~(STAGING_ALIGNMENT - 1);
+	m_staging = m_context.create_buffer(staging_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		memory_pool::staging);
+
+	VkCommandPoolCreateInfo pool_info = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
+	pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+	pool_info.queueFamilyIndex = m_context.transfer_family();
+	vk_check(vkCreateCommandPool(m_context.device(), &pool_info, nullptr, &m_command_pool), "vkCreateCommandPool");
+
+	m_timeline = m_context.create_timeline_semaphore(0);
+}
+
+gpu_uploader::~gpu_uploader() {
+	if (m_submitted > 0) {
+		m_context.wait_timeline(m_timeline, m_submitted);
+	}
+
+	vkDestroySemaphore(m_context.device(), m_timeline, nullptr);
+	vkDestroyCommandPool(m_context.device(), m_command_pool, nullptr);
+	m_context.destroy_buffer(m_staging);
+}
+
+void gpu_uploader::write(const gpu_buffer& target, VkDeviceSize offset, const void* data, VkDeviceSize size) {
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+
+	// Pieces of at most half the ring always fit once the batches ahead of them have finished.
+	const VkDeviceSize max_piece = m_staging.size / 2;
+
+	while (size > 0) {
+		const VkDeviceSize piece = std::min(size, max_piece);
+
+		VkDeviceSize staging_offset;
+		while (!reserve(piece, staging_offset)) {
+			// The batch being recorded holds ring space too; it has to be submitted before it can be freed.
+			if (m_recording != VK_NULL_HANDLE) {
+				flush();
+			}
+
+			reclaim(true);
+		}
+
+		std::memcpy(static_cast<uint8_t*>(m_staging.mapped) + staging_offset, bytes, piece);
+
+		if (m_recording == VK_NULL_HANDLE) {
+			if (m_free_command_buffers.empty()) {
+				VkCommandBufferAllocateInfo allocate_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+				allocate_info.commandPool = m_command_pool;
+				allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+				allocate_info.commandBufferCount = 1;
+				vk_check(vkAllocateCommandBuffers(m_context.device(), &allocate_info, &m_recording), "vkAllocateCommandBuffers");
+			}
+			else {
+				m_recording = m_free_command_buffers.back();
+				m_free_command_buffers.pop_back();
+			}
+
+			VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+			begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+			vk_check(vkBeginCommandBuffer(m_recording, &begin_info), "vkBeginCommandBuffer");
+		}
+
+		const VkBufferCopy region = { staging_offset, offset, piece };
+		vkCmdCopyBuffer(m_recording, m_staging.buffer, target.buffer, 1, &region);
+
+		if (m_context.has_dedicated_transfer()) {
+			VkBufferMemoryBarrier release = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER };
+			release.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			release.srcQueueFamilyIndex = m_context.transfer_family();
+			release.dstQueueFamilyIndex = m_context.compute_family();
+			release.buffer = target.buffer;
+			release.offset = offset;
+			release.size = piece;
+			m_transfers.push_back(release);
+		}
+
+		m_uploaded_bytes += piece;
+		bytes += piece;
+		offset += piece;
+		size -= piece;
+	}
+}
+
+uint64_t gpu_uploader::flush() {
+	if (m_recording == VK_NULL_HANDLE) {
+		return m_submitted;
+	}
+
+	if (!m_transfers.empty()) {
+		vkCmdPipelineBarrier(m_recording, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr,
+			static_cast<uint32_t>(m_transfers.size()), m_transfers.data(), 0, nullptr);
+	}
+
+	vk_check(vkEndCommandBuffer(m_recording), "vkEndCommandBuffer");
+
+	const uint64_t value = m_submitted + 1;
+	VkTimelineSemaphoreSubmitInfo timeline_info = { VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO };
+	timeline_info.signalSemaphoreValueCount = 1;
+	timeline_info.pSignalSemaphoreValues = &value;
+
+	VkSubmitInfo submit_info = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
+	submit_info.pNext = &timeline_info;
+	submit_info.commandBufferCount = 1;
+	submit_info.pCommandBuffers = &m_recording;
+	submit_info.signalSemaphoreCount = 1;
+	submit_info.pSignalSemaphores = &m_timeline;
+	vk_check(vkQueueSubmit(m_context.transfer_queue(), 1, &submit_info, VK_NULL_HANDLE), "vkQueueSubmit");
+
+	m_batches.push_back({ value, m_recording, m_head, m_batch_bytes });
+	if (!m_transfers.empty()) {
+		m_acquires.push_back({ value, std::move(m_transfers) });
+		m_transfers.clear();
+	}
+
+	m_recording = VK_NULL_HANDLE;
+	m_batch_bytes = 0;
+	m_submitted = value;
+
+	reclaim(false);
+	return value;
+}
+
+void gpu_uploader::acquire(VkCommandBuffer command_buffer, uint64_t value) {
+	std::vector<VkBufferMemoryBarrier> barriers;
+	std::erase_if(m_acquires, [&](const pending_acquire& pending) {
+		if (pending.value > value) {
+			return false;
+		}
+
+		for (VkBufferMemoryBarrier barrier : pending.transfers) {
+			barrier.srcAccessMask = 0;
+			barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+			barriers.push_back(barrier);
+		}
+
+		return true;
+	});
+
+	// The source stage matches the stage the submission waits for the upload semaphore at, which chains the two.
+	if (!barriers.empty()) {
+		vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr,
+			static_cast<uint32_t>(barriers.size()), barriers.data(), 0, nullptr);
+	}
+}
+
+/* Takes `size` contiguous bytes at the head of the ring, skipping to the start if the end is too short. */
+bool gpu_uploader::reserve(VkDeviceSize size, VkDeviceSize& offset) {
+	size = (size + STAGING_ALIGNMENT - 1) & ~(STAGING_ALIGNMENT - 1);
+
+	if (m_used == 0) {
+		m_head = 0;
+		m_tail = 0;
+	}
+	else if (m_head == m_tail) {
+		return false;
+	}
+
+	VkDeviceSize skipped = 0;
+	if (m_head >= m_tail) {
+		if (m_staging.size - m_head >= size) {
+			offset = m_head;
+		}
+		else if (m_tail >= size) {
+			skipped = m_staging.size - m_head;
+			offset = 0;
+		}
+		else {
+			return false;
+		}
+	}
+	else if (m_tail - m_head >= size) {
+		offset = m_head;
+	}
+	else {
+		return false;
+	}
+
+	m_head = offset + size;
+	m_used += skipped + size;
+	m_batch_bytes += skipped + size;
+	return true;
+}
+
+/* Frees the staging space and command buffers of finished batches; with `wait`, blocks for the oldest one first. */
+void gpu_uploader::reclaim(bool wait) {
+	if (m_batches.empty()) {
+		return;
+	}
+
+	if (wait) {
+		m_context.wait_timeline(m_timeline, m_batches.front().value);
+	}
+
+	const uint64_t completed = m_context.timeline_value(m_timeline);
+	size_t finished = 0;
+	for (; finished < m_batches.size() && m_batches[finished].value <= completed; finished++) {
+		const batch& b = m_batches[finished];
+		m_tail = b.staging_end;
+		m_used -= b.staging_bytes;
+		m_free_command_buffers.push_back(b.command_buffer);
+	}
+
+	m_batches.erase(m_batches.begin(), m_batches.begin() + static_cast<std::ptrdiff_t>(finished));
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "gpu_context.hpp"
+
+#include <cstdint>
+#include <vector>
+
+/*
+ * Copies host data into device local buffers on the context's transfer
+ * queue, so streaming uploads run on the copy engines next to the raytrace
+ * dispatches instead of in line with them.
+ *
+ * Data is staged in a host visible ring buffer. flush() submits everything
+ * written since the last flush as one batch, which signals its number on
+ * timeline(). A compute submission that reads the data waits for that value
+ * and, when the transfer queue has its own family, records acquire() first:
+ * every batch releases the ranges it wrote to the compute family, and the
+ * acquire is the other half of that ownership transfer. On devices with a
+ * single queue the same path runs on the compute queue, where the
+ * semaphore alone orders the copies.
+ *
+ * Targets must be ranges the GPU is not reading (fresh buffers or unused
+ * slots); the contents are not preserved across the transfer. Render thread
+ * only.
+ */
+class gpu_uploader {
+public:
+	gpu_uploader(gpu_context& context, VkDeviceSize staging_size);
+	~gpu_uploader();
+
+	gpu_uploader(const gpu_uploader&) = delete;
+	gpu_uploader& operator=(const gpu_uploader&) = delete;
+
+	/* Queues a copy into `target`. Large writes are split; blocks only if the staging ring is full of unfinished batches. */
+	void write(const gpu_buffer& target, VkDeviceSize offset, const void* data, VkDeviceSize size);
+
+	/* Submits the queued copies. Returns the timeline value that signals their completion, or the last one if nothing was queued. */
+	uint64_t flush();
+
+	/* Records the acquiring half of the ownership transfers of batches up to `value` into a compute command buffer. */
+	void acquire(VkCommandBuffer command_buffer, uint64_t value);
+
+	VkSemaphore timeline() const { return m_timeline; }
+
+	/* Bytes copied since creation. */
+	uint64_t uploaded_bytes() const { return m_uploaded_bytes; }
+
+private:
+	struct batch {
+		uint64_t value;
+		VkCommandBuffer command_buffer;
+
+		// Where the ring's tail moves once this batch is done, and how many bytes that frees.
+		VkDeviceSize staging_end;
+		VkDeviceSize staging_bytes;
+	};
+
+	// Release barriers of a submitted batch, replayed as acquires on the compute queue.
+	struct pending_acquire {
+		uint64_t value;
+		std::vector<VkBufferMemoryBarrier> transfers;
+	};
+
+	bool reserve(VkDeviceSize size, VkDeviceSize& offset);
+	void reclaim(bool wait);
+
+	gpu_context& m_context;
+	gpu_buffer m_staging;
+	VkCommandPool m_command_pool = VK_NULL_HANDLE;
+	VkSemaphore m_timeline = VK_NULL_HANDLE;
+
+	// In flight batches, oldest first, and command buffers ready for reuse.
+	std::vector<batch> m_batches;
+	std::vector<VkCommandBuffer> m_free_command_buffers;
+	std::vector<pending_acquire> m_acquires;
+
+	// The batch being written, null until the first write after a flush. Transfers stay empty without a dedicated family.
+	VkCommandBuffer m_recording = VK_NULL_HANDLE;
+	std::vector<VkBufferMemoryBarrier> m_transfers;
+	VkDeviceSize m_batch_bytes = 0;
+
+	VkDeviceSize m_head = 0;
+	VkDeviceSize m_tail = 0;
+	VkDeviceSize m_used = 0;
+
+	uint64_t m_submitted = 0;
+	uint64_t m_uploaded_bytes = 0;
+};
@@ -0,0 +1,326 @@
+#include "instances.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <numeric>
+
+namespace {
+
+constexpr int BIN_COUNT = 16;
+constexpr uint32_t MAX_LEAF_SIZE = 4;
+constexpr uint32_t PARALLEL_BINNING_THRESHOLD = 4096;
+constexpr int STACK_SIZE = 64;
+
+// Traversal keeps at most one pending sibling per level above the node it visits, so nodes this deep are always leaves.
+constexpr uint32_t MAX_DEPTH = STACK_SIZE - 1;
+
+aabb transform_bounds(const glm::mat4& m, glm::vec3 lo, glm::vec3 hi) {
+	aabb bounds;
+	for (int i = 0; i < 8; i++) {
+		const glm::vec3 corner((i & 1) ? hi.x : lo.x, (i & 2) ? hi.y : lo.y, (i & 4) ? hi.z : lo.z);
+		bounds.grow(glm::vec3(m * glm::vec4(corner, 1.0f)));
+	}
+
+	return bounds;
+}
+
+bool intersect_bounds(const aabb& bounds, glm::vec3 origin, glm::vec3 inv_dir, float t_min, float t_max, float& t_near) {
+	const glm::vec3 t0 = (bounds.min - origin) * inv_dir;
+	const glm::vec3 t1 = (bounds.max - origin) * inv_dir;
+	const glm::vec3 lo = glm::min(t0, t1);
+	const glm::vec3 hi = glm::max(t0, t1);
+
+	t_near = std::max(std::max(lo.x, lo.y), std::max(lo.z, t_min));
+	const float t_far = std::min(std::min(hi.x, hi.y), std::min(hi.z, t_max));
+	return t_near <= t_far;
+}
+
+int bin_index(float centroid, float lo, float scale) {
+	return std::min(static_cast<int>((centroid - lo) * scale), BIN_COUNT - 1);
+}
+
+}
+
+uint32_t instance_set::add_model(world&& model) {
+	m_models.push_back(std::make_unique<world>(std::move(model)));
+	return static_cast<uint32_t>(m_models.size() - 1);
+}
+
+uint32_t instance_set::add_instance(uint32_t model, const glm::mat4& to_world) {
+	m_instances.push_back({ model, glm::mat4(1.0f), glm::mat4(1.0f), aabb() });
+	set_transform(static_cast<uint32_t>(m_instances.size() - 1), to_world);
+	return static_cast<uint32_t>(m_instances.size() - 1);
+}
+
+void instance_set::set_transform(uint32_t id, const glm::mat4& to_world) {
+	instance& inst = m_instances[id];
+	inst.to_world = to_world;
+	inst.to_model = glm::inverse(to_world);
+	inst.bounds = transform_bounds(to_world, glm::vec3(0.0f), glm::vec3(m_models[inst.model]->size()));
+	m_needs_refit = true;
+}
+
+void instance_set::build(job_system& jobs) {
+	const uint32_t count = static_cast<uint32_t>(m_instances.size());
+
+	m_order.resize(count);
+	std::iota(m_order.begin(), m_order.end(), 0);
+
+	m_nodes.clear();
+	m_needs_refit = false;
+
+	if (count == 0) {
+		return;
+	}
+
+	// Never reallocates: a binary tree with at most one instance per leaf has 2n - 1 nodes.
+	m_nodes.reserve(2 * static_cast<size_t>(count));
+	m_nodes.push_back({ aabb(), 0, count });
+
+	struct pending_node {
+		uint32_t index;
+		uint32_t depth;
+	};
+
+	std::vector<pending_node> pending = { { 0, 0 } };
+	while (!pending.empty()) {
+		const pending_node node = pending.back();
+		pending.pop_back();
+
+		subdivide(node.index, node.depth, jobs);
+
+		if (m_nodes[node.index].count == 0) {
+			pending.push_back({ m_nodes[node.index].first, node.depth + 1 });
+			pending.push_back({ m_nodes[node.index].first + 1, node.depth + 1 });
+		}
+	}
+}
+
+void instance_set::subdivide(uint32_t node_index, uint32_t depth, job_system& jobs) {
+	const uint32_t first = m_nodes[node_index].first;
+	const uint32_t count = m_nodes[node_index].count;
+
+	// Large nodes are binned in parallel, one chunk of instances per thread, and the partial results merged.
+	const uint32_t chunks = count >= PARALLEL_BINNING_THRESHOLD ? jobs.thread_count() : 1;
+	const uint32_t chunk_size = (count + chunks - 1) / chunks;
+
+	auto for_each_chunk = [&](auto&& fn) {
+		if (chunks == 1) {
+			fn(0u, 0u);
+		}
+		else {
+			jobs.parallel_for(chunks, fn);
+		}
+	};
+
+	std::vector<aabb> chunk_bounds(chunks);
+	std::vector<aabb> chunk_centroids(chunks);
+
+	for_each_chunk([&](uint32_t chunk, unsigned) {
+		const uint32_t end = std::min(count, (chunk + 1) * chunk_size);
+		for (uint32_t i = chunk * chunk_size; i < end; i++) {
+			const aabb& bounds = m_instances[m_order[first + i]].bounds;
+			chunk_bounds[chunk].grow(bounds);
+			chunk_centroids[chunk].grow(bounds.centroid());
+		}
+	});
+
+	aabb bounds;
+	aabb centroids;
+	for (uint32_t chunk = 0; chunk < chunks; chunk++) {
+		bounds.grow(chunk_bounds[chunk]);
+		centroids.grow(chunk_centroids[chunk]);
+	}
+
+	m_nodes[node_index].bounds = bounds;
+
+	const glm::vec3 extent = centroids.max - centroids.min;
+	const int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+	// Past MAX_DEPTH the node stays a leaf, however many instances it holds, so traversal never outgrows its stack.
+	if (count <= 1 || extent[axis] <= 1e-6f || depth >= MAX_DEPTH) {
+		return;
+	}
+
+	const float lo = centroids.min[axis];
+	const float scale = static_cast<float>(BIN_COUNT) / extent[axis];
+
+	std::vector<std::array<bin, BIN_COUNT>> chunk_bins(chunks);
+	for_each_chunk([&](uint32_t chunk, unsigned) {
+		const uint32_t end = std::min(count, (chunk + 1) * chunk_size);
+		for (uint32_t i = chunk * chunk_size; i < end; i++) {
+			const aabb& instance_bounds = m_instances[m_order[first + i]].bounds;
+			bin& b = chunk_bins[chunk][bin_index(instance_bounds.centroid()[axis], lo, scale)];
+			b.bounds.grow(instance_bounds);
+			b.count++;
+		}
+	});
+
+	std::array<bin, BIN_COUNT> bins;
+	for (uint32_t chunk = 0; chunk < chunks; chunk++) {
+		for (int i = 0; i < BIN_COUNT; i++) {
+			bins[i].bounds.grow(chunk_bins[chunk][i].bounds);
+			bins[i].count += chunk_bins[chunk][i].count;
+		}
+	}
+
+	// Sweep from both sides to get the SAH cost of splitting after each bin.
+	std::array<float, BIN_COUNT - 1> right_cost;
+	aabb right;
+	uint32_t right_count = 0;
+	for (int i = BIN_COUNT - 1; i > 0; i--) {
+		right.grow(bins[i].bounds);
+		right_count += bins[i].count;
+		right_cost[i - 1] = right_count ? right.surface_area() * right_count : 0.0f;
+	}
+
+	int best_split = -1;
+	float best_cost = std::numeric_limits<float>::max();
+	aabb left;
+	uint32_t left_count = 0;
+	for (int i = 0; i < BIN_COUNT - 1; i++) {
+		left.grow(bins[i].bounds);
+		left_count += bins[i].count;
+
+		const float cost = (left_count ? left.surface_area() * left_count : 0.0f) + right_cost[i];
+		if (left_count > 0 && left_count < count && cost < best_cost) {
+			best_cost = cost;
+			best_split = i;
+		}
+	}
+
+	const float leaf_cost = bounds.surface_area() * count;
+	if (best_split < 0 || (best_cost >= leaf_cost && count <= MAX_LEAF_SIZE)) {
+		return;
+	}
+
+	const auto begin = m_order.begin() + first;
+	const auto middle = std::partition(begin, begin + count, [&](uint32_t id) {
+		return bin_index(m_instances[id].bounds.centroid()[axis], lo, scale) <= best_split;
+	});
+
+	const uint32_t split = static_cast<uint32_t>(middle - begin);
+	const uint32_t children = static_cast<uint32_t>(m_nodes.size());
+
+	m_nodes.push_back({ aabb(), first, split });
+	m_nodes.push_back({ aabb(), first + split, count - split });
+	m_nodes[node_index].first = children;
+	m_nodes[node_index].count = 0;
+}
+
+void instance_set::refit() {
+	// Children are always stored after their parent, so a reverse sweep sees them first.
+	for (size_t i = m_nodes.size(); i-- > 0;) {
+		bvh_node& node = m_nodes[i];
+		aabb bounds;
+
+		if (node.count > 0) {
+			for (uint32_t j = 0; j < node.count; j++) {
+				bounds.grow(m_instances[m_order[node.first + j]].bounds);
+			}
+		}
+		else {
+			bounds.grow(m_nodes[node.first].bounds);
+			bounds.grow(m_nodes[node.first + 1].bounds);
+		}
+
+		node.bounds = bounds;
+	}
+
+	m_needs_refit = false;
+}
+
+bool instance_set::trace(glm::vec3 origin, glm::vec3 direction, float t_min, float t_max, hit& out, trace_stats& stats) const {
+	if (m_nodes.empty()) {
+		return false;
+	}
+
+	struct stack_entry {
+		uint32_t node;
+		float t_near;
+	};
+
+	const glm::vec3 inv_dir = safe_inverse(direction);
+	stack_entry stack[STACK_SIZE];
+	int stack_size = 0;
+	bool found = false;
+
+	float t_root;
+	if (intersect_bounds(m_nodes[0].bounds, origin, inv_dir, t_min, t_max, t_root)) {
+		stack[stack_size++] = { 0, t_root };
+	}
+
+	while (stack_size > 0) {
+		const stack_entry entry = stack[--stack_size];
+		if (entry.t_near > t_max) {
+			continue;
+		}
+
+		const bvh_node& node = m_nodes[entry.node];
+		stats.tlas_steps++;
+
+		if (node.count > 0) {
+			for (uint32_t i = 0; i < node.count; i++) {
+				const uint32_t id = m_order[node.first + i];
+				const instance& inst = m_instances[id];
+
+				// Tracing with a normalized model space direction scales t by the length of the transformed direction.
+				const glm::vec3 model_origin(inst.to_model * glm::vec4(origin, 1.0f));
+				const glm::vec3 model_direction(inst.to_model * glm::vec4(direction, 0.0f));
+				const float scale = glm::length(model_direction);
+
+				hit h;
+				if (trace_ray(*m_models[inst.model], model_origin, model_direction / scale, t_min * scale, t_max * scale, h, stats)) {
+					h.t /= scale;
+					h.instance = id;
+					out = h;
+					t_max = h.t;
+					found = true;
+				}
+			}
+
+			continue;
+		}
+
+		assert(stack_size + 2 <= STACK_SIZE && "instance BVH deeper than MAX_DEPTH");
+
+		float t_left;
+		float t_right;
+		const bool hit_left = intersect_bounds(m_nodes[node.first].bounds, origin, inv_dir, t_min, t_max, t_left);
+		const bool hit_right = intersect_bounds(m_nodes[node.first + 1].bounds, origin, inv_dir, t_min, t_max, t_right);
+
+		// Push the far child first so the near one is visited next.
+		if (hit_left && hit_right) {
+			const bool left_first = t_left <= t_right;
+			stack[stack_size++] = { left_first ? node.first + 1 : node.first, left_first ? t_right : t_left };
+			stack[stack_size++] = { left_first ? node.first : node.first + 1, left_first ? t_left : t_right };
+		}
+		else if (hit_left) {
+			stack[stack_size++] = { node.first, t_left };
+		}
+		else if (hit_right) {
+			stack[stack_size++] = { node.first + 1, t_right };
+		}
+	}
+
+	return found;
+}
+
+glm::vec3 instance_set::world_normal(const hit& h) const {
+	const instance& inst = m_instances[h.instance];
+	return glm::normalize(glm::transpose(glm::mat3(inst.to_model)) * glm::vec3(h.normal));
+}
+
+size_t instance_set::model_memory_usage() const {
+	size_t bytes = 0;
+	for (const std::unique_ptr<world>& model : m_models) {
+		bytes += model->memory_usage();
+	}
+
+	return bytes;
+}
+
+size_t instance_set::instance_memory_usage() const {
+	return m_instances.size() * sizeof(instance) + m_nodes.size() * sizeof(bvh_node) + m_order.size() * sizeof(uint32_t);
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "jobs.hpp"
+#include "raytracer.hpp"
+#include "world.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+struct aabb {
+	glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+	glm::vec3 max = glm::vec3(-std::numeric_limits<float>::max());
+
+	void grow(glm::vec3 p) {
+		min = glm::min(min, p);
+		max = glm::max(max, p);
+	}
+
+	void grow(const aabb& other) {
+		min = glm::min(min, other.min);
+		max = glm::max(max, other.max);
+	}
+
+	glm::vec3 centroid() const { return (min + max) * 0.5f; }
+
+	float surface_area() const {
+		const glm::vec3 e = glm::max(max - min, glm::vec3(0.0f));
+		return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
+};
+
+struct instance {
+	uint32_t model;
+	glm::mat4 to_world;
+	glm::mat4 to_model;
+	aabb bounds;
+};
+
+struct bvh_node {
+	aabb bounds;
+
+	// Leaves reference `count` entries of the instance order starting at `first`,
+	// inner nodes (count == 0) have their children at `first` and `first + 1`.
+	uint32_t first;
+	uint32_t count;
+};
+
+/*
+ * Copies of voxel models placed in the world with an affine transform. Each
+ * model is stored once no matter how many instances use it; an instance is
+ * just a model id and two matrices.
+ *
+ * A top level BVH over the instance bounds is built with a binned SAH, with
+ * the binning of large nodes spread over the job system. Its depth is capped
+ * so that traversal fits a fixed stack. Moving instances only refits the
+ * existing tree.
+ */
+class instance_set {
+public:
+	uint32_t add_model(world&& model);
+	uint32_t add_instance(uint32_t model, const glm::mat4& to_world);
+	void set_transform(uint32_t instance, const glm::mat4& to_world);
+
+	const world& model(uint32_t id) const { return *m_models[id]; }
+	const instance& get_instance(uint32_t id) const { return m_instances[id]; }
+
+	size_t model_count() const { return m_models.size(); }
+	size_t instance_count() const { return m_instances.size(); }
+	size_t node_count() const { return m_nodes.size(); }
+
+	void build(job_system& jobs);
+
+	/* Recomputes node bounds after set_transform() calls, keeping the tree topology. */
+	void refit();
+	bool needs_refit() const { return m_needs_refit; }
+
+	/* Rays are transformed into each candidate's model space and traced against the model's own grid. */
+	bool trace(glm::vec3 origin, glm::vec3 direction, float t_min, float t_max, hit& out, trace_stats& stats) const;
+
+	/* World space normal of a hit returned by trace(). */
+	glm::vec3 world_normal(const hit& h) const;
+
+	size_t model_memory_usage() const;
+	size_t instance_memory_usage() const;
+
+private:
+	struct bin {
+		aabb bounds;
+		uint32_t count = 0;
+	};
+
+	void subdivide(uint32_t node_index, uint32_t depth, job_system& jobs);
+
+	std::vector<std::unique_ptr<world>> m_models;
+	std::vector<instance> m_instances;
+	std::vector<bvh_node> m_nodes;
+	std::vector<uint32_t> m_order;
+	bool m_needs_refit = false;
+};
@@ -0,0 +1,93 @@
+#include "jobs.hpp"
+
+#include <algorithm>
+
+namespace {
+
+constexpr size_t ARENA_CAPACITY = 1 << 20;
+
+}
+
+job_system::job_system(unsigned thread_count) {
+	thread_count = std::max(thread_count, 1u);
+
+	for (unsigned i = 0; i < thread_count; i++) {
+		m_arenas.push_back(std::make_unique<frame_arena>(ARENA_CAPACITY));
+	}
+
+	for (unsigned i = 1; i < thread_count; i++) {
+		m_threads.emplace_back(&job_system::worker_main, this, i);
+	}
+}
+
+job_system::~job_system() {
+	{
+		std::lock_guard lock(m_mutex);
+		m_quit = true;
+	}
+
+	m_wake.notify_all();
+	for (std::thread& thread : m_threads) {
+		thread.join();
+	}
+}
+
+void job_system::begin_frame() {
+	for (std::unique_ptr<frame_arena>& arena : m_arenas) {
+		arena->reset();
+	}
+}
+
+void job_system::run(uint32_t count, job_fn fn, void* context) {
+	if (count == 0) {
+		return;
+	}
+
+	{
+		std::lock_guard lock(m_mutex);
+		m_fn = fn;
+		m_context = context;
+		m_count = count;
+		m_next.store(0, std::memory_order_relaxed);
+		m_busy_workers = static_cast<unsigned>(m_threads.size());
+		m_generation++;
+	}
+
+	m_wake.notify_all();
+	execute(0);
+
+	std::unique_lock lock(m_mutex);
+	m_done.wait(lock, [this] { return m_busy_workers == 0; });
+}
+
+void job_system::execute(unsigned thread_index) {
+	for (uint32_t index = m_next.fetch_add(1, std::memory_order_relaxed); index < m_count; index = m_next.fetch_add(1, std::memory_order_relaxed)) {
+		m_fn(m_context, index, thread_index);
+	}
+}
+
+void job_system::worker_main(unsigned thread_index) {
+	uint64_t seen_generation = 0;
+
+	while (true) {
+		{
+			std::unique_lock lock(m_mutex);
+			m_wake.wait(lock, [&] { return m_quit || m_generation != seen_generation; });
+
+			if (m_quit) {
+				return;
+			}
+
+			seen_generation = m_generation;
+		}
+
+		execute(thread_index);
+
+		{
+			std::lock_guard lock(m_mutex);
+			m_busy_workers--;
+		}
+
+		m_done.notify_one();
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "arena.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/*
+ * Fixed pool of worker threads. The calling thread takes part in every
+ * parallel_for as thread 0, so a pool of one thread runs everything inline.
+ *
+ * Each thread owns a frame_arena for its transient data. Dispatching work
+ * does not allocate: jobs are passed as a function pointer and a context
+ * pointer rather than through std::function.
+ */
+class job_system {
+public:
+	explicit job_system(unsigned thread_count = std::thread::hardware_concurrency());
+	~job_system();
+
+	job_system(const job_system&) = delete;
+	job_system& operator=(const job_system&) = delete;
+
+	unsigned thread_count() const { return static_cast<unsigned>(m_arenas.size()); }
+	frame_arena& arena(unsigned thread_index) { return *m_arenas[thread_index]; }
+
+	/* Releases every thread's frame arena. Must not be called during a parallel_for. */
+	void begin_frame();
+
+	/* Calls fn(index, thread_index) for every index in [0, count) and waits for all of them. */
+	template<typename F>
+	void parallel_for(uint32_t count, F&& fn) {
+		run(count, [](void* context, uint32_t index, unsigned thread_index) {
+			(*static_cast<std::remove_reference_t<F>*>(context))(index, thread_index);
+		}, &fn);
+	}
+
+private:
+	using job_fn = void (*)(void* context, uint32_t index, unsigned thread_index);
+
+	void run(uint32_t count, job_fn fn, void* context);
+	void execute(unsigned thread_index);
+	void worker_main(unsigned thread_index);
+
+	std::vector<std::unique_ptr<frame_arena>> m_arenas;
+	std::vector<std::thread> m_threads;
+
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::condition_variable m_done;
+	uint64_t m_generation = 0;
+	unsigned m_busy_workers = 0;
+	bool m_quit = false;
+
+	job_fn m_fn = nullptr;
+	void* m_context = nullptr;
+	uint32_t m_count = 0;
+	std::atomic<uint32_t> m_next = 0;
+};
@@ -1,7 +1,397 @@
+#include "gpu_context.hpp"
+#include "gpu_renderer.hpp"
+#include "pipeline_library.hpp"
+#include "scenes.hpp"
+#include "shader_watcher.hpp"
+
 #include <spdlog/spdlog.h>
-#include <vulkan/vulkan.h>
-#include <vulkan/vk_enum_string_helper.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+// Set by CMake: where the GLSL sources live and where the build writes their SPIR-V.
+#ifndef VOXEL_SHADER_SOURCE_DIR
+#define VOXEL_SHADER_SOURCE_DIR "res/shaders"
+#endif
+
+#ifndef VOXEL_SHADER_DIR
+#define VOXEL_SHADER_DIR "res/shaders"
+#endif
+
+namespace {
+
+// Frames --resident-bricks renders at most before the timed ones, for a budget too small for the view to ever settle.
+constexpr int MAX_WARMUP_FRAMES = 64;
+
+// Mean per-channel difference, in 0-255 steps, --check-cpu accepts between the GPU and CPU images. Level of detail and
+// float differences stay well below it; an image the trace pass never wrote is far above.
+constexpr double CPU_CHECK_TOLERANCE = 16.0;
+
+struct app_options {
+	int width = 1280;
+	int height = 720;
+	int frames = 1;
+	int frames_in_flight = 2;
+	int record_threads = 0;
+	int resident_bricks = 0;
+	int memory_stress = 0;
+	bool dev = false;
+	bool validation = false;
+	bool single_queue = false;
+	bool ray_query = true;
+	bool subgroup_ops = true;
+	bool stream = false;
+	bool check_cpu = false;
+	const char* output = "frame.ppm";
+	const char* pipeline_cache = "pipeline_cache.bin";
+	gpu_trace_features features;
+};
+
+std::atomic<bool> g_quit = false;
+
+app_options parse_options(int argc, char** argv) {
+	app_options options;
+
+	for (int i = 1; i < argc; i++) {
+		if (std::strcmp(argv[i], "--dev") == 0) {
+			options.dev = true;
+		}
+		else if (std::strcmp(argv[i], "--validation") == 0) {
+			options.validation = true;
+		}
+		else if (std::strcmp(argv[i], "--single-queue") == 0) {
+			options.single_queue = true;
+		}
+		else if (std::strcmp(argv[i], "--no-ray-query") == 0) {
+			options.ray_query = false;
+		}
+		else if (std::strcmp(argv[i], "--no-subgroup-ops") == 0) {
+			options.subgroup_ops = false;
+		}
+		else if (std::strcmp(argv[i], "--check-cpu") == 0) {
+			options.check_cpu = true;
+		}
+		else if (std::strcmp(argv[i], "--stream") == 0) {
+			options.stream = true;
+		}
+		else if (i + 1 < argc && std::strcmp(argv[i], "--width") == 0) {
+			options.width = std::max(std::atoi(argv[++i]), 1);
+		}
+		else if (i + 1 < argc && std::strcmp(argv[i], "--height") == 0) {
+			options.height = std::max(std::atoi(argv[++i]), 1);
+		}
+		else if (i + 1 < argc && std::strcmp(argv[i], "--frames") == 0) {
+			options.frames = std::max(std::atoi(argv[++i]), 1);
+		}
+		else if (i + 1 < argc && std::strcmp(argv[i], "--memory-stress") == 0) {
+			options.memory_stress = std::max(std::atoi(argv[++i]), 1);
+		}
+		else if (i + 1 < argc && std::strcmp(argv[i], "--frames-in-flight") == 0) {
+			options.frames_in_flight = std::clamp(std::atoi(argv[++i]), 1, 8);
+		}
+		else if (i + 1 < argc && std::strcmp(argv[i], "--resident-bricks") == 0) {
+			options.resident_bricks = std::max(std::atoi(argv[++i]), 0);
+		}
+		else if (i + 1 < argc && std::strcmp(argv[i], "--record-threads") == 0) {
+			options.record_threads = std::max(std::atoi(argv[++i]), 1);
+		}
+		else if (i + 1 < argc && std::strcmp(argv[i], "--out") == 0) {
+			options.output = argv[++i];
+		}
+		else if (i + 1 < argc && std::strcmp(argv[i], "--pipeline-cache") == 0) {
+			options.pipeline_cache = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--shadows") == 0) {
+			options.features.shadows = true;
+		}
+		else if (std::strcmp(argv[i], "--ao") == 0) {
+			options.features.ambient_occlusion = true;
+		}
+		else if (std::strcmp(argv[i], "--gi") == 0) {
+			options.features.global_illumination = true;
+		}
+		else if (i + 1 < argc && std::strcmp(argv[i], "--lod-levels") == 0) {
+			options.features.lod_levels = std::clamp(std::atoi(argv[++i]), 1, BRICK_LOD_LEVELS);
+		}
+		else {
+			spdlog::warn("Unknown option {}", argv[i]);
+		}
+	}
+
+	return options;
+}
+
+/* Edits one layer per frame of a 4x4 column in the middle of the world, alternately filling and carving it, and lists the changed bricks. */
+void edit_column(world& w, int frame, std::vector<glm::ivec3>& bricks) {
+	const glm::ivec3 size = w.size();
+	const int y = frame % size.y;
+	const uint8_t material = (frame / size.y) % 2 == 0 ? 4 : 0;
+
+	bricks.clear();
+	for (int z = size.z / 2 - 2; z < size.z / 2 + 2; z++) {
+		for (int x = size.x / 2 - 2; x < size.x / 2 + 2; x++) {
+			w.set(glm::ivec3(x, y, z), material);
+
+			const glm::ivec3 brick = glm::ivec3(x, y, z) / BRICK_SIZE;
+			if (std::find(bricks.begin(), bricks.end(), brick) == bricks.end()) {
+				bricks.push_back(brick);
+			}
+		}
+	}
+}
+
+/*
+ * Creates and destroys buffers of random sizes in every memory pool, checking
+ * that live buffers sharing a VkDeviceMemory never overlap, that host visible
+ * ones keep their contents and that the pools drain completely. Small enough
+ * to run on lavapipe.
+ */
+bool stress_memory(gpu_context& context, int iterations) {
+	struct live_buffer {
+		gpu_buffer buffer;
+		uint32_t tag;
+	};
+
+	constexpr size_t MAX_LIVE = 512;
+	const VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
+	std::mt19937 rng(1337);
+	std::vector<live_buffer> live;
+	bool ok = true;
+
+	auto release = [&](size_t index) {
+		live_buffer& b = live[index];
+		if (b.buffer.mapped) {
+			const uint32_t* words = static_cast<const uint32_t*>(b.buffer.mapped);
+			if (words[0] != b.tag || words[b.buffer.size / 4 - 1] != b.tag) {
+				spdlog::error("Buffer {} lost its contents", b.tag);
+				ok = false;
+			}
+		}
+
+		context.destroy_buffer(b.buffer);
+		live[index] = live.back();
+		live.pop_back();
+	};
+
+	for (int i = 0; i < iterations && ok; i++) {
+		if (!live.empty() && (live.size() == MAX_LIVE || rng() % 3 == 0)) {
+			release(rng() % live.size());
+			continue;
+		}
+
+		// Sizes from 256 bytes to 32 MiB, evenly spread over the powers of two, so some need dedicated blocks.
+		const memory_pool pool = static_cast<memory_pool>(rng() % MEMORY_POOL_COUNT);
+		const VkDeviceSize size = (VkDeviceSize(256) << (rng() % 18)) + (rng() % 1024) * 4;
+		const VkMemoryPropertyFlags properties = pool == memory_pool::staging ? VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT : VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+
+		live_buffer b = { context.create_buffer(size, usage, properties, pool), static_cast<uint32_t>(i) };
+		const gpu_allocation& a = b.buffer.allocation;
+		for (const live_buffer& other : live) {
+			const gpu_allocation& o = other.buffer.allocation;
+			if (o.memory == a.memory && o.offset < a.offset + a.size && a.offset < o.offset + o.size) {
+				spdlog::error("Buffers {} and {} overlap", other.tag, b.tag);
+				ok = false;
+			}
+		}
+
+		if (b.buffer.mapped) {
+			uint32_t* words = static_cast<uint32_t*>(b.buffer.mapped);
+			words[0] = b.tag;
+			words[size / 4 - 1] = b.tag;
+		}
+
+		live.push_back(b);
+	}
+
+	context.allocator().log_stats();
+	while (!live.empty()) {
+		release(live.size() - 1);
+	}
+
+	for (int i = 0; i < MEMORY_POOL_COUNT; i++) {
+		const memory_pool_stats stats = context.allocator().stats(static_cast<memory_pool>(i));
+		if (stats.used != 0 || stats.allocations != 0) {
+			spdlog::error("Memory pool {} still holds {} allocations after freeing everything", memory_pool_name(static_cast<memory_pool>(i)), stats.allocations);
+			ok = false;
+		}
+	}
+
+	spdlog::info("Memory stress {} after {} iterations", ok ? "passed" : "failed", iterations);
+	return ok;
+}
+
+/* Mean absolute difference per color channel, in 0-255 steps. */
+double image_error(const framebuffer& a, const framebuffer& b) {
+	uint64_t total = 0;
+	for (size_t i = 0; i < a.pixels.size(); i++) {
+		for (int shift = 0; shift < 24; shift += 8) {
+			total += static_cast<uint64_t>(std::abs(static_cast<int>((a.pixels[i] >> shift) & 0xFF) - static_cast<int>((b.pixels[i] >> shift) & 0xFF)));
+		}
+	}
+
+	return static_cast<double>(total) / static_cast<double>(std::max<size_t>(a.pixels.size() * 3, 1));
+}
+
+bool write_ppm(const char* path, const framebuffer& image) {
+	FILE* file = std::fopen(path, "wb");
+	if (!file) {
+		spdlog::error("Failed to open {}", path);
+		return false;
+	}
+
+	std::fprintf(file, "P6\n%d %d\n255\n", image.width, image.height);
+	for (uint32_t pixel : image.pixels) {
+		const unsigned char rgb[3] = { static_cast<unsigned char>(pixel), static_cast<unsigned char>(pixel >> 8), static_cast<unsigned char>(pixel >> 16) };
+		std::fwrite(rgb, 1, 3, file);
+	}
+
+	std::fclose(file);
+	return true;
+}
+
+}
+
+/*
+ * Renders the terrain's horizon view on the GPU and writes it to --out.
+ *
+ * With --dev it keeps rendering until interrupted, recompiling shaders in
+ * res/shaders as they are saved and writing a new image after every swap, so
+ * traversal changes can be checked without rebuilding or relaunching.
+ */
 int main(int argc, char** argv) {
-	spdlog::info("Hello, World");
-}
\ No newline at end of file
+	const app_options options = parse_options(argc, argv);
+	std::signal(SIGINT, [](int) { g_quit = true; });
+
+	spdlog::info("Generating terrain");
+	world w = generate_terrain(glm::ivec3(64, 16, 64), 1337);
+	const scene_view view = terrain_views(w).front();
+	const render_settings settings;
+
+	try {
+		gpu_context context(options.validation, !options.single_queue, options.ray_query, options.subgroup_ops);
+		if (options.memory_stress > 0) {
+			return stress_memory(context, options.memory_stress) ? 0 : 1;
+		}
+
+		// Without --record-threads every core records dispatch regions.
+		job_system jobs(options.record_threads > 0 ? static_cast<unsigned>(options.record_threads) : std::thread::hardware_concurrency());
+		pipeline_library pipelines(context, options.pipeline_cache);
+		gpu_renderer renderer(context, pipelines, VOXEL_SHADER_DIR, w, options.width, options.height, jobs, static_cast<uint32_t>(options.frames_in_flight),
+			static_cast<uint32_t>(options.resident_bricks));
+		framebuffer image(options.width, options.height);
+
+		// On demand bricks arrive a few frames after rays first reach their proxies; settle before the frames that count.
+		if (options.resident_bricks > 0) {
+			int warmup = 0;
+			while (warmup < MAX_WARMUP_FRAMES && (renderer.residency().frame == 0 || renderer.residency().requested > 0)) {
+				renderer.render(view.cam, settings, options.features);
+				pipelines.collect(renderer.completed_frame());
+				warmup++;
+			}
+			spdlog::info("Residency settled after {} frames, {} bricks still requested", warmup, renderer.residency().requested);
+		}
+
+		std::unique_ptr<shader_watcher> watcher;
+		if (options.dev) {
+			watcher = std::make_unique<shader_watcher>(VOXEL_SHADER_SOURCE_DIR, VOXEL_SHADER_DIR, [&](const std::string& name, const std::vector<uint32_t>& spirv) {
+				pipelines.prepare(name, spirv);
+			});
+		}
+
+		std::vector<glm::ivec3> edited;
+		std::vector<uint32_t> old_entries;
+		uint32_t stale_bricks = 0;
+		gpu_frame_timings total;
+		int rendered = 0;
+		for (int frame = 0; options.dev ? !g_quit : frame < options.frames; frame++) {
+			if (options.stream) {
+				edit_column(w, frame, edited);
+				old_entries.clear();
+				for (const glm::ivec3& brick : edited) {
+					old_entries.push_back(renderer.cell_entry(brick));
+				}
+
+				renderer.stream_bricks(w, edited);
+
+				// An edited brick must never keep its old slot, even when the atlas is full.
+				if (options.check_cpu) {
+					for (size_t i = 0; i < edited.size(); i++) {
+						const uint32_t entry = old_entries[i];
+						stale_bricks += entry != EMPTY_BRICK && (entry & GPU_PROXY_BRICK) == 0 && renderer.cell_entry(edited[i]) == entry;
+					}
+				}
+			}
+
+			// Swapping only changes which pipeline the next command buffer binds, so nothing waits on the GPU.
+			// The replaced pipelines were last used by the most recently submitted frame.
+			const bool swapped = pipelines.swap_pending(renderer.frame()) > 0;
+
+			renderer.render(view.cam, settings, options.features);
+			pipelines.collect(renderer.completed_frame());
+
+			const gpu_frame_timings& timings = renderer.timings();
+			total.wait_ms += timings.wait_ms;
+			total.record_ms += timings.record_ms;
+			total.submit_ms += timings.submit_ms;
+			rendered++;
+
+			if (swapped) {
+				renderer.read_back(image);
+				write_ppm(options.output, image);
+			}
+
+			if (options.dev) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(16));
+			}
+		}
+
+		renderer.read_back(image);
+		pipelines.collect(renderer.completed_frame());
+		if (!write_ppm(options.output, image)) {
+			return 1;
+		}
+
+		spdlog::info("Wrote {} with {} pipeline variants", options.output, pipelines.variant_count());
+
+		if (stale_bricks > 0) {
+			spdlog::error("{} edited bricks kept their old GPU slot", stale_bricks);
+			return 1;
+		}
+
+		// The last frame against the CPU renderer on the same world, which --stream has edited as well.
+		if (options.check_cpu) {
+			framebuffer reference(options.width, options.height);
+			render(w, nullptr, view.cam, settings, reference, jobs);
+			const double error = image_error(image, reference);
+			spdlog::info("Mean per-channel difference from the CPU renderer: {:.2f}", error);
+			if (error > CPU_CHECK_TOLERANCE) {
+				spdlog::error("The GPU image differs from the CPU renderer by more than {:.0f}", CPU_CHECK_TOLERANCE);
+				return 1;
+			}
+		}
+		spdlog::info("Average CPU frame: wait {:.3f} ms, record {:.3f} ms ({} regions on {} threads), submit {:.3f} ms",
+			total.wait_ms / rendered, total.record_ms / rendered, renderer.timings().regions, renderer.timings().recording_threads, total.submit_ms / rendered);
+		if (options.resident_bricks > 0) {
+			const gpu_residency_stats& residency = renderer.residency();
+			spdlog::info("Resident bricks: {} in {} slots, {} uploaded on demand, {} evicted", residency.resident, residency.slots, residency.uploaded, residency.evicted);
+		}
+		context.allocator().log_stats();
+	}
+	catch (const std::exception& e) {
+		spdlog::error("{}", e.what());
+		return 1;
+	}
+
+	return 0;
+}
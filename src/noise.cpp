@@ -0,0 +1,84 @@
+#include "noise.hpp"
+#include "cpu_features.hpp"
+
+#include <cmath>
+
+namespace {
+
+uint32_t hash(int x, int y, uint32_t seed) {
+	uint32_t h = seed ^ (static_cast<uint32_t>(x) * 0x8da6b343u) ^ (static_cast<uint32_t>(y) * 0xd8163841u);
+	h ^= h >> 15;
+	h *= 0x2c1b3c6du;
+	h ^= h >> 12;
+	h *= 0x297a2d39u;
+	h ^= h >> 15;
+	return h;
+}
+
+float lattice(int x, int y, uint32_t seed) {
+	return static_cast<float>(hash(x, y, seed) & 0xFFFFFF) / static_cast<float>(0xFFFFFF);
+}
+
+VOXEL_KERNEL float value_noise_kernel(glm::vec2 p, uint32_t seed) {
+	const glm::vec2 cell = glm::floor(p);
+	const glm::vec2 f = p - cell;
+	const glm::vec2 u = f * f * (3.0f - 2.0f * f);
+
+	const int x = static_cast<int>(cell.x);
+	const int y = static_cast<int>(cell.y);
+
+	const float a = lattice(x, y, seed);
+	const float b = lattice(x + 1, y, seed);
+	const float c = lattice(x, y + 1, seed);
+	const float d = lattice(x + 1, y + 1, seed);
+
+	return glm::mix(glm::mix(a, b, u.x), glm::mix(c, d, u.x), u.y);
+}
+
+VOXEL_KERNEL float fbm_kernel(glm::vec2 p, int octaves, uint32_t seed) {
+	float sum = 0.0f;
+	float amplitude = 0.5f;
+	float total = 0.0f;
+
+	for (int i = 0; i < octaves; i++) {
+		sum += value_noise_kernel(p, seed + i) * amplitude;
+		total += amplitude;
+		p *= 2.0f;
+		amplitude *= 0.5f;
+	}
+
+	return sum / total;
+}
+
+#if VOXEL_ISA_DISPATCH
+VOXEL_TARGET_SSE42 float fbm_sse42(glm::vec2 p, int octaves, uint32_t seed) {
+	return fbm_kernel(p, octaves, seed);
+}
+
+VOXEL_TARGET_AVX2 float fbm_avx2(glm::vec2 p, int octaves, uint32_t seed) {
+	return fbm_kernel(p, octaves, seed);
+}
+
+VOXEL_TARGET_AVX512 float fbm_avx512(glm::vec2 p, int octaves, uint32_t seed) {
+	return fbm_kernel(p, octaves, seed);
+}
+#endif
+
+}
+
+float value_noise(glm::vec2 p, uint32_t seed) {
+	return value_noise_kernel(p, seed);
+}
+
+float fbm(glm::vec2 p, int octaves, uint32_t seed) {
+#if VOXEL_ISA_DISPATCH
+	switch (active_cpu_isa()) {
+	case cpu_isa::avx512: return fbm_avx512(p, octaves, seed);
+	case cpu_isa::avx2: return fbm_avx2(p, octaves, seed);
+	case cpu_isa::sse42: return fbm_sse42(p, octaves, seed);
+	default: break;
+	}
+#endif
+
+	return fbm_kernel(p, octaves, seed);
+}
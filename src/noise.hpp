@@ -0,0 +1,11 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+
+/* Smooth value noise in [0, 1]. */
+float value_noise(glm::vec2 p, uint32_t seed);
+
+/* Sum of `octaves` layers of value noise, normalized back to [0, 1]. */
+float fbm(glm::vec2 p, int octaves, uint32_t seed);
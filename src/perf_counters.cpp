@@ -0,0 +1,100 @@
+#include "perf_counters.hpp"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <initializer_list>
+
+namespace {
+
+int open_cache_counter(uint64_t cache) {
+	perf_event_attr attr;
+	std::memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+uint64_t read_counter(int fd) {
+	uint64_t value = 0;
+	if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) {
+		return 0;
+	}
+
+	return value;
+}
+
+}
+
+cache_counters::cache_counters()
+	: m_l1d(open_cache_counter(PERF_COUNT_HW_CACHE_L1D)), m_llc(open_cache_counter(PERF_COUNT_HW_CACHE_LL)) {
+}
+
+cache_counters::~cache_counters() {
+	if (m_l1d >= 0) {
+		close(m_l1d);
+	}
+
+	if (m_llc >= 0) {
+		close(m_llc);
+	}
+}
+
+void cache_counters::start() {
+	for (int fd : { m_l1d, m_llc }) {
+		if (fd >= 0) {
+			ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+}
+
+void cache_counters::stop() {
+	for (int fd : { m_l1d, m_llc }) {
+		if (fd >= 0) {
+			ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		}
+	}
+}
+
+uint64_t cache_counters::l1d_misses() const {
+	return read_counter(m_l1d);
+}
+
+uint64_t cache_counters::llc_misses() const {
+	return read_counter(m_llc);
+}
+
+#else
+
+cache_counters::cache_counters() {
+}
+
+cache_counters::~cache_counters() {
+}
+
+void cache_counters::start() {
+}
+
+void cache_counters::stop() {
+}
+
+uint64_t cache_counters::l1d_misses() const {
+	return 0;
+}
+
+uint64_t cache_counters::llc_misses() const {
+	return 0;
+}
+
+#endif
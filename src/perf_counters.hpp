@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+ * Hardware cache miss counters through Linux perf events. They count the
+ * calling thread and every thread it starts after construction, so create
+ * them before the job_system being measured.
+ *
+ * L2 misses have no portable generic perf event, so L1 data cache and last
+ * level cache read misses are reported instead. Elsewhere, or when
+ * perf_event_paranoid forbids it, available() is false and counts are 0.
+ */
+class cache_counters {
+public:
+	cache_counters();
+	~cache_counters();
+
+	cache_counters(const cache_counters&) = delete;
+	cache_counters& operator=(const cache_counters&) = delete;
+
+	bool available() const { return m_l1d >= 0 && m_llc >= 0; }
+
+	void start();
+	void stop();
+
+	uint64_t l1d_misses() const;
+	uint64_t llc_misses() const;
+
+private:
+	int m_l1d = -1;
+	int m_llc = -1;
+};
@@ -0,0 +1,265 @@
+#include "pipeline_library.hpp"
+
+#include <spdlog/spdlog.h>
+#include <vulkan/vk_enum_string_helper.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+bool load_spirv(const std::filesystem::path& path, std::vector<uint32_t>& words) {
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file) {
+		return false;
+	}
+
+	const std::streamsize size = file.tellg();
+	if (size <= 0 || size % 4 != 0) {
+		return false;
+	}
+
+	words.resize(static_cast<size_t>(size) / 4);
+	file.seekg(0);
+	return static_cast<bool>(file.read(reinterpret_cast<char*>(words.data()), size));
+}
+
+namespace {
+
+// VkPipelineCacheHeaderVersionOne: header size, version, vendor id, device id, then the cache UUID.
+constexpr size_t CACHE_HEADER_SIZE = 16 + VK_UUID_SIZE;
+
+}
+
+pipeline_library::pipeline_library(gpu_context& context, std::filesystem::path cache_path)
+	: m_context(context), m_cache_path(std::move(cache_path)) {
+	load_cache();
+}
+
+pipeline_library::~pipeline_library() {
+	collect(UINT64_MAX);
+
+	for (entry& e : m_entries) {
+		for (variant_pipeline& v : e.variants) {
+			vkDestroyPipeline(m_context.device(), v.pipeline, nullptr);
+			vkDestroyPipeline(m_context.device(), v.pending, nullptr);
+		}
+	}
+
+	save_cache();
+	vkDestroyPipelineCache(m_context.device(), m_cache, nullptr);
+}
+
+void pipeline_library::add(const std::string& name, const std::filesystem::path& path, VkPipelineLayout layout) {
+	std::vector<uint32_t> spirv;
+	if (!load_spirv(path, spirv)) {
+		spdlog::error("Failed to load {}", path.string());
+		throw std::runtime_error("Loading SPIR-V");
+	}
+
+	m_entries.push_back({ name, layout, std::move(spirv), {} });
+}
+
+VkPipeline pipeline_library::get(const std::string& name, const shader_variant& variant) {
+	const auto it = std::find_if(m_entries.begin(), m_entries.end(), [&](const entry& e) { return e.name == name; });
+	if (it == m_entries.end()) {
+		return VK_NULL_HANDLE;
+	}
+
+	std::lock_guard lock(m_mutex);
+
+	for (const variant_pipeline& v : it->variants) {
+		if (v.variant == variant) {
+			return v.pipeline;
+		}
+	}
+
+	VkPipeline pipeline;
+	vk_check(create(it->spirv, it->layout, variant, pipeline), "vkCreateComputePipelines");
+	it->variants.push_back({ variant, pipeline, VK_NULL_HANDLE });
+
+	spdlog::info("Built {} variant {}", name, it->variants.size());
+	return pipeline;
+}
+
+bool pipeline_library::prepare(const std::string& name, const std::vector<uint32_t>& spirv) {
+	const auto it = std::find_if(m_entries.begin(), m_entries.end(), [&](const entry& e) { return e.name == name; });
+	if (it == m_entries.end()) {
+		return false;
+	}
+
+	std::vector<shader_variant> variants;
+	{
+		std::lock_guard lock(m_mutex);
+		for (const variant_pipeline& v : it->variants) {
+			variants.push_back(v.variant);
+		}
+	}
+
+	std::vector<VkPipeline> pipelines(variants.size(), VK_NULL_HANDLE);
+	for (size_t i = 0; i < variants.size(); i++) {
+		const VkResult result = create(spirv, it->layout, variants[i], pipelines[i]);
+		if (result != VK_SUCCESS) {
+			spdlog::error("Rebuilding the {} pipeline failed: {}", name, string_VkResult(result));
+			for (VkPipeline pipeline : pipelines) {
+				vkDestroyPipeline(m_context.device(), pipeline, nullptr);
+			}
+			return false;
+		}
+	}
+
+	std::lock_guard lock(m_mutex);
+
+	// Variants first used while these were building keep the old shader until the next change.
+	it->spirv = spirv;
+	for (size_t i = 0; i < variants.size(); i++) {
+		// A newer build replaces one that has not been picked up yet.
+		variant_pipeline& v = it->variants[i];
+		vkDestroyPipeline(m_context.device(), v.pending, nullptr);
+		v.pending = pipelines[i];
+	}
+
+	return true;
+}
+
+uint32_t pipeline_library::swap_pending(uint64_t frame) {
+	std::lock_guard lock(m_mutex);
+	uint32_t swapped = 0;
+
+	for (entry& e : m_entries) {
+		uint32_t entry_swapped = 0;
+		for (variant_pipeline& v : e.variants) {
+			if (v.pending == VK_NULL_HANDLE) {
+				continue;
+			}
+
+			m_retired.push_back({ v.pipeline, frame });
+			v.pipeline = v.pending;
+			v.pending = VK_NULL_HANDLE;
+			entry_swapped++;
+		}
+
+		if (entry_swapped > 0) {
+			spdlog::info("Swapped in {} new {} pipelines", entry_swapped, e.name);
+		}
+		swapped += entry_swapped;
+	}
+
+	return swapped;
+}
+
+void pipeline_library::collect(uint64_t completed_frame) {
+	std::erase_if(m_retired, [&](const retired_pipeline& retired) {
+		if (retired.frame > completed_frame) {
+			return false;
+		}
+
+		vkDestroyPipeline(m_context.device(), retired.pipeline, nullptr);
+		return true;
+	});
+}
+
+uint32_t pipeline_library::variant_count() const {
+	std::lock_guard lock(m_mutex);
+	uint32_t count = 0;
+	for (const entry& e : m_entries) {
+		count += static_cast<uint32_t>(e.variants.size());
+	}
+
+	return count;
+}
+
+void pipeline_library::load_cache() {
+	std::vector<char> data;
+	std::ifstream file(m_cache_path, std::ios::binary | std::ios::ate);
+	if (file) {
+		data.resize(static_cast<size_t>(std::max<std::streamsize>(file.tellg(), 0)));
+		file.seekg(0);
+		file.read(data.data(), static_cast<std::streamsize>(data.size()));
+	}
+
+	// Drivers are required to reject foreign caches themselves, but not all of them do; only hand over data this device wrote.
+	const VkPhysicalDeviceProperties& properties = m_context.properties();
+	bool valid = data.size() >= CACHE_HEADER_SIZE;
+	if (valid) {
+		uint32_t header[4];
+		std::memcpy(header, data.data(), sizeof(header));
+		valid = header[0] >= CACHE_HEADER_SIZE && header[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE && header[2] == properties.vendorID &&
+			header[3] == properties.deviceID && std::memcmp(data.data() + 16, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+	}
+
+	if (!data.empty() && !valid) {
+		spdlog::warn("Ignoring pipeline cache {}, it was written by another device or driver", m_cache_path.string());
+	}
+
+	VkPipelineCacheCreateInfo cache_info = { VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO };
+	if (valid) {
+		cache_info.initialDataSize = data.size();
+		cache_info.pInitialData = data.data();
+		spdlog::info("Loaded pipeline cache {} ({} bytes)", m_cache_path.string(), data.size());
+	}
+
+	vk_check(vkCreatePipelineCache(m_context.device(), &cache_info, nullptr, &m_cache), "vkCreatePipelineCache");
+}
+
+void pipeline_library::save_cache() const {
+	size_t size = 0;
+	if (vkGetPipelineCacheData(m_context.device(), m_cache, &size, nullptr) != VK_SUCCESS || size == 0) {
+		return;
+	}
+
+	std::vector<char> data(size);
+	if (vkGetPipelineCacheData(m_context.device(), m_cache, &size, data.data()) != VK_SUCCESS) {
+		return;
+	}
+
+	// Written next to the target and renamed over it, so an interrupted save never leaves a truncated cache.
+	const std::filesystem::path temporary = m_cache_path.string() + ".tmp";
+	std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+	if (!file || !file.write(data.data(), static_cast<std::streamsize>(size))) {
+		spdlog::warn("Failed to write pipeline cache {}", temporary.string());
+		return;
+	}
+	file.close();
+
+	std::error_code error;
+	std::filesystem::rename(temporary, m_cache_path, error);
+	if (error) {
+		spdlog::warn("Failed to write pipeline cache {}: {}", m_cache_path.string(), error.message());
+	}
+}
+
+VkResult pipeline_library::create(const std::vector<uint32_t>& spirv, VkPipelineLayout layout, const shader_variant& variant, VkPipeline& pipeline) const {
+	VkShaderModuleCreateInfo module_info = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+	module_info.codeSize = spirv.size() * sizeof(uint32_t);
+	module_info.pCode = spirv.data();
+
+	VkShaderModule module;
+	VkResult result = vkCreateShaderModule(m_context.device(), &module_info, nullptr, &module);
+	if (result != VK_SUCCESS) {
+		return result;
+	}
+
+	VkSpecializationMapEntry entries[MAX_SPECIALIZATION_CONSTANTS];
+	for (uint32_t i = 0; i < variant.count; i++) {
+		entries[i] = { i, i * static_cast<uint32_t>(sizeof(uint32_t)), sizeof(uint32_t) };
+	}
+
+	VkSpecializationInfo specialization = {};
+	specialization.mapEntryCount = variant.count;
+	specialization.pMapEntries = entries;
+	specialization.dataSize = variant.count * sizeof(uint32_t);
+	specialization.pData = variant.values.data();
+
+	VkComputePipelineCreateInfo pipeline_info = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+	pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	pipeline_info.stage.module = module;
+	pipeline_info.stage.pName = "main";
+	pipeline_info.stage.pSpecializationInfo = variant.count > 0 ? &specialization : nullptr;
+	pipeline_info.layout = layout;
+
+	result = vkCreateComputePipelines(m_context.device(), m_cache, 1, &pipeline_info, nullptr, &pipeline);
+	vkDestroyShaderModule(m_context.device(), module, nullptr);
+	return result;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "gpu_context.hpp"
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <vector>
+
+constexpr uint32_t MAX_SPECIALIZATION_CONSTANTS = 8;
+
+/* Reads a compiled shader; returns false if the file is missing or not a multiple of four bytes. */
+bool load_spirv(const std::filesystem::path& path, std::vector<uint32_t>& words);
+
+/* Values for constant_id 0, 1, ... of a shader. Every constant is 32 bits wide; bools are VkBool32. */
+struct shader_variant {
+	std::array<uint32_t, MAX_SPECIALIZATION_CONSTANTS> values = {};
+	uint32_t count = 0;
+
+	void push(uint32_t value) { values[count++] = value; }
+
+	bool operator==(const shader_variant&) const = default;
+};
+
+/*
+ * Compute pipelines by shader file name and specialization, with support for
+ * replacing them while frames are in flight.
+ *
+ * Each shader is built once per variant, the first time that variant is
+ * asked for, so only the combinations a scene actually renders with are
+ * compiled. Builds go through a VkPipelineCache that is loaded from and
+ * saved to `cache_path`, which makes them cheap on later runs.
+ *
+ * prepare() may be called from any thread: it rebuilds every variant built
+ * so far there, so the driver's compile never lands on the render thread.
+ * The render thread picks replacements up with swap_pending() between
+ * frames. The pipelines they replace may still be in use by submitted
+ * frames, so they are only destroyed by collect() once those have finished.
+ */
+class pipeline_library {
+public:
+	pipeline_library(gpu_context& context, std::filesystem::path cache_path);
+	~pipeline_library();
+
+	pipeline_library(const pipeline_library&) = delete;
+	pipeline_library& operator=(const pipeline_library&) = delete;
+
+	/* Loads the SPIR-V at `path`; no pipeline is built until get(). Throws if it cannot be loaded. */
+	void add(const std::string& name, const std::filesystem::path& path, VkPipelineLayout layout);
+
+	/* The pipeline for one variant of `name`, built on first use. Render thread only; throws if creation fails. */
+	VkPipeline get(const std::string& name, const shader_variant& variant = {});
+
+	/* Builds replacements for every variant of `name`. Returns false, keeping the current pipelines, if the name is unknown or creation fails. */
+	bool prepare(const std::string& name, const std::vector<uint32_t>& spirv);
+
+	/* Installs prepared replacements. The old pipelines are kept until `frame` has completed. Returns how many were swapped. */
+	uint32_t swap_pending(uint64_t frame);
+
+	/* Destroys replaced pipelines whose last frame is at or before `completed_frame`. */
+	void collect(uint64_t completed_frame);
+
+	/* Writes the pipeline cache to disk. Also done on destruction. */
+	void save_cache() const;
+
+	uint32_t variant_count() const;
+
+private:
+	struct variant_pipeline {
+		shader_variant variant;
+		VkPipeline pipeline;
+		VkPipeline pending;
+	};
+
+	struct entry {
+		std::string name;
+		VkPipelineLayout layout;
+		std::vector<uint32_t> spirv;
+		std::vector<variant_pipeline> variants;
+	};
+
+	struct retired_pipeline {
+		VkPipeline pipeline;
+		uint64_t frame;
+	};
+
+	void load_cache();
+	VkResult create(const std::vector<uint32_t>& spirv, VkPipelineLayout layout, const shader_variant& variant, VkPipeline& pipeline) const;
+
+	gpu_context& m_context;
+	std::filesystem::path m_cache_path;
+	VkPipelineCache m_cache = VK_NULL_HANDLE;
+
+	// Entries are only added during setup; the mutex guards their SPIR-V and variants.
+	std::vector<entry> m_entries;
+	mutable std::mutex m_mutex;
+
+	std::vector<retired_pipeline> m_retired;
+};
@@ -0,0 +1,111 @@
+#include "ray_query.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <memory>
+
+namespace {
+
+constexpr uint32_t PACKETS_PER_JOB = 8;
+
+/* Structure of arrays view of one packet; the lane loops below are written to auto-vectorize. */
+struct ray_packet {
+	float origin[3][RAY_PACKET_SIZE];
+	float direction[3][RAY_PACKET_SIZE];
+	float t_enter[RAY_PACKET_SIZE];
+	float t_exit[RAY_PACKET_SIZE];
+};
+
+void trace_packet(const world& w, const instance_set* instances, const ray* rays, hit* hits, int count, trace_stats& stats) {
+	ray_packet packet;
+	const glm::vec3 world_size(w.size());
+
+	for (int axis = 0; axis < 3; axis++) {
+		for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+			const int source = std::min(lane, count - 1);
+			packet.origin[axis][lane] = rays[source].origin[axis];
+			packet.direction[axis][lane] = rays[source].direction[axis];
+		}
+	}
+
+	for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+		const float x = packet.direction[0][lane];
+		const float y = packet.direction[1][lane];
+		const float z = packet.direction[2][lane];
+		const float inv_length = 1.0f / std::sqrt(x * x + y * y + z * z);
+
+		packet.direction[0][lane] = x * inv_length;
+		packet.direction[1][lane] = y * inv_length;
+		packet.direction[2][lane] = z * inv_length;
+		packet.t_enter[lane] = rays[std::min(lane, count - 1)].t_min;
+		packet.t_exit[lane] = rays[std::min(lane, count - 1)].t_max;
+	}
+
+	// Slab test against the world bounds for the whole packet at once.
+	for (int axis = 0; axis < 3; axis++) {
+		for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+			const float d = packet.direction[axis][lane];
+			const float inv = 1.0f / (std::abs(d) < 1e-8f ? std::copysign(1e-8f, d) : d);
+			const float t0 = -packet.origin[axis][lane] * inv;
+			const float t1 = (world_size[axis] - packet.origin[axis][lane]) * inv;
+
+			packet.t_enter[lane] = std::max(packet.t_enter[lane], std::min(t0, t1));
+			packet.t_exit[lane] = std::min(packet.t_exit[lane], std::max(t0, t1));
+		}
+	}
+
+	for (int lane = 0; lane < count; lane++) {
+		const glm::vec3 origin(packet.origin[0][lane], packet.origin[1][lane], packet.origin[2][lane]);
+		const glm::vec3 direction(packet.direction[0][lane], packet.direction[1][lane], packet.direction[2][lane]);
+		hit& h = hits[lane];
+		float t_max = rays[lane].t_max;
+
+		h.material = 0;
+		if (packet.t_enter[lane] > packet.t_exit[lane]) {
+			stats.rays++;
+		}
+		else if (trace_ray(w, origin, direction, packet.t_enter[lane], packet.t_exit[lane], h, stats)) {
+			t_max = h.t;
+		}
+
+		if (instances) {
+			instances->trace(origin, direction, rays[lane].t_min, t_max, h, stats);
+		}
+	}
+}
+
+}
+
+trace_stats trace_rays(const world& w, const instance_set* instances, std::span<const ray> rays, std::span<hit> hits, job_system& jobs) {
+	assert(hits.size() >= rays.size());
+
+	const uint32_t rays_per_job = RAY_PACKET_SIZE * PACKETS_PER_JOB;
+	const uint32_t job_count = static_cast<uint32_t>((rays.size() + rays_per_job - 1) / rays_per_job);
+
+	// Borrow the calling thread's arena for per-thread stats and hand the space back before returning.
+	frame_arena& arena = jobs.arena(0);
+	const size_t mark = arena.mark();
+	trace_stats* thread_stats = arena.allocate<trace_stats>(jobs.thread_count());
+	std::uninitialized_value_construct_n(thread_stats, jobs.thread_count());
+
+	jobs.parallel_for(job_count, [&](uint32_t job, unsigned thread_index) {
+		trace_stats stats;
+		const size_t end = std::min(rays.size(), static_cast<size_t>(job + 1) * rays_per_job);
+
+		for (size_t first = static_cast<size_t>(job) * rays_per_job; first < end; first += RAY_PACKET_SIZE) {
+			const int count = static_cast<int>(std::min<size_t>(RAY_PACKET_SIZE, end - first));
+			trace_packet(w, instances, rays.data() + first, hits.data() + first, count, stats);
+		}
+
+		thread_stats[thread_index] += stats;
+	});
+
+	trace_stats stats;
+	for (unsigned i = 0; i < jobs.thread_count(); i++) {
+		stats += thread_stats[i];
+	}
+
+	arena.rewind(mark);
+	return stats;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "instances.hpp"
+#include "jobs.hpp"
+#include "raytracer.hpp"
+#include "world.hpp"
+
+#include <span>
+
+constexpr int RAY_PACKET_SIZE = 8;
+
+/*
+ * Batched ray queries for gameplay and physics (line of sight, picking).
+ *
+ * Directions do not need to be normalized; t_min and t_max are distances in
+ * voxels along the normalized direction. hits[i] receives the result for
+ * rays[i], with material 0 meaning nothing was hit. Hits on instances report
+ * the voxel and normal in the model's grid and set `instance`.
+ *
+ * Rays are split into jobs of several packets of RAY_PACKET_SIZE rays. Each
+ * packet is set up and clipped against the world in structure of arrays
+ * form, and only the lanes that survive go through the same per-ray traversal
+ * the renderer uses. Does not allocate: scratch space is borrowed from the
+ * calling thread's frame arena and handed back before returning.
+ */
+trace_stats trace_rays(const world& w, const instance_set* instances, std::span<const ray> rays, std::span<hit> hits, job_system& jobs);
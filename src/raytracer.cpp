@@ -0,0 +1,434 @@
+#include "raytracer.hpp"
+#include "alloc_counter.hpp"
+#include "cpu_features.hpp"
+#include "instances.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <memory>
+
+namespace {
+
+int box_exit(glm::vec3 origin, glm::vec3 inv_dir, glm::ivec3 lo, glm::ivec3 hi, float& t_exit) {
+	int axis = 0;
+	t_exit = std::numeric_limits<float>::infinity();
+
+	for (int i = 0; i < 3; i++) {
+		const float bound = static_cast<float>(inv_dir[i] > 0.0f ? hi[i] : lo[i]);
+		const float t = (bound - origin[i]) * inv_dir[i];
+		if (t < t_exit) {
+			t_exit = t;
+			axis = i;
+		}
+	}
+
+	return axis;
+}
+
+glm::vec3 shade(const render_settings& settings, const instance_set* instances, glm::vec3 direction, bool found, const hit& h) {
+	if (!found) {
+		return sky_color(direction);
+	}
+
+	const glm::vec3 normal = h.instance == NO_INSTANCE ? glm::vec3(h.normal) : instances->world_normal(h);
+	const float lambert = std::max(glm::dot(normal, settings.sun_direction), 0.0f);
+	return h.color * (0.35f + 0.65f * lambert);
+}
+
+}
+
+glm::vec3 safe_inverse(glm::vec3 direction) {
+	constexpr float DIRECTION_EPSILON = 1e-8f;
+
+	glm::vec3 inv;
+	for (int i = 0; i < 3; i++) {
+		const float d = std::abs(direction[i]) < DIRECTION_EPSILON ? std::copysign(DIRECTION_EPSILON, direction[i]) : direction[i];
+		inv[i] = 1.0f / d;
+	}
+
+	return inv;
+}
+
+namespace {
+
+VOXEL_KERNEL bool trace_ray_kernel(const world& w, glm::vec3 origin, glm::vec3 direction, float t_min, float t_max, hit& out, trace_stats& stats, const trace_options& options) {
+	stats.rays++;
+
+	const glm::vec3 inv_dir = safe_inverse(direction);
+	const glm::ivec3 step(inv_dir.x > 0.0f ? 1 : -1, inv_dir.y > 0.0f ? 1 : -1, inv_dir.z > 0.0f ? 1 : -1);
+	const glm::ivec3 world_size = w.size();
+
+	float t_enter = t_min;
+	float t_end = t_max;
+	int enter_axis = -1;
+
+	for (int i = 0; i < 3; i++) {
+		float t0 = -origin[i] * inv_dir[i];
+		float t1 = (static_cast<float>(world_size[i]) - origin[i]) * inv_dir[i];
+		if (t0 > t1) {
+			std::swap(t0, t1);
+		}
+
+		if (t0 > t_enter) {
+			t_enter = t0;
+			enter_axis = i;
+		}
+
+		t_end = std::min(t_end, t1);
+	}
+
+	if (t_enter > t_end) {
+		return false;
+	}
+
+	float t = t_enter;
+	glm::ivec3 voxel = glm::clamp(glm::ivec3(glm::floor(origin + direction * t)), glm::ivec3(0), world_size - 1);
+	glm::ivec3 normal(0);
+
+	if (enter_axis >= 0) {
+		voxel[enter_axis] = step[enter_axis] > 0 ? 0 : world_size[enter_axis] - 1;
+		normal[enter_axis] = -step[enter_axis];
+	}
+
+	while (t <= t_end && w.in_bounds(voxel)) {
+		const glm::ivec3 brick_coord = voxel >> BRICK_SHIFT;
+		const uint32_t brick_index = w.brick_index(brick_coord);
+		stats.coarse_steps++;
+
+		if (brick_index == EMPTY_BRICK) {
+			glm::ivec3 lo;
+			glm::ivec3 hi;
+
+			if (options.skip == empty_skip::distance_field) {
+				// Every brick closer than the stored distance is empty, so the cube around this one can be crossed at once.
+				const int reach = std::max(w.brick_distance(brick_coord) - 1, 0);
+				lo = (brick_coord - reach) * BRICK_SIZE;
+				hi = (brick_coord + reach + 1) * BRICK_SIZE;
+			}
+			else {
+				// Climb to the coarsest empty cell and jump straight to its far side.
+				int level = 0;
+				while (level + 1 < w.occupancy_levels() && !w.is_occupied(level + 1, brick_coord >> (level + 1))) {
+					level++;
+				}
+
+				lo = ((brick_coord >> level) << level) * BRICK_SIZE;
+				hi = lo + (BRICK_SIZE << level);
+			}
+
+			float t_exit;
+			const int axis = box_exit(origin, inv_dir, lo, hi, t_exit);
+			t = std::max(t, t_exit);
+
+			const glm::vec3 p = origin + direction * t;
+			for (int i = 0; i < 3; i++) {
+				voxel[i] = std::clamp(static_cast<int>(std::floor(p[i])), lo[i], hi[i] - 1);
+			}
+
+			voxel[axis] = step[axis] > 0 ? hi[axis] : lo[axis] - 1;
+			normal = glm::ivec3(0);
+			normal[axis] = -step[axis];
+			continue;
+		}
+
+		// Pick the coarsest level whose cells still cover no more than the pixel footprint at this distance.
+		const bool coarse = world::is_coarse(brick_index);
+		const brick* b = coarse ? nullptr : &w.get_brick(brick_index);
+		const brick_lod& lod = w.get_brick_lod(brick_index);
+		int level = coarse ? 1 : 0;
+		while (level + 1 < BRICK_LOD_LEVELS && static_cast<float>(2 << level) <= t * options.lod_scale) {
+			level++;
+		}
+
+		const int cell_size = 1 << level;
+		const int cell_count = BRICK_SIZE >> level;
+		const glm::ivec3 base = brick_coord * BRICK_SIZE;
+		const glm::vec3 t_delta = glm::abs(inv_dir) * static_cast<float>(cell_size);
+		glm::ivec3 cell = (voxel - base) >> level;
+		glm::vec3 t_side;
+
+		for (int i = 0; i < 3; i++) {
+			t_side[i] = (static_cast<float>(base[i] + (cell[i] + (step[i] > 0 ? 1 : 0)) * cell_size) - origin[i]) * inv_dir[i];
+		}
+
+		while (true) {
+			stats.fine_steps++;
+
+			if (level == 0 ? brick_is_solid(*b, cell) : lod_is_solid(lod, level, cell)) {
+				out.t = t;
+				out.voxel = voxel;
+				out.normal = normal;
+				out.instance = NO_INSTANCE;
+
+				if (level == 0) {
+					out.material = b->materials[brick_voxel_index(cell)];
+					out.color = material_color(out.material);
+				}
+				else {
+					const lod_cell& c = lod.cells[lod_cell_index(level, cell)];
+					out.material = c.material;
+					out.color = glm::vec3(c.color) / 255.0f;
+				}
+
+				return true;
+			}
+
+			// `voxel` follows the first voxel entered in each new cell, so leaving the brick lands next to it.
+			const int axis = t_side.x < t_side.y ? (t_side.x < t_side.z ? 0 : 2) : (t_side.y < t_side.z ? 1 : 2);
+			t = t_side[axis];
+			t_side[axis] += t_delta[axis];
+			cell[axis] += step[axis];
+			voxel[axis] = base[axis] + cell[axis] * cell_size + (step[axis] > 0 ? 0 : cell_size - 1);
+			normal = glm::ivec3(0);
+			normal[axis] = -step[axis];
+
+			if (t > t_end) {
+				return false;
+			}
+
+			if (cell[axis] < 0 || cell[axis] >= cell_count) {
+				break;
+			}
+		}
+	}
+
+	return false;
+}
+
+#if VOXEL_ISA_DISPATCH
+VOXEL_TARGET_SSE42 bool trace_ray_sse42(const world& w, glm::vec3 origin, glm::vec3 direction, float t_min, float t_max, hit& out, trace_stats& stats, const trace_options& options) {
+	return trace_ray_kernel(w, origin, direction, t_min, t_max, out, stats, options);
+}
+
+VOXEL_TARGET_AVX2 bool trace_ray_avx2(const world& w, glm::vec3 origin, glm::vec3 direction, float t_min, float t_max, hit& out, trace_stats& stats, const trace_options& options) {
+	return trace_ray_kernel(w, origin, direction, t_min, t_max, out, stats, options);
+}
+
+VOXEL_TARGET_AVX512 bool trace_ray_avx512(const world& w, glm::vec3 origin, glm::vec3 direction, float t_min, float t_max, hit& out, trace_stats& stats, const trace_options& options) {
+	return trace_ray_kernel(w, origin, direction, t_min, t_max, out, stats, options);
+}
+#endif
+
+}
+
+bool trace_ray(const world& w, glm::vec3 origin, glm::vec3 direction, float t_min, float t_max, hit& out, trace_stats& stats, const trace_options& options) {
+#if VOXEL_ISA_DISPATCH
+	switch (active_cpu_isa()) {
+	case cpu_isa::avx512: return trace_ray_avx512(w, origin, direction, t_min, t_max, out, stats, options);
+	case cpu_isa::avx2: return trace_ray_avx2(w, origin, direction, t_min, t_max, out, stats, options);
+	case cpu_isa::sse42: return trace_ray_sse42(w, origin, direction, t_min, t_max, out, stats, options);
+	default: break;
+	}
+#endif
+
+	return trace_ray_kernel(w, origin, direction, t_min, t_max, out, stats, options);
+}
+
+float cone_safe_distance(const world& w, glm::vec3 origin, glm::vec3 axis, float spread, float t_max, trace_stats& stats) {
+	const int top_level = w.occupancy_levels() - 1;
+	int level = top_level;
+	float t = 0.0f;
+
+	while (t < t_max) {
+		stats.cone_steps++;
+
+		const glm::vec3 p = origin + axis * t;
+		const float radius = t * spread;
+
+		// The coarsest level we may stop at is the one whose cells are at least as wide as the cone.
+		int min_level = 0;
+		while (min_level < top_level && static_cast<float>(BRICK_SIZE << min_level) < 2.0f * radius) {
+			min_level++;
+		}
+
+		level = std::max(level, min_level);
+
+		// Pad the query by half a cell so that every empty answer guarantees forward progress.
+		const float cell_size = static_cast<float>(BRICK_SIZE << level);
+		const float reach = radius + cell_size * 0.5f;
+		const glm::ivec3 lo(glm::floor((p - reach) / cell_size));
+		const glm::ivec3 hi(glm::floor((p + reach) / cell_size));
+
+		bool occupied = false;
+		for (int z = lo.z; z <= hi.z && !occupied; z++) {
+			for (int y = lo.y; y <= hi.y && !occupied; y++) {
+				for (int x = lo.x; x <= hi.x && !occupied; x++) {
+					occupied = w.is_occupied(level, glm::ivec3(x, y, z));
+				}
+			}
+		}
+
+		if (occupied) {
+			if (level == min_level) {
+				return t;
+			}
+
+			level--;
+			continue;
+		}
+
+		// Advance until the cone's bounding sphere would leave the box of empty cells.
+		const glm::vec3 box_lo = glm::vec3(lo) * cell_size;
+		const glm::vec3 box_hi = glm::vec3(hi + 1) * cell_size;
+		float dt = std::numeric_limits<float>::infinity();
+
+		for (int i = 0; i < 3; i++) {
+			if (axis[i] + spread > 0.0f) {
+				dt = std::min(dt, (box_hi[i] - p[i] - radius) / (axis[i] + spread));
+			}
+
+			if (spread - axis[i] > 0.0f) {
+				dt = std::min(dt, (p[i] - radius - box_lo[i]) / (spread - axis[i]));
+			}
+		}
+
+		t += dt;
+		level = std::min(level + 1, top_level);
+	}
+
+	return t_max;
+}
+
+glm::vec3 pixel_direction(const camera& cam, const framebuffer& target, glm::vec2 pixel) {
+	const float aspect = static_cast<float>(target.width) / static_cast<float>(target.height);
+	const glm::vec2 screen(
+		pixel.x / static_cast<float>(target.width) * 2.0f - 1.0f,
+		1.0f - pixel.y / static_cast<float>(target.height) * 2.0f
+	);
+
+	return glm::normalize(cam.ray_direction(screen, aspect));
+}
+
+uint32_t pack_color(glm::vec3 color) {
+	const glm::vec3 c = glm::clamp(color, glm::vec3(0.0f), glm::vec3(1.0f)) * 255.0f + 0.5f;
+	return static_cast<uint32_t>(c.x) | (static_cast<uint32_t>(c.y) << 8) | (static_cast<uint32_t>(c.z) << 16) | 0xFF000000u;
+}
+
+glm::vec3 sky_color(glm::vec3 direction) {
+	return glm::mix(glm::vec3(0.78f, 0.86f, 0.95f), glm::vec3(0.35f, 0.55f, 0.85f), std::max(direction.y, 0.0f));
+}
+
+framebuffer::framebuffer(int width, int height)
+	: width(width), height(height), pixels(static_cast<size_t>(width) * height) {
+	tile_start.resize(static_cast<size_t>(tiles_x()) * tiles_y());
+}
+
+void framebuffer::resize(int new_width, int new_height) {
+	width = new_width;
+	height = new_height;
+	pixels.resize(static_cast<size_t>(width) * height);
+	tile_start.resize(static_cast<size_t>(tiles_x()) * tiles_y());
+}
+
+trace_stats render(const world& w, const instance_set* instances, const camera& cam, const render_settings& settings, framebuffer& target, job_system& jobs) {
+	jobs.begin_frame();
+
+	frame_arena& frame = jobs.arena(0);
+	const uint32_t tile_count = static_cast<uint32_t>(target.tiles_x() * target.tiles_y());
+
+	uint32_t* tiles = frame.allocate<uint32_t>(tile_count);
+	order_tiles(settings.order, target.tiles_x(), target.tiles_y(), tiles);
+
+	const uint32_t queue_count = std::min(jobs.thread_count(), tile_count);
+	tile_queue* queues = frame.allocate<tile_queue>(queue_count);
+	init_tile_queues(queues, queue_count, tile_count);
+
+	trace_stats* thread_stats = frame.allocate<trace_stats>(jobs.thread_count());
+	std::uninitialized_value_construct_n(thread_stats, jobs.thread_count());
+
+	// The footprint is the size of one pixel at unit distance, scaled by the quality knob.
+	trace_options options;
+	options.lod_scale = settings.lod_bias * 2.0f * std::tan(cam.fov_y * 0.5f) / static_cast<float>(target.height);
+	options.skip = settings.skip;
+
+	auto render_tile = [&](uint32_t tile, unsigned thread_index, trace_stats& stats) {
+		frame_arena& arena = jobs.arena(thread_index);
+		const size_t mark = arena.mark();
+
+		const int tile_x = static_cast<int>(tile) % target.tiles_x();
+		const int tile_y = static_cast<int>(tile) / target.tiles_x();
+		const int x0 = tile_x * TILE_SIZE;
+		const int y0 = tile_y * TILE_SIZE;
+		const int x1 = std::min(x0 + TILE_SIZE, target.width);
+		const int y1 = std::min(y0 + TILE_SIZE, target.height);
+
+		float t_start = 0.0f;
+		if (settings.cone_prepass) {
+			// Every pixel ray of the tile lies inside the cone spanned by the tile's corner rays.
+			const glm::vec3 corners[4] = {
+				pixel_direction(cam, target, glm::vec2(x0, y0)),
+				pixel_direction(cam, target, glm::vec2(x1, y0)),
+				pixel_direction(cam, target, glm::vec2(x0, y1)),
+				pixel_direction(cam, target, glm::vec2(x1, y1)),
+			};
+
+			const glm::vec3 axis = glm::normalize(corners[0] + corners[1] + corners[2] + corners[3]);
+			float spread = 0.0f;
+			for (const glm::vec3& corner : corners) {
+				spread = std::max(spread, glm::length(corner - axis));
+			}
+
+			t_start = cone_safe_distance(w, cam.position, axis, spread, settings.max_distance, stats);
+		}
+
+		target.tile_start[tile] = t_start;
+
+		const int pixel_count = (x1 - x0) * (y1 - y0);
+		ray* rays = arena.allocate<ray>(pixel_count);
+		hit* hits = arena.allocate<hit>(pixel_count);
+
+		for (int i = 0; i < pixel_count; i++) {
+			const int x = x0 + i % (x1 - x0);
+			const int y = y0 + i / (x1 - x0);
+			rays[i] = { cam.position, pixel_direction(cam, target, glm::vec2(x + 0.5f, y + 0.5f)), t_start, settings.max_distance };
+		}
+
+		for (int i = 0; i < pixel_count; i++) {
+			float t_max = rays[i].t_max;
+			if (trace_ray(w, rays[i].origin, rays[i].direction, rays[i].t_min, t_max, hits[i], stats, options)) {
+				t_max = hits[i].t;
+			}
+			else {
+				hits[i].material = 0;
+			}
+
+			if (instances) {
+				instances->trace(rays[i].origin, rays[i].direction, 0.0f, t_max, hits[i], stats);
+			}
+		}
+
+		for (int i = 0; i < pixel_count; i++) {
+			const int x = x0 + i % (x1 - x0);
+			const int y = y0 + i / (x1 - x0);
+			target.pixels[x + y * target.width] = pack_color(shade(settings, instances, rays[i].direction, hits[i].material != 0, hits[i]));
+		}
+
+		arena.rewind(mark);
+	};
+
+	// One job per queue. A thread that picks up a second job finds its queue already drained by thieves and just steals.
+	jobs.parallel_for(queue_count, [&](uint32_t queue, unsigned thread_index) {
+		const uint64_t allocations_before = thread_heap_allocations();
+		trace_stats stats;
+		uint32_t slot;
+		bool stolen;
+
+		while (take_tile(queues, queue_count, queue, slot, stolen)) {
+			render_tile(tiles[slot], thread_index, stats);
+			stats.stolen_tiles += stolen;
+		}
+
+		stats.heap_allocations = thread_heap_allocations() - allocations_before;
+		thread_stats[thread_index] += stats;
+	});
+
+	trace_stats stats;
+	for (unsigned i = 0; i < jobs.thread_count(); i++) {
+		stats += thread_stats[i];
+	}
+
+	assert(stats.heap_allocations == 0 && "render hot loop allocated from the heap");
+	return stats;
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include "camera.hpp"
+#include "jobs.hpp"
+#include "tile_schedule.hpp"
+#include "world.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+constexpr int TILE_SIZE = 8;
+constexpr uint32_t NO_INSTANCE = UINT32_MAX;
+
+class instance_set;
+
+struct ray {
+	glm::vec3 origin;
+	glm::vec3 direction;
+	float t_min;
+	float t_max;
+};
+
+struct hit {
+	float t;
+	glm::ivec3 voxel;
+	glm::ivec3 normal;
+	uint8_t material;
+
+	// The material's color, or the averaged color of a coarser level of detail cell.
+	glm::vec3 color;
+
+	// Hits on instances report voxel and normal in the model's own grid.
+	uint32_t instance;
+};
+
+struct trace_stats {
+	uint64_t rays = 0;
+	uint64_t coarse_steps = 0;
+	uint64_t fine_steps = 0;
+	uint64_t cone_steps = 0;
+	uint64_t tlas_steps = 0;
+	uint64_t heap_allocations = 0;
+	uint64_t stolen_tiles = 0;
+
+	uint64_t primary_steps() const { return coarse_steps + fine_steps; }
+
+	trace_stats& operator+=(const trace_stats& other) {
+		rays += other.rays;
+		coarse_steps += other.coarse_steps;
+		fine_steps += other.fine_steps;
+		cone_steps += other.cone_steps;
+		tlas_steps += other.tlas_steps;
+		heap_allocations += other.heap_allocations;
+		stolen_tiles += other.stolen_tiles;
+		return *this;
+	}
+};
+
+/* Reciprocal of a ray direction with zero components nudged away from zero. */
+glm::vec3 safe_inverse(glm::vec3 direction);
+
+enum class empty_skip {
+	// Climb the occupancy pyramid to the coarsest empty cell and jump to its far side.
+	pyramid,
+	// Leap across the empty cube of bricks given by the brick distance field.
+	distance_field,
+};
+
+struct trace_options {
+	/*
+	 * Width of the footprint (usually a pixel) per unit of distance. Each brick
+	 * is traversed at the coarsest level of detail whose cells are no wider
+	 * than the footprint where the ray enters it; 0 always uses full
+	 * resolution unless the brick is coarse-only.
+	 */
+	float lod_scale = 0.0f;
+	empty_skip skip = empty_skip::pyramid;
+};
+
+/*
+ * Walks the brick grid along the ray, starting at t_min, skipping empty
+ * space as selected by `options`. `direction` must be normalized; t is
+ * measured in voxels.
+ */
+bool trace_ray(const world& w, glm::vec3 origin, glm::vec3 direction, float t_min, float t_max, hit& out, trace_stats& stats, const trace_options& options = {});
+
+/*
+ * Marches a cone with apex at `origin` through the occupancy pyramid and
+ * returns the largest t for which the cone is known to be empty. `spread` is
+ * the cone radius per unit of distance along the axis.
+ */
+float cone_safe_distance(const world& w, glm::vec3 origin, glm::vec3 axis, float spread, float t_max, trace_stats& stats);
+
+struct render_settings {
+	bool cone_prepass = true;
+
+	// Quality against speed: bricks switch to a coarser level once its cells cover at most this many pixels. 0 disables.
+	float lod_bias = 1.0f;
+
+	empty_skip skip = empty_skip::pyramid;
+
+	// Order tiles are handed out in; each thread starts on its own contiguous run of it.
+	tile_order order = tile_order::hilbert;
+
+	float max_distance = 4096.0f;
+	glm::vec3 sun_direction = glm::normalize(glm::vec3(0.4f, 0.8f, 0.3f));
+};
+
+struct framebuffer {
+	int width = 0;
+	int height = 0;
+	std::vector<uint32_t> pixels;
+
+	/* Per 8x8 tile start distance found by the cone pre-pass. */
+	std::vector<float> tile_start;
+
+	framebuffer(int width, int height);
+
+	/* Changes the size without giving memory back, so shrinking and growing again within the peak does not allocate. */
+	void resize(int width, int height);
+
+	int tiles_x() const { return (width + TILE_SIZE - 1) / TILE_SIZE; }
+	int tiles_y() const { return (height + TILE_SIZE - 1) / TILE_SIZE; }
+};
+
+/* Normalized direction of the camera ray through a point in pixel coordinates. */
+glm::vec3 pixel_direction(const camera& cam, const framebuffer& target, glm::vec2 pixel);
+
+/* Packs a linear color clamped to [0, 1] into RGBA8. */
+uint32_t pack_color(glm::vec3 color);
+
+glm::vec3 sky_color(glm::vec3 direction);
+
+/*
+ * Renders one frame across the job system. All transient data (the tile job
+ * list, per-tile ray queues and hit records) comes from the per-thread frame
+ * arenas, which are reset at the start of the call.
+ *
+ * The tile list is split into one queue per thread along `settings.order`.
+ * Threads that run out of work steal from their neighbours' queues first.
+ *
+ * `instances` is optional. The cone pre-pass only covers the world grid, so
+ * instances are always traced from the camera.
+ */
+trace_stats render(const world& w, const instance_set* instances, const camera& cam, const render_settings& settings, framebuffer& target, job_system& jobs);
@@ -0,0 +1,374 @@
+#include "render_graph.hpp"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+
+// Accesses that modify memory; any other access only reads.
+constexpr VkAccessFlags WRITE_ACCESS = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_HOST_WRITE_BIT | VK_ACCESS_MEMORY_WRITE_BIT
+	| VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+
+VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize alignment) {
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+}
+
+render_graph::render_graph(gpu_context& context, uint32_t frame_slots) : m_context(context), m_frame_slots(std::max(frame_slots, 1u)) {}
+
+render_graph::~render_graph() {
+	const VkDevice device = m_context.device();
+	for (resource& r : m_resources) {
+		if (!r.transient) {
+			continue;
+		}
+
+		for (copy& c : r.copies) {
+			if (r.is_image) {
+				vkDestroyImageView(device, c.image.view, nullptr);
+				vkDestroyImage(device, c.image.image, nullptr);
+			} else {
+				vkDestroyBuffer(device, c.buffer, nullptr);
+			}
+		}
+	}
+
+	if (m_memory.memory != VK_NULL_HANDLE) {
+		m_context.allocator().free(m_memory);
+	}
+}
+
+graph_resource render_graph::create_buffer(std::string name, VkDeviceSize size, VkBufferUsageFlags usage) {
+	resource r;
+	r.name = std::move(name);
+	r.transient = true;
+	r.copies.resize(m_frame_slots);
+	r.size = size;
+	r.buffer_usage = usage;
+	m_resources.push_back(std::move(r));
+	return static_cast<graph_resource>(m_resources.size() - 1);
+}
+
+graph_resource render_graph::create_image(std::string name, uint32_t width, uint32_t height, VkFormat format, VkImageUsageFlags usage) {
+	resource r;
+	r.name = std::move(name);
+	r.transient = true;
+	r.is_image = true;
+	r.copies.resize(m_frame_slots);
+	r.extent = { width, height };
+	r.format = format;
+	r.image_usage = usage;
+	m_resources.push_back(std::move(r));
+	return static_cast<graph_resource>(m_resources.size() - 1);
+}
+
+graph_resource render_graph::import_buffer(std::string name) {
+	resource r;
+	r.name = std::move(name);
+	r.copies.resize(1);
+	m_resources.push_back(std::move(r));
+	return static_cast<graph_resource>(m_resources.size() - 1);
+}
+
+void render_graph::bind_buffer(graph_resource index, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size) {
+	resource& r = m_resources[index];
+	copy& c = r.copies[0];
+	if (c.buffer == buffer && r.offset == offset && r.size == size) {
+		return;
+	}
+
+	c.buffer = buffer;
+	c.state = {};
+	r.offset = offset;
+	r.size = size;
+}
+
+graph_pass render_graph::add_pass(std::string name, std::vector<graph_access> accesses, std::function<void(VkCommandBuffer)> record) {
+	m_passes.push_back({ std::move(name), std::move(accesses), std::move(record) });
+	return static_cast<graph_pass>(m_passes.size() - 1);
+}
+
+void render_graph::set_enabled(graph_pass pass, bool enabled) {
+	m_passes[pass].enabled = enabled;
+}
+
+void render_graph::compile() {
+	if (m_compiled) {
+		return;
+	}
+	m_compiled = true;
+
+	// A transient is live from the first pass that uses it to the last; its first use is where its contents start.
+	for (uint32_t p = 0; p < m_passes.size(); p++) {
+		for (const graph_access& access : m_passes[p].accesses) {
+			resource& r = m_resources[access.resource];
+			if (!r.transient) {
+				continue;
+			}
+
+			const bool writes = (access.access & WRITE_ACCESS) != 0;
+			if (r.first_pass == UINT32_MAX && !writes && !(r.is_image && access.access == 0)) {
+				throw std::runtime_error("Render graph pass " + m_passes[p].name + " reads " + r.name + " before anything writes it");
+			}
+			r.first_pass = std::min(r.first_pass, p);
+			r.last_pass = std::max(r.last_pass, p);
+		}
+	}
+
+	const VkDevice device = m_context.device();
+	std::vector<VkMemoryRequirements> requirements(m_resources.size());
+	for (size_t i = 0; i < m_resources.size(); i++) {
+		resource& r = m_resources[i];
+		if (!r.transient) {
+			continue;
+		}
+
+		// Every slot's copy is created the same way, so the first one's requirements stand for all of them.
+		for (copy& c : r.copies) {
+			if (r.is_image) {
+				VkImageCreateInfo image_info = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
+				image_info.imageType = VK_IMAGE_TYPE_2D;
+				image_info.format = r.format;
+				image_info.extent = { r.extent.width, r.extent.height, 1 };
+				image_info.mipLevels = 1;
+				image_info.arrayLayers = 1;
+				image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+				image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+				image_info.usage = r.image_usage;
+				image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+				image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+				vk_check(vkCreateImage(device, &image_info, nullptr, &c.image.image), "vkCreateImage");
+				c.image.extent = r.extent;
+			} else {
+				VkBufferCreateInfo buffer_info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+				buffer_info.size = r.size;
+				buffer_info.usage = r.buffer_usage;
+				buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+				vk_check(vkCreateBuffer(device, &buffer_info, nullptr, &c.buffer), "vkCreateBuffer");
+			}
+		}
+
+		if (r.is_image) {
+			vkGetImageMemoryRequirements(device, r.copies[0].image.image, &requirements[i]);
+		} else {
+			vkGetBufferMemoryRequirements(device, r.copies[0].buffer, &requirements[i]);
+		}
+	}
+
+	place_transients(requirements);
+	if (m_transient_size == 0) {
+		return;
+	}
+
+	// One allocation for every slot's transients, so it needs a memory type all of them accept. Slots follow each other at
+	// an offset that keeps every placement aligned.
+	VkMemoryRequirements combined = { 0, 1, ~0u };
+	for (size_t i = 0; i < m_resources.size(); i++) {
+		if (m_resources[i].transient) {
+			combined.alignment = std::max(combined.alignment, requirements[i].alignment);
+			combined.memoryTypeBits &= requirements[i].memoryTypeBits;
+		}
+	}
+	if (combined.memoryTypeBits == 0) {
+		throw std::runtime_error("Render graph transients have no memory type in common");
+	}
+	const VkDeviceSize granularity = std::max<VkDeviceSize>(m_context.properties().limits.bufferImageGranularity, 1);
+	const VkDeviceSize slot_stride = align_up(m_transient_size, std::max(combined.alignment, granularity));
+	combined.size = slot_stride * m_frame_slots;
+	m_memory = m_context.allocator().allocate(memory_pool::frame, combined, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+	for (resource& r : m_resources) {
+		if (!r.transient) {
+			continue;
+		}
+
+		for (uint32_t slot = 0; slot < m_frame_slots; slot++) {
+			copy& c = r.copies[slot];
+			const VkDeviceSize offset = m_memory.offset + slot * slot_stride + r.memory_offset;
+			if (!r.is_image) {
+				vk_check(vkBindBufferMemory(device, c.buffer, m_memory.memory, offset), "vkBindBufferMemory");
+				continue;
+			}
+
+			vk_check(vkBindImageMemory(device, c.image.image, m_memory.memory, offset), "vkBindImageMemory");
+
+			VkImageViewCreateInfo view_info = { VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO };
+			view_info.image = c.image.image;
+			view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+			view_info.format = r.format;
+			view_info.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+			vk_check(vkCreateImageView(device, &view_info, nullptr, &c.image.view), "vkCreateImageView");
+		}
+	}
+
+	spdlog::info("Render graph: {} passes, transients in {:.1f} MiB per frame slot ({:.1f} MiB without aliasing), {} slots", m_passes.size(),
+		m_transient_size / 1048576.0, m_unaliased_size / 1048576.0, m_frame_slots);
+}
+
+/*
+ * First fit, largest first: each transient goes at the lowest offset where it
+ * overlaps no transient already placed whose passes overlap its own. Unused
+ * transients are live in no pass and sit at offset 0. Offsets are aligned to
+ * bufferImageGranularity as well, since buffers and optimal images may end up
+ * side by side.
+ */
+void render_graph::place_transients(const std::vector<VkMemoryRequirements>& requirements) {
+	std::vector<graph_resource> order;
+	for (size_t i = 0; i < m_resources.size(); i++) {
+		if (m_resources[i].transient) {
+			order.push_back(static_cast<graph_resource>(i));
+		}
+	}
+	std::sort(order.begin(), order.end(), [&](graph_resource a, graph_resource b) {
+		return requirements[a].size > requirements[b].size;
+	});
+
+	auto live_together = [&](const resource& a, const resource& b) {
+		return a.first_pass <= b.last_pass && b.first_pass <= a.last_pass;
+	};
+	auto share_bytes = [](const resource& a, const resource& b) {
+		return a.memory_offset < b.memory_offset + b.memory_size && b.memory_offset < a.memory_offset + a.memory_size;
+	};
+
+	const VkDeviceSize granularity = std::max<VkDeviceSize>(m_context.properties().limits.bufferImageGranularity, 1);
+	std::vector<graph_resource> placed;
+	for (graph_resource index : order) {
+		resource& r = m_resources[index];
+		const VkDeviceSize alignment = std::max(requirements[index].alignment, granularity);
+		r.memory_size = requirements[index].size;
+		r.memory_offset = 0;
+
+		for (bool moved = true; moved;) {
+			moved = false;
+			for (graph_resource other : placed) {
+				const resource& o = m_resources[other];
+				if (live_together(r, o) && share_bytes(r, o)) {
+					r.memory_offset = align_up(o.memory_offset + o.memory_size, alignment);
+					moved = true;
+				}
+			}
+		}
+
+		placed.push_back(index);
+		m_transient_size = std::max(m_transient_size, r.memory_offset + r.memory_size);
+		m_unaliased_size += r.memory_size;
+	}
+
+	for (graph_resource index : placed) {
+		for (graph_resource other : placed) {
+			if (share_bytes(m_resources[index], m_resources[other])) {
+				m_resources[index].aliases.push_back(other);
+			}
+		}
+	}
+}
+
+void render_graph::execute(VkCommandBuffer command_buffer, uint32_t slot) {
+	for (resource& r : m_resources) {
+		copy_of(r, slot).discard = r.transient;
+	}
+
+	for (pass& p : m_passes) {
+		if (!p.enabled) {
+			continue;
+		}
+
+		VkPipelineStageFlags src_stages = 0;
+		VkPipelineStageFlags dst_stages = 0;
+		m_buffer_barriers.clear();
+		m_image_barriers.clear();
+
+		for (const graph_access& access : p.accesses) {
+			resource& r = m_resources[access.resource];
+			copy& c = copy_of(r, slot);
+			sync_state& state = c.state;
+			const bool writes = (access.access & WRITE_ACCESS) != 0;
+
+			// What this access has to wait for: everything since the last write for a write or a layout change, the
+			// write alone for a read it is not yet visible to.
+			VkPipelineStageFlags wait_stages = 0;
+			VkAccessFlags wait_access = 0;
+			VkImageLayout old_layout = state.layout;
+			if (c.discard) {
+				// The bytes were last used by this resource in the slot's previous frame or by an alias; their contents are dropped.
+				for (graph_resource alias : r.aliases) {
+					const sync_state& previous = copy_of(m_resources[alias], slot).state;
+					wait_stages |= previous.write_stages | previous.read_stages;
+					wait_access |= previous.write_access;
+				}
+				old_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+				c.discard = false;
+			} else if (writes || (r.is_image && access.layout != state.layout)) {
+				wait_stages = state.write_stages | state.read_stages;
+				wait_access = state.write_access;
+			} else if ((access.stages & ~state.read_stages) != 0 || (access.access & ~state.visible) != 0) {
+				wait_stages = state.write_stages;
+				wait_access = state.write_access;
+			}
+
+			// A layout change counts as a write by the stages that wait for it.
+			const bool transition = r.is_image && access.layout != old_layout;
+			if (writes || transition) {
+				state.write_stages = access.stages;
+				state.write_access = access.access & WRITE_ACCESS;
+				state.read_stages = writes ? 0 : access.stages;
+				state.visible = writes ? 0 : access.access;
+			} else {
+				state.read_stages |= access.stages;
+				state.visible |= access.access;
+			}
+			if (r.is_image) {
+				state.layout = access.layout;
+			}
+
+			if (wait_stages == 0 && !transition) {
+				continue;
+			}
+
+			// A layout change of memory nothing has used yet waits for nothing.
+			src_stages |= wait_stages != 0 ? wait_stages : static_cast<VkPipelineStageFlags>(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT);
+			dst_stages |= access.stages;
+
+			// Write after read only needs the stage masks.
+			if (!transition && wait_access == 0 && writes) {
+				continue;
+			}
+
+			if (r.is_image) {
+				VkImageMemoryBarrier barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+				barrier.srcAccessMask = wait_access;
+				barrier.dstAccessMask = access.access;
+				barrier.oldLayout = old_layout;
+				barrier.newLayout = access.layout;
+				barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+				barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+				barrier.image = c.image.image;
+				barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+				m_image_barriers.push_back(barrier);
+			} else {
+				VkBufferMemoryBarrier barrier = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER };
+				barrier.srcAccessMask = wait_access;
+				barrier.dstAccessMask = access.access;
+				barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+				barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+				barrier.buffer = c.buffer;
+				barrier.offset = r.offset;
+				barrier.size = r.size;
+				m_buffer_barriers.push_back(barrier);
+			}
+		}
+
+		if (src_stages != 0) {
+			vkCmdPipelineBarrier(command_buffer, src_stages, dst_stages, 0, 0, nullptr, static_cast<uint32_t>(m_buffer_barriers.size()), m_buffer_barriers.data(),
+				static_cast<uint32_t>(m_image_barriers.size()), m_image_barriers.data());
+		}
+
+		if (p.record) {
+			p.record(command_buffer);
+		}
+	}
+}
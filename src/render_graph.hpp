@@ -0,0 +1,160 @@
+#pragma once
+
+#include "gpu_context.hpp"
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+/* Index of a resource or a pass in its render_graph. */
+using graph_resource = uint32_t;
+using graph_pass = uint32_t;
+
+/*
+ * How a pass uses a resource: the stages that touch it and the accesses they
+ * make. Accesses with a write bit make it a write. Images are used in `layout`.
+ */
+struct graph_access {
+	graph_resource resource;
+	VkPipelineStageFlags stages;
+	VkAccessFlags access;
+	VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+};
+
+/*
+ * The passes of a frame in recording order, with the resources each one reads
+ * and writes, so that none of them records its own barriers. Before each pass,
+ * execute() compares the pass's accesses with what happened to the resources
+ * since their last write. A read gets a barrier only if the write has not
+ * already been made visible to its stages. A write waits for earlier reads
+ * with an execution dependency alone. An image gets a barrier when it has to
+ * change layout. All of a pass's barriers go into one vkCmdPipelineBarrier,
+ * and a pass that needs none records nothing.
+ *
+ * What a resource went through carries over from one execute() to the next.
+ * Every execute() runs on the same queue, so a barrier in one frame also
+ * orders it against the frames submitted before it.
+ *
+ * Transient resources belong to the graph and hold nothing from one frame to
+ * the next. Their first use in a frame must write them or, for images, set
+ * their layout, and their old contents are discarded. compile() works out,
+ * from the declared accesses, the span of passes in which each transient is
+ * live. It then places them in a single allocation, and transients whose
+ * spans do not overlap share memory. Each of the `frame_slots` frames in
+ * flight gets its own copy of that placement, so aliasing only ever reorders
+ * passes within a frame and frames in different slots never wait for each
+ * other's transients. The first use of a transient waits for whatever last
+ * used its bytes in the same slot.
+ *
+ * Imported resources belong to the caller and keep their contents. There is
+ * one of each for all slots. bind_buffer() points one at a buffer range. A
+ * newly bound range starts with no history, so the caller has to know that the
+ * GPU is done with it, as with a per-frame slice whose frame has finished.
+ */
+class render_graph {
+public:
+	render_graph(gpu_context& context, uint32_t frame_slots);
+	~render_graph();
+
+	render_graph(const render_graph&) = delete;
+	render_graph& operator=(const render_graph&) = delete;
+
+	graph_resource create_buffer(std::string name, VkDeviceSize size, VkBufferUsageFlags usage);
+	graph_resource create_image(std::string name, uint32_t width, uint32_t height, VkFormat format, VkImageUsageFlags usage);
+	graph_resource import_buffer(std::string name);
+
+	void bind_buffer(graph_resource resource, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size);
+
+	/* Passes run in the order they are added. */
+	graph_pass add_pass(std::string name, std::vector<graph_access> accesses, std::function<void(VkCommandBuffer)> record);
+
+	/* Disabled passes are skipped by execute() as if they had not been added. */
+	void set_enabled(graph_pass pass, bool enabled);
+
+	/* Places and creates the transient resources. Nothing can be added afterwards. Throws if a transient is read before it is written. */
+	void compile();
+
+	/* Records the enabled passes with the transients of `slot`. */
+	void execute(VkCommandBuffer command_buffer, uint32_t slot);
+
+	/* A transient's copy in `slot`; imported resources ignore the slot. */
+	VkBuffer buffer(graph_resource resource, uint32_t slot) const { return copy_of(m_resources[resource], slot).buffer; }
+	const gpu_image& image(graph_resource resource, uint32_t slot) const { return copy_of(m_resources[resource], slot).image; }
+
+	/* The size of one slot's transients, and the total they would need with no memory shared. */
+	VkDeviceSize transient_size() const { return m_transient_size; }
+	VkDeviceSize unaliased_size() const { return m_unaliased_size; }
+
+private:
+	// What has happened to a resource since it was last written. `read_stages` and `visible` say which stages and accesses already
+	// see the write.
+	struct sync_state {
+		VkPipelineStageFlags write_stages = 0;
+		VkAccessFlags write_access = 0;
+		VkPipelineStageFlags read_stages = 0;
+		VkAccessFlags visible = 0;
+		VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+	};
+
+	// The Vulkan objects behind a resource in one slot, what happened to them and whether their first use of the frame is
+	// still to come.
+	struct copy {
+		VkBuffer buffer = VK_NULL_HANDLE;
+		gpu_image image;
+		sync_state state;
+		bool discard = false;
+	};
+
+	struct resource {
+		std::string name;
+		bool transient = false;
+		bool is_image = false;
+
+		// One copy per slot for transients, a single one for imported resources.
+		std::vector<copy> copies;
+		VkDeviceSize offset = 0;
+		VkDeviceSize size = 0;
+		VkExtent2D extent = {};
+
+		// Transients only: creation parameters, the passes they are live in and their place in a slot's memory.
+		VkBufferUsageFlags buffer_usage = 0;
+		VkImageUsageFlags image_usage = 0;
+		VkFormat format = VK_FORMAT_UNDEFINED;
+		uint32_t first_pass = UINT32_MAX;
+		uint32_t last_pass = 0;
+		VkDeviceSize memory_offset = 0;
+		VkDeviceSize memory_size = 0;
+
+		// Transients sharing bytes with this one, itself included.
+		std::vector<graph_resource> aliases;
+	};
+
+	struct pass {
+		std::string name;
+		std::vector<graph_access> accesses;
+		std::function<void(VkCommandBuffer)> record;
+		bool enabled = true;
+	};
+
+	static copy& copy_of(resource& r, uint32_t slot) { return r.copies[r.transient ? slot : 0]; }
+	static const copy& copy_of(const resource& r, uint32_t slot) { return r.copies[r.transient ? slot : 0]; }
+
+	void place_transients(const std::vector<VkMemoryRequirements>& requirements);
+
+	gpu_context& m_context;
+	uint32_t m_frame_slots;
+	std::vector<resource> m_resources;
+	std::vector<pass> m_passes;
+	bool m_compiled = false;
+
+	gpu_allocation m_memory;
+	VkDeviceSize m_transient_size = 0;
+	VkDeviceSize m_unaliased_size = 0;
+
+	// Reused by execute() for each pass.
+	std::vector<VkBufferMemoryBarrier> m_buffer_barriers;
+	std::vector<VkImageMemoryBarrier> m_image_barriers;
+};
@@ -0,0 +1,159 @@
+#include "resolution.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+constexpr int MAX_TAPS = 16;
+constexpr int ROWS_PER_JOB = 8;
+constexpr float LANCZOS_LOBES = 3.0f;
+
+struct filter_taps {
+	int first;
+	int count;
+	float weights[MAX_TAPS];
+};
+
+float filter_radius(upscale_filter filter) {
+	return filter == upscale_filter::lanczos ? LANCZOS_LOBES : 1.0f;
+}
+
+float sinc(float x) {
+	if (std::abs(x) < 1e-6f) {
+		return 1.0f;
+	}
+
+	const float px = 3.14159265f * x;
+	return std::sin(px) / px;
+}
+
+float filter_weight(upscale_filter filter, float x) {
+	x = std::abs(x);
+	if (filter == upscale_filter::bilinear) {
+		return std::max(1.0f - x, 0.0f);
+	}
+
+	return x < LANCZOS_LOBES ? sinc(x) * sinc(x / LANCZOS_LOBES) : 0.0f;
+}
+
+/*
+ * Weights for every target coordinate along one axis. When downscaling the
+ * kernel is widened by the ratio so it still low-passes; taps past the
+ * image edge are folded onto the edge pixel.
+ */
+void build_taps(filter_taps* taps, int source_size, int target_size, upscale_filter filter) {
+	const float ratio = static_cast<float>(source_size) / static_cast<float>(target_size);
+	const float widen = std::max(ratio, 1.0f);
+	const float radius = std::min(filter_radius(filter) * widen, static_cast<float>(MAX_TAPS - 1) * 0.5f);
+
+	for (int i = 0; i < target_size; i++) {
+		filter_taps& t = taps[i];
+		const float center = (static_cast<float>(i) + 0.5f) * ratio - 0.5f;
+		const int first = static_cast<int>(std::ceil(center - radius));
+		const int last = static_cast<int>(std::floor(center + radius));
+
+		t.first = std::clamp(first, 0, source_size - 1);
+		t.count = std::clamp(last, 0, source_size - 1) - t.first + 1;
+		std::fill(t.weights, t.weights + MAX_TAPS, 0.0f);
+
+		float total = 0.0f;
+		for (int j = first; j <= last; j++) {
+			const float weight = filter_weight(filter, (static_cast<float>(j) - center) / widen);
+			t.weights[std::clamp(j, 0, source_size - 1) - t.first] += weight;
+			total += weight;
+		}
+
+		for (int k = 0; k < t.count; k++) {
+			t.weights[k] /= total;
+		}
+	}
+}
+
+glm::vec3 unpack_color(uint32_t packed) {
+	return glm::vec3(static_cast<float>(packed & 0xFF), static_cast<float>((packed >> 8) & 0xFF), static_cast<float>((packed >> 16) & 0xFF)) * (1.0f / 255.0f);
+}
+
+}
+
+const char* upscale_filter_name(upscale_filter filter) {
+	switch (filter) {
+	case upscale_filter::bilinear: return "bilinear";
+	case upscale_filter::lanczos: return "lanczos";
+	}
+
+	return "unknown";
+}
+
+void upscale(const framebuffer& source, framebuffer& target, upscale_filter filter, job_system& jobs) {
+	if (source.width == target.width && source.height == target.height) {
+		target.pixels = source.pixels;
+		return;
+	}
+
+	// Borrow the calling thread's arena and hand the space back before returning, as the frame it belongs to is still in flight.
+	frame_arena& arena = jobs.arena(0);
+	const size_t mark = arena.mark();
+
+	filter_taps* columns = arena.allocate<filter_taps>(target.width);
+	filter_taps* rows = arena.allocate<filter_taps>(target.height);
+	glm::vec3* horizontal = arena.allocate<glm::vec3>(static_cast<size_t>(target.width) * source.height);
+
+	build_taps(columns, source.width, target.width, filter);
+	build_taps(rows, source.height, target.height, filter);
+
+	const uint32_t source_jobs = static_cast<uint32_t>((source.height + ROWS_PER_JOB - 1) / ROWS_PER_JOB);
+	jobs.parallel_for(source_jobs, [&](uint32_t job, unsigned) {
+		const int end = std::min(source.height, static_cast<int>(job + 1) * ROWS_PER_JOB);
+		for (int y = static_cast<int>(job) * ROWS_PER_JOB; y < end; y++) {
+			const uint32_t* row = source.pixels.data() + static_cast<size_t>(y) * source.width;
+
+			for (int x = 0; x < target.width; x++) {
+				const filter_taps& t = columns[x];
+				glm::vec3 sum(0.0f);
+				for (int k = 0; k < t.count; k++) {
+					sum += unpack_color(row[t.first + k]) * t.weights[k];
+				}
+
+				horizontal[static_cast<size_t>(y) * target.width + x] = sum;
+			}
+		}
+	});
+
+	const uint32_t target_jobs = static_cast<uint32_t>((target.height + ROWS_PER_JOB - 1) / ROWS_PER_JOB);
+	jobs.parallel_for(target_jobs, [&](uint32_t job, unsigned) {
+		const int end = std::min(target.height, static_cast<int>(job + 1) * ROWS_PER_JOB);
+		for (int y = static_cast<int>(job) * ROWS_PER_JOB; y < end; y++) {
+			const filter_taps& t = rows[y];
+
+			for (int x = 0; x < target.width; x++) {
+				glm::vec3 sum(0.0f);
+				for (int k = 0; k < t.count; k++) {
+					sum += horizontal[static_cast<size_t>(t.first + k) * target.width + x] * t.weights[k];
+				}
+
+				target.pixels[static_cast<size_t>(y) * target.width + x] = pack_color(sum);
+			}
+		}
+	});
+
+	arena.rewind(mark);
+}
+
+resolution_controller::resolution_controller(glm::ivec2 output_size, double target_ms, float min_scale, float max_scale)
+	: m_output_size(output_size), m_target_ms(target_ms), m_scale(max_scale), m_min_scale(min_scale), m_max_scale(max_scale) {
+}
+
+glm::ivec2 resolution_controller::update(double frame_ms) {
+	// The frame just finished was rendered at m_scale.
+	const double cost_ms = frame_ms / (static_cast<double>(m_scale) * m_scale);
+	m_smoothed_cost_ms = m_smoothed_cost_ms == 0.0 || frame_ms > m_target_ms ? cost_ms : m_smoothed_cost_ms * 0.5 + cost_ms * 0.5;
+
+	const float desired = static_cast<float>(std::sqrt(m_target_ms / std::max(m_smoothed_cost_ms, 1e-6)));
+	m_scale = std::clamp(m_scale + (desired - m_scale) * 0.5f, m_min_scale, m_max_scale);
+	return render_size();
+}
+
+glm::ivec2 resolution_controller::render_size() const {
+	return glm::max(glm::ivec2(glm::round(glm::vec2(m_output_size) * m_scale)), glm::ivec2(1));
+}
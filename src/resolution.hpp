@@ -0,0 +1,55 @@
+#pragma once
+
+#include "jobs.hpp"
+#include "raytracer.hpp"
+
+#include <glm/glm.hpp>
+
+enum class upscale_filter {
+	bilinear,
+	lanczos,
+};
+
+const char* upscale_filter_name(upscale_filter filter);
+
+/*
+ * Resamples source to the size of target with a separable filter: a
+ * horizontal pass into a float buffer from the calling thread's frame arena,
+ * then a vertical pass that packs the result. Lanczos uses three lobes and
+ * can ring slightly at hard edges; the result is clamped.
+ */
+void upscale(const framebuffer& source, framebuffer& target, upscale_filter filter, job_system& jobs);
+
+/*
+ * Picks the internal render resolution that keeps frames at a target time.
+ * Render cost scales with the pixel count, so each frame's time divided by
+ * its scale squared gives a cost per full resolution frame that does not
+ * depend on the scale it was measured at. The scale that would hit the
+ * target is the square root of target over that cost, and the controller
+ * moves halfway there each frame.
+ *
+ * The cost is smoothed asymmetrically: an over-target frame is taken at face
+ * value straight away, while other frames pull the average halfway towards
+ * them. Under a sudden load spike the resolution drops on the next frame, and
+ * it comes back up within a few frames of the spike passing.
+ */
+class resolution_controller {
+public:
+	resolution_controller(glm::ivec2 output_size, double target_ms, float min_scale = 0.5f, float max_scale = 1.0f);
+
+	/* Feeds the time of the frame just finished and returns the size to render the next one at. */
+	glm::ivec2 update(double frame_ms);
+
+	glm::ivec2 render_size() const;
+	float scale() const { return m_scale; }
+	float min_scale() const { return m_min_scale; }
+	double smoothed_cost_ms() const { return m_smoothed_cost_ms; }
+
+private:
+	glm::ivec2 m_output_size;
+	double m_target_ms;
+	double m_smoothed_cost_ms = 0.0;
+	float m_scale;
+	float m_min_scale;
+	float m_max_scale;
+};
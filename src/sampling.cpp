@@ -0,0 +1,383 @@
+#include "sampling.hpp"
+#include "alloc_counter.hpp"
+#include "instances.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <memory>
+
+namespace {
+
+constexpr int64_t PATH_RAYS = 3;
+constexpr float SURFACE_OFFSET = 1e-3f;
+constexpr float SUN_STRENGTH = 0.65f;
+constexpr float BOUNCE_STRENGTH = 0.45f;
+
+struct scene {
+	const world& w;
+	const instance_set* instances;
+	const camera& cam;
+	const render_settings& settings;
+	const adaptive_settings& adaptive;
+	const framebuffer& target;
+	trace_options options;
+};
+
+struct pixel_accum {
+	glm::vec3 sum;
+	float luminance;
+	float luminance2;
+	uint32_t count;
+};
+
+struct tile_rect {
+	int x0;
+	int y0;
+	int x1;
+	int y1;
+
+	int pixel_count() const { return (x1 - x0) * (y1 - y0); }
+};
+
+/* PCG based generator, seeded per pixel and sample so results do not depend on which thread ran the tile. */
+struct sample_rng {
+	uint32_t state;
+
+	sample_rng(uint32_t pixel, uint32_t sample, uint32_t frame)
+		: state(pixel * 0x9E3779B9u ^ (sample + 1) * 0x85EBCA6Bu ^ (frame + 1) * 0xC2B2AE35u) {
+		next();
+	}
+
+	float next() {
+		state = state * 747796405u + 2891336453u;
+		uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+		word = (word >> 22u) ^ word;
+		return static_cast<float>(word >> 8) * (1.0f / 16777216.0f);
+	}
+};
+
+tile_rect tile_bounds(const framebuffer& target, uint32_t tile) {
+	const int x0 = static_cast<int>(tile) % target.tiles_x() * TILE_SIZE;
+	const int y0 = static_cast<int>(tile) / target.tiles_x() * TILE_SIZE;
+	return { x0, y0, std::min(x0 + TILE_SIZE, target.width), std::min(y0 + TILE_SIZE, target.height) };
+}
+
+float luminance(glm::vec3 color) {
+	return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+bool trace_scene(const scene& s, glm::vec3 origin, glm::vec3 direction, hit& h, trace_stats& stats) {
+	float t_max = s.settings.max_distance;
+	bool found = trace_ray(s.w, origin, direction, 0.0f, t_max, h, stats, s.options);
+	if (found) {
+		t_max = h.t;
+	}
+
+	if (s.instances && s.instances->trace(origin, direction, 0.0f, t_max, h, stats)) {
+		found = true;
+	}
+
+	return found;
+}
+
+glm::vec3 surface_normal(const scene& s, const hit& h) {
+	return h.instance == NO_INSTANCE ? glm::vec3(h.normal) : s.instances->world_normal(h);
+}
+
+glm::vec3 cosine_direction(glm::vec3 normal, sample_rng& rng) {
+	const glm::vec3 helper = std::abs(normal.x) > 0.5f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+	const glm::vec3 tangent = glm::normalize(glm::cross(helper, normal));
+	const glm::vec3 bitangent = glm::cross(normal, tangent);
+
+	const float u = rng.next();
+	const float phi = 6.2831853f * rng.next();
+	const float r = std::sqrt(u);
+	return glm::normalize(tangent * (r * std::cos(phi)) + bitangent * (r * std::sin(phi)) + normal * std::sqrt(1.0f - u));
+}
+
+/* One path: primary hit, sun visibility and a single diffuse bounce whose hit is lit without another shadow ray. */
+glm::vec3 path_sample(const scene& s, glm::vec3 direction, sample_rng& rng, trace_stats& stats) {
+	hit h;
+	if (!trace_scene(s, s.cam.position, direction, h, stats)) {
+		return sky_color(direction);
+	}
+
+	const glm::vec3 normal = surface_normal(s, h);
+	const glm::vec3 p = s.cam.position + direction * h.t + normal * SURFACE_OFFSET;
+	glm::vec3 light(0.0f);
+
+	const float lambert = glm::dot(normal, s.settings.sun_direction);
+	hit blocker;
+	if (lambert > 0.0f && !trace_scene(s, p, s.settings.sun_direction, blocker, stats)) {
+		light += glm::vec3(SUN_STRENGTH * lambert);
+	}
+
+	const glm::vec3 bounce = cosine_direction(normal, rng);
+	hit bounce_hit;
+	if (trace_scene(s, p, bounce, bounce_hit, stats)) {
+		const float bounce_lambert = std::max(glm::dot(surface_normal(s, bounce_hit), s.settings.sun_direction), 0.0f);
+		light += bounce_hit.color * (BOUNCE_STRENGTH * (0.35f + 0.65f * bounce_lambert));
+	}
+	else {
+		light += sky_color(bounce) * BOUNCE_STRENGTH;
+	}
+
+	return h.color * light;
+}
+
+glm::vec3 camera_sample(const scene& s, glm::vec2 pixel, sample_rng& rng, trace_stats& stats) {
+	const glm::vec2 jitter(rng.next(), rng.next());
+	return path_sample(s, pixel_direction(s.cam, s.target, pixel + jitter), rng, stats);
+}
+
+void sample_pixel(const scene& s, pixel_accum& accum, int x, int y, uint32_t sample, trace_stats& stats) {
+	sample_rng rng(static_cast<uint32_t>(x + y * s.target.width), sample, s.adaptive.frame);
+	const glm::vec3 color = camera_sample(s, glm::vec2(x, y), rng, stats);
+	const float l = luminance(color);
+
+	accum.sum += color;
+	accum.luminance += l;
+	accum.luminance2 += l * l;
+	accum.count++;
+}
+
+/*
+ * Most rays one sample can trace: each of the path's rays goes through the
+ * world and at most once through every instance, as each instance sits in one
+ * leaf of the instance BVH.
+ */
+int64_t max_sample_rays(const scene& s) {
+	return PATH_RAYS * (1 + (s.instances ? static_cast<int64_t>(s.instances->instance_count()) : 0));
+}
+
+/* Takes `rays` from the budget if that many are left, and leaves it untouched otherwise. */
+bool reserve_rays(std::atomic<int64_t>& remaining, int64_t rays) {
+	int64_t left = remaining.load(std::memory_order_relaxed);
+	while (left >= rays) {
+		if (remaining.compare_exchange_weak(left, left - rays, std::memory_order_relaxed)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Mean over the tile's pixels of the variance of each pixel's luminance estimate. */
+float tile_variance(const pixel_accum* accum, const tile_rect& rect, int width) {
+	float total = 0.0f;
+
+	for (int y = rect.y0; y < rect.y1; y++) {
+		for (int x = rect.x0; x < rect.x1; x++) {
+			const pixel_accum& a = accum[x + y * width];
+			const float n = static_cast<float>(a.count);
+			const float mean = a.luminance / n;
+			total += std::max(a.luminance2 / n - mean * mean, 0.0f) / n;
+		}
+	}
+
+	return total / static_cast<float>(rect.pixel_count());
+}
+
+bool is_periphery(const scene& s, const tile_rect& rect) {
+	if (!s.adaptive.foveated) {
+		return false;
+	}
+
+	const glm::vec2 center(static_cast<float>(rect.x0 + rect.x1) * 0.5f, static_cast<float>(rect.y0 + rect.y1) * 0.5f);
+	const glm::vec2 fovea = s.adaptive.fovea_center * glm::vec2(static_cast<float>(s.target.width), static_cast<float>(s.target.height));
+	return glm::length(center - fovea) > s.adaptive.fovea_radius * static_cast<float>(s.target.height);
+}
+
+/* Traces one sample point per periphery_scale^2 block of the tile and fills the pixels by bilinear interpolation within the tile. */
+uint64_t render_periphery(const scene& s, pixel_accum* accum, const tile_rect& rect, trace_stats& stats) {
+	const int scale = std::clamp(s.adaptive.periphery_scale, 1, TILE_SIZE);
+	const int width = (rect.x1 - rect.x0 + scale - 1) / scale;
+	const int height = (rect.y1 - rect.y0 + scale - 1) / scale;
+	glm::vec3 coarse[TILE_SIZE * TILE_SIZE];
+
+	for (int by = 0; by < height; by++) {
+		for (int bx = 0; bx < width; bx++) {
+			const glm::vec2 block(static_cast<float>(rect.x0 + bx * scale), static_cast<float>(rect.y0 + by * scale));
+			glm::vec3 sum(0.0f);
+
+			for (int i = 0; i < s.adaptive.base_samples; i++) {
+				sample_rng rng(static_cast<uint32_t>(rect.x0 + bx * scale + (rect.y0 + by * scale) * s.target.width), i, s.adaptive.frame);
+				const glm::vec2 offset(rng.next(), rng.next());
+				sum += path_sample(s, pixel_direction(s.cam, s.target, block + offset * static_cast<float>(scale)), rng, stats);
+			}
+
+			coarse[bx + by * width] = sum / static_cast<float>(s.adaptive.base_samples);
+		}
+	}
+
+	for (int y = rect.y0; y < rect.y1; y++) {
+		for (int x = rect.x0; x < rect.x1; x++) {
+			const float fx = std::clamp((static_cast<float>(x - rect.x0) + 0.5f) / static_cast<float>(scale) - 0.5f, 0.0f, static_cast<float>(width - 1));
+			const float fy = std::clamp((static_cast<float>(y - rect.y0) + 0.5f) / static_cast<float>(scale) - 0.5f, 0.0f, static_cast<float>(height - 1));
+			const int ix = std::min(static_cast<int>(fx), width - 1);
+			const int iy = std::min(static_cast<int>(fy), height - 1);
+			const int jx = std::min(ix + 1, width - 1);
+			const int jy = std::min(iy + 1, height - 1);
+			const float tx = fx - static_cast<float>(ix);
+			const float ty = fy - static_cast<float>(iy);
+
+			const glm::vec3 top = glm::mix(coarse[ix + iy * width], coarse[jx + iy * width], tx);
+			const glm::vec3 bottom = glm::mix(coarse[ix + jy * width], coarse[jx + jy * width], tx);
+			accum[x + y * s.target.width] = { glm::mix(top, bottom, ty), 0.0f, 0.0f, 1 };
+		}
+	}
+
+	return static_cast<uint64_t>(width) * height * s.adaptive.base_samples;
+}
+
+}
+
+adaptive_stats render_adaptive(const world& w, const instance_set* instances, const camera& cam, const render_settings& settings, const adaptive_settings& adaptive, framebuffer& target, job_system& jobs) {
+	jobs.begin_frame();
+
+	trace_options options;
+	options.lod_scale = settings.lod_bias * 2.0f * std::tan(cam.fov_y * 0.5f) / static_cast<float>(target.height);
+	options.skip = settings.skip;
+	const scene s = { w, instances, cam, settings, adaptive, target, options };
+
+	frame_arena& frame = jobs.arena(0);
+	const uint32_t tile_count = static_cast<uint32_t>(target.tiles_x() * target.tiles_y());
+
+	pixel_accum* accum = frame.allocate<pixel_accum>(target.pixels.size());
+	float* variance = frame.allocate<float>(tile_count);
+	uint32_t* refine = frame.allocate<uint32_t>(tile_count);
+
+	adaptive_stats* thread_stats = frame.allocate<adaptive_stats>(jobs.thread_count());
+	std::uninitialized_value_construct_n(thread_stats, jobs.thread_count());
+
+	// Base pass: every pixel gets base_samples, periphery tiles get their reduced set.
+	jobs.parallel_for(tile_count, [&](uint32_t tile, unsigned thread_index) {
+		const uint64_t allocations_before = thread_heap_allocations();
+		adaptive_stats& stats = thread_stats[thread_index];
+		const tile_rect rect = tile_bounds(target, tile);
+
+		if (is_periphery(s, rect)) {
+			stats.samples += render_periphery(s, accum, rect, stats.trace);
+			stats.periphery_tiles++;
+			variance[tile] = 0.0f;
+		}
+		else {
+			for (int y = rect.y0; y < rect.y1; y++) {
+				for (int x = rect.x0; x < rect.x1; x++) {
+					pixel_accum& a = accum[x + y * target.width];
+					a = { glm::vec3(0.0f), 0.0f, 0.0f, 0 };
+
+					for (int i = 0; i < adaptive.base_samples; i++) {
+						sample_pixel(s, a, x, y, static_cast<uint32_t>(i), stats.trace);
+					}
+				}
+			}
+
+			stats.samples += static_cast<uint64_t>(rect.pixel_count()) * adaptive.base_samples;
+			variance[tile] = tile_variance(accum, rect, target.width);
+		}
+
+		stats.trace.heap_allocations += thread_heap_allocations() - allocations_before;
+	});
+
+	uint64_t base_rays = 0;
+	for (unsigned i = 0; i < jobs.thread_count(); i++) {
+		base_rays += thread_stats[i].trace.rays;
+	}
+
+	uint32_t refine_count = 0;
+	for (uint32_t tile = 0; tile < tile_count; tile++) {
+		if (variance[tile] > adaptive.variance_threshold) {
+			refine[refine_count++] = tile;
+		}
+	}
+
+	// Noisiest tiles first, so they are the ones that get samples if the budget runs out.
+	std::sort(refine, refine + refine_count, [&](uint32_t a, uint32_t b) { return variance[a] > variance[b]; });
+
+	const bool budgeted = adaptive.ray_budget > 0;
+	const int64_t sample_rays = max_sample_rays(s);
+	std::atomic<int64_t> remaining = budgeted ? static_cast<int64_t>(adaptive.ray_budget) - static_cast<int64_t>(base_rays) : 0;
+
+	// Refinement pass: one more sample per pixel at a time. With a budget, each sample reserves the most rays it can trace and
+	// gives back what it did not use, so the frame never goes over. A round the budget cuts short leaves the rest of the tile as is.
+	jobs.parallel_for(refine_count, [&](uint32_t job, unsigned thread_index) {
+		const uint64_t allocations_before = thread_heap_allocations();
+		adaptive_stats& stats = thread_stats[thread_index];
+		const uint32_t tile = refine[job];
+		const tile_rect rect = tile_bounds(target, tile);
+		bool exhausted = false;
+
+		for (int sample = adaptive.base_samples; sample < adaptive.max_samples; sample++) {
+			uint64_t sampled = 0;
+			for (int y = rect.y0; y < rect.y1 && !exhausted; y++) {
+				for (int x = rect.x0; x < rect.x1; x++) {
+					if (budgeted && !reserve_rays(remaining, sample_rays)) {
+						exhausted = true;
+						break;
+					}
+
+					const uint64_t rays_before = stats.trace.rays;
+					sample_pixel(s, accum[x + y * target.width], x, y, static_cast<uint32_t>(sample), stats.trace);
+					sampled++;
+
+					if (budgeted) {
+						remaining.fetch_add(sample_rays - static_cast<int64_t>(stats.trace.rays - rays_before), std::memory_order_relaxed);
+					}
+				}
+			}
+
+			stats.refined_tiles += sample == adaptive.base_samples && sampled > 0;
+			stats.samples += sampled;
+
+			if (exhausted) {
+				stats.budget_exhausted = true;
+				break;
+			}
+
+			if (tile_variance(accum, rect, target.width) <= adaptive.variance_threshold) {
+				break;
+			}
+		}
+
+		stats.trace.heap_allocations += thread_heap_allocations() - allocations_before;
+	});
+
+	jobs.parallel_for(tile_count, [&](uint32_t tile, unsigned) {
+		const tile_rect rect = tile_bounds(target, tile);
+		for (int y = rect.y0; y < rect.y1; y++) {
+			for (int x = rect.x0; x < rect.x1; x++) {
+				const pixel_accum& a = accum[x + y * target.width];
+				target.pixels[x + y * target.width] = pack_color(a.sum / static_cast<float>(a.count));
+			}
+		}
+	});
+
+	adaptive_stats stats;
+	for (unsigned i = 0; i < jobs.thread_count(); i++) {
+		stats.trace += thread_stats[i].trace;
+		stats.samples += thread_stats[i].samples;
+		stats.refined_tiles += thread_stats[i].refined_tiles;
+		stats.periphery_tiles += thread_stats[i].periphery_tiles;
+		stats.budget_exhausted = stats.budget_exhausted || thread_stats[i].budget_exhausted;
+	}
+
+	assert(stats.trace.heap_allocations == 0 && "adaptive render hot loop allocated from the heap");
+	return stats;
+}
+
+sampling_controller::sampling_controller(double target_ms, float min_threshold, float max_threshold)
+	: m_target_ms(target_ms), m_min_threshold(min_threshold), m_max_threshold(max_threshold) {
+}
+
+void sampling_controller::update(double frame_ms, adaptive_settings& adaptive) {
+	m_smoothed_ms = m_smoothed_ms == 0.0 ? frame_ms : m_smoothed_ms * 0.5 + frame_ms * 0.5;
+
+	// The number of tiles above the threshold falls off roughly with its logarithm, so steer it multiplicatively.
+	// The square root damps the step so the smoothing lag does not make it overshoot.
+	const double ratio = m_smoothed_ms / m_target_ms;
+	const float scale = static_cast<float>(std::clamp(std::sqrt(ratio), 0.75, 1.5));
+	adaptive.variance_threshold = std::clamp(adaptive.variance_threshold * scale, m_min_threshold, m_max_threshold);
+}
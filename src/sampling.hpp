@@ -0,0 +1,68 @@
+#pragma once
+
+#include "raytracer.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+
+struct adaptive_settings {
+	// Samples every pixel gets, and the most a refined pixel can end up with.
+	int base_samples = 2;
+	int max_samples = 16;
+
+	// Tiles whose mean pixel variance (of the luminance estimate) is above this get extra samples.
+	float variance_threshold = 1e-3f;
+
+	// Most rays a frame may trace, counting primary, shadow and bounce rays. The base pass always runs in full. 0 is unlimited.
+	uint64_t ray_budget = 0;
+
+	// Foveated mode traces tiles outside the fovea at one sample per periphery_scale^2 pixels and upsamples them.
+	bool foveated = false;
+	glm::vec2 fovea_center = glm::vec2(0.5f);
+	float fovea_radius = 0.25f;
+	int periphery_scale = 2;
+
+	// Seeds the sample sequence, so successive frames get different noise.
+	uint32_t frame = 0;
+};
+
+struct adaptive_stats {
+	trace_stats trace;
+	uint64_t samples = 0;
+	uint32_t refined_tiles = 0;
+	uint32_t periphery_tiles = 0;
+	bool budget_exhausted = false;
+};
+
+/*
+ * Renders with a one bounce path tracer: every sample traces a jittered
+ * primary ray, a shadow ray towards the sun and a cosine weighted bounce.
+ *
+ * All pixels first get `base_samples`. Tiles whose estimated variance is
+ * still above the threshold are then refined one sample per pixel at a time,
+ * noisiest tile first, until they drop below it, reach `max_samples` or the
+ * ray budget runs out. Scratch data comes from the frame arenas.
+ */
+adaptive_stats render_adaptive(const world& w, const instance_set* instances, const camera& cam, const render_settings& settings, const adaptive_settings& adaptive, framebuffer& target, job_system& jobs);
+
+/*
+ * Steers the variance threshold so that frames settle at a target time: a
+ * slow frame raises the threshold (fewer tiles refined), a fast one lowers it.
+ * The frame time is smoothed first so that single spikes do not make the
+ * image quality oscillate.
+ */
+class sampling_controller {
+public:
+	explicit sampling_controller(double target_ms, float min_threshold = 1e-6f, float max_threshold = 1.0f);
+
+	void update(double frame_ms, adaptive_settings& adaptive);
+
+	double smoothed_ms() const { return m_smoothed_ms; }
+
+private:
+	double m_target_ms;
+	double m_smoothed_ms = 0.0;
+	float m_min_threshold;
+	float m_max_threshold;
+};
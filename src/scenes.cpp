@@ -0,0 +1,185 @@
+#include "scenes.hpp"
+#include "noise.hpp"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <random>
+
+namespace {
+
+constexpr int WATER_LEVEL = 22;
+
+int terrain_height(const world& w, int x, int z, uint32_t seed) {
+	const glm::vec2 p = glm::vec2(x, z) / 160.0f;
+	const float height = 12.0f + fbm(p, 5, seed) * static_cast<float>(w.size().y) * 0.6f;
+	return std::min(static_cast<int>(height), w.size().y - 1);
+}
+
+float surface_height(const world& w, int x, int z) {
+	for (int y = w.size().y - 1; y >= 0; y--) {
+		if (w.get(glm::ivec3(x, y, z)) != 0) {
+			return static_cast<float>(y + 1);
+		}
+	}
+
+	return 0.0f;
+}
+
+}
+
+world generate_terrain(glm::ivec3 size_in_bricks, uint32_t seed) {
+	world w(size_in_bricks);
+	const glm::ivec3 size = w.size();
+
+	for (int z = 0; z < size.z; z++) {
+		for (int x = 0; x < size.x; x++) {
+			const int height = terrain_height(w, x, z, seed);
+
+			for (int y = 0; y <= height; y++) {
+				uint8_t material = 3;
+				if (y == height) {
+					material = height <= WATER_LEVEL + 1 ? 4 : 1;
+				}
+				else if (y > height - 4) {
+					material = 2;
+				}
+
+				w.set(glm::ivec3(x, y, z), material);
+			}
+
+			for (int y = height + 1; y <= WATER_LEVEL; y++) {
+				w.set(glm::ivec3(x, y, z), 6);
+			}
+		}
+	}
+
+	return w;
+}
+
+void carve_craters(world& w, int count, uint32_t seed) {
+	std::mt19937 rng(seed);
+	std::uniform_int_distribution<int> x_dist(0, w.size().x - 1);
+	std::uniform_int_distribution<int> z_dist(0, w.size().z - 1);
+	std::uniform_int_distribution<int> radius_dist(6, 20);
+
+	for (int i = 0; i < count; i++) {
+		const int cx = x_dist(rng);
+		const int cz = z_dist(rng);
+		const int cy = static_cast<int>(surface_height(w, cx, cz));
+		const int radius = radius_dist(rng);
+
+		for (int z = cz - radius; z <= cz + radius; z++) {
+			for (int y = cy - radius; y <= cy + radius; y++) {
+				for (int x = cx - radius; x <= cx + radius; x++) {
+					const glm::ivec3 d = glm::ivec3(x, y, z) - glm::ivec3(cx, cy, cz);
+					if (glm::dot(d, d) <= radius * radius) {
+						w.set(glm::ivec3(x, y, z), 0);
+					}
+				}
+			}
+		}
+	}
+}
+
+std::vector<world> generate_props(uint32_t seed) {
+	std::vector<world> props;
+
+	world tree(glm::ivec3(2, 3, 2));
+	for (int y = 0; y < 14; y++) {
+		for (int z = 7; z <= 8; z++) {
+			for (int x = 7; x <= 8; x++) {
+				tree.set(glm::ivec3(x, y, z), 7);
+			}
+		}
+	}
+
+	for (int z = 0; z < 16; z++) {
+		for (int y = 10; y < 24; y++) {
+			for (int x = 0; x < 16; x++) {
+				const glm::vec3 d = glm::vec3(x, y, z) + 0.5f - glm::vec3(8.0f, 16.0f, 8.0f);
+				if (glm::dot(d, d) < 42.0f + 8.0f * value_noise(glm::vec2(x + y, z) * 0.5f, seed)) {
+					tree.set(glm::ivec3(x, y, z), 1);
+				}
+			}
+		}
+	}
+
+	props.push_back(std::move(tree));
+
+	world boulder(glm::ivec3(1, 1, 1));
+	for (int z = 0; z < 8; z++) {
+		for (int y = 0; y < 8; y++) {
+			for (int x = 0; x < 8; x++) {
+				const glm::vec3 d = glm::vec3(x, y, z) + 0.5f - glm::vec3(4.0f, 2.5f, 4.0f);
+				if (glm::dot(d, d) < 10.0f + 6.0f * value_noise(glm::vec2(x, z + y * 8), seed + 1)) {
+					boulder.set(glm::ivec3(x, y, z), 3);
+				}
+			}
+		}
+	}
+
+	props.push_back(std::move(boulder));
+
+	world crystal(glm::ivec3(1, 2, 1));
+	for (int y = 0; y < 16; y++) {
+		const int radius = 3 - y / 5;
+		for (int z = 4 - radius; z < 4 + radius; z++) {
+			for (int x = 4 - radius; x < 4 + radius; x++) {
+				crystal.set(glm::ivec3(x, y, z), 6);
+			}
+		}
+	}
+
+	props.push_back(std::move(crystal));
+	return props;
+}
+
+void scatter_instances(instance_set& instances, const world& terrain, int count, uint32_t seed) {
+	std::mt19937 rng(seed);
+	std::uniform_int_distribution<int> x_dist(0, terrain.size().x - 1);
+	std::uniform_int_distribution<int> z_dist(0, terrain.size().z - 1);
+	std::uniform_int_distribution<uint32_t> model_dist(0, static_cast<uint32_t>(instances.model_count() - 1));
+	std::uniform_real_distribution<float> angle_dist(0.0f, glm::radians(360.0f));
+	std::uniform_real_distribution<float> scale_dist(0.75f, 1.5f);
+
+	for (int i = 0; i < count; i++) {
+		const int x = x_dist(rng);
+		const int z = z_dist(rng);
+		const uint32_t model = model_dist(rng);
+		const glm::vec3 size(instances.model(model).size());
+
+		glm::mat4 to_world = glm::translate(glm::mat4(1.0f), glm::vec3(x, surface_height(terrain, x, z), z));
+		to_world = glm::rotate(to_world, angle_dist(rng), glm::vec3(0.0f, 1.0f, 0.0f));
+		to_world = glm::scale(to_world, glm::vec3(scale_dist(rng)));
+		to_world = glm::translate(to_world, glm::vec3(-size.x * 0.5f, 0.0f, -size.z * 0.5f));
+
+		instances.add_instance(model, to_world);
+	}
+}
+
+std::vector<scene_view> terrain_views(const world& w) {
+	const glm::vec3 size(w.size());
+	const glm::vec3 center = size * 0.5f;
+	const float fov = glm::radians(70.0f);
+	const float ground = surface_height(w, static_cast<int>(center.x), static_cast<int>(center.z));
+
+	return {
+		{ "horizon", camera::look_at(glm::vec3(center.x, size.y * 0.75f, 4.0f), glm::vec3(center.x, size.y * 0.55f, size.z), fov) },
+		{ "overview", camera::look_at(glm::vec3(-size.x * 0.25f, size.y * 2.0f, -size.z * 0.25f), center, fov) },
+		{ "ground", camera::look_at(glm::vec3(center.x, ground + 6.0f, center.z), glm::vec3(size.x, ground, size.z), fov) },
+	};
+}
+
+std::vector<scene_view> distance_views(const world& w) {
+	const glm::vec3 center = glm::vec3(w.size()) * 0.5f;
+	const glm::vec3 direction = glm::normalize(glm::vec3(-1.0f, 0.6f, -1.0f));
+	const float fov = glm::radians(70.0f);
+
+	std::vector<scene_view> views;
+	for (int distance : { 256, 768, 1536, 3072 }) {
+		views.push_back({ "distance_" + std::to_string(distance), camera::look_at(center + direction * static_cast<float>(distance), center, fov) });
+	}
+
+	return views;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "camera.hpp"
+#include "instances.hpp"
+#include "world.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct scene_view {
+	std::string name;
+	camera cam;
+};
+
+/* Rolling heightfield terrain with grass, dirt, stone and water layers. */
+world generate_terrain(glm::ivec3 size_in_bricks, uint32_t seed);
+
+/* Blasts `count` spherical craters into the surface, freeing bricks all over the world. */
+void carve_craters(world& w, int count, uint32_t seed);
+
+/* Small props used for instancing: a tree, a boulder and a crystal. */
+std::vector<world> generate_props(uint32_t seed);
+
+/* Places `count` randomly rotated and scaled copies of the set's models on the terrain surface. */
+void scatter_instances(instance_set& instances, const world& terrain, int count, uint32_t seed);
+
+/* The fixed camera set used by voxel-bench. */
+std::vector<scene_view> terrain_views(const world& w);
+
+/* Cameras looking at the terrain's center from increasing distances, for level of detail measurements. */
+std::vector<scene_view> distance_views(const world& w);
@@ -0,0 +1,207 @@
+#include "shader_watcher.hpp"
+#include "pipeline_library.hpp"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <system_error>
+
+#ifdef __linux__
+#include <poll.h>
+#include <spawn.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+#endif
+
+namespace {
+
+// How long the directory has to stay quiet before changed files are compiled; editors often write a file in several steps.
+constexpr int DEBOUNCE_MS = 50;
+constexpr int POLL_INTERVAL_MS = 100;
+
+bool is_shader_source(const std::filesystem::path& path) {
+	const std::filesystem::path extension = path.extension();
+	return extension == ".comp" || extension == ".vert" || extension == ".frag";
+}
+
+// Extra builds of a source, matching the ones in CMakeLists.txt.
+struct shader_permutation {
+	const char* source;
+	const char* name;
+	std::vector<std::string> args;
+};
+
+const shader_permutation SHADER_PERMUTATIONS[] = {
+	{ "raytrace.comp", "raytrace_rq.comp", { "-DRAY_QUERY", "--target-env=vulkan1.2" } },
+	{ "raytrace.comp", "raytrace_sg.comp", { "-DSUBGROUP_OPS", "--target-env=vulkan1.1" } },
+	{ "raytrace.comp", "raytrace_rq_sg.comp", { "-DRAY_QUERY", "-DSUBGROUP_OPS", "--target-env=vulkan1.2" } },
+};
+
+}
+
+#ifdef __linux__
+
+bool compile_shader(const std::filesystem::path& source, const std::filesystem::path& output, std::string& log, const std::vector<std::string>& extra_args) {
+	int fds[2];
+	if (pipe(fds) != 0) {
+		log = "pipe failed";
+		return false;
+	}
+
+	const std::string source_arg = source.string();
+	const std::string output_arg = output.string() + ".tmp";
+	std::vector<char*> argv = { const_cast<char*>("glslc") };
+	for (const std::string& arg : extra_args) {
+		argv.push_back(const_cast<char*>(arg.c_str()));
+	}
+	argv.push_back(const_cast<char*>(source_arg.c_str()));
+	argv.push_back(const_cast<char*>("-o"));
+	argv.push_back(const_cast<char*>(output_arg.c_str()));
+	argv.push_back(nullptr);
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+	posix_spawn_file_actions_addclose(&actions, fds[0]);
+	posix_spawn_file_actions_addclose(&actions, fds[1]);
+
+	pid_t pid;
+	const int error = posix_spawnp(&pid, "glslc", &actions, nullptr, argv.data(), environ);
+	posix_spawn_file_actions_destroy(&actions);
+	close(fds[1]);
+
+	if (error != 0) {
+		close(fds[0]);
+		log = "could not start glslc: " + std::system_category().message(error);
+		return false;
+	}
+
+	log.clear();
+	char buffer[4096];
+	for (ssize_t n; (n = read(fds[0], buffer, sizeof(buffer))) > 0;) {
+		log.append(buffer, static_cast<size_t>(n));
+	}
+	close(fds[0]);
+
+	int status;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		return false;
+	}
+
+	std::error_code rename_error;
+	std::filesystem::rename(output_arg, output, rename_error);
+	return !rename_error;
+}
+
+shader_watcher::shader_watcher(std::filesystem::path source_dir, std::filesystem::path output_dir, compiled_fn on_compiled)
+	: m_source_dir(std::move(source_dir)), m_output_dir(std::move(output_dir)), m_on_compiled(std::move(on_compiled)) {
+	m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (m_fd < 0 || inotify_add_watch(m_fd, m_source_dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		spdlog::warn("Cannot watch {}, shader hot reload is off", m_source_dir.string());
+		if (m_fd >= 0) {
+			close(m_fd);
+			m_fd = -1;
+		}
+		return;
+	}
+
+	spdlog::info("Watching {} for shader changes", m_source_dir.string());
+	m_thread = std::thread([this] { run(); });
+}
+
+shader_watcher::~shader_watcher() {
+	m_running = false;
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+
+	if (m_fd >= 0) {
+		close(m_fd);
+	}
+}
+
+void shader_watcher::run() {
+	std::vector<std::string> changed;
+
+	while (m_running.load(std::memory_order_relaxed)) {
+		pollfd fd = { m_fd, POLLIN, 0 };
+		if (poll(&fd, 1, changed.empty() ? POLL_INTERVAL_MS : DEBOUNCE_MS) > 0) {
+			alignas(inotify_event) char buffer[4096];
+			for (ssize_t n; (n = read(m_fd, buffer, sizeof(buffer))) > 0;) {
+				for (char* p = buffer; p < buffer + n;) {
+					const inotify_event* event = reinterpret_cast<const inotify_event*>(p);
+					p += sizeof(inotify_event) + event->len;
+
+					if (event->len == 0 || !is_shader_source(event->name)) {
+						continue;
+					}
+
+					if (std::find(changed.begin(), changed.end(), event->name) == changed.end()) {
+						changed.push_back(event->name);
+					}
+				}
+			}
+
+			continue;
+		}
+
+		for (const std::string& name : changed) {
+			rebuild(name);
+		}
+
+		changed.clear();
+	}
+}
+
+#else
+
+bool compile_shader(const std::filesystem::path&, const std::filesystem::path&, std::string& log, const std::vector<std::string>&) {
+	log = "shader compilation needs a Linux host";
+	return false;
+}
+
+shader_watcher::shader_watcher(std::filesystem::path source_dir, std::filesystem::path output_dir, compiled_fn on_compiled)
+	: m_source_dir(std::move(source_dir)), m_output_dir(std::move(output_dir)), m_on_compiled(std::move(on_compiled)) {
+	spdlog::warn("Shader hot reload is only available on Linux");
+}
+
+shader_watcher::~shader_watcher() {
+}
+
+void shader_watcher::run() {
+}
+
+#endif
+
+void shader_watcher::rebuild(const std::string& name) {
+	compile(name, name, {});
+	for (const shader_permutation& permutation : SHADER_PERMUTATIONS) {
+		if (name == permutation.source) {
+			compile(name, permutation.name, permutation.args);
+		}
+	}
+}
+
+void shader_watcher::compile(const std::string& source, const std::string& name, const std::vector<std::string>& args) {
+	const std::filesystem::path output = m_output_dir / (name + ".spv");
+	std::string log;
+
+	if (!compile_shader(m_source_dir / source, output, log, args)) {
+		spdlog::error("Compiling {} failed:\n{}", name, log);
+		return;
+	}
+
+	std::vector<uint32_t> spirv;
+	if (!load_spirv(output, spirv)) {
+		spdlog::error("Failed to load {}", output.string());
+		return;
+	}
+
+	spdlog::info("Recompiled {}", name);
+	m_on_compiled(name, spirv);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Compiles one GLSL file with a glslc subprocess, writing through a
+ * temporary file so readers never see a partial output. `extra_args` go
+ * before the source, for defines and the target environment. The compiler's
+ * messages are returned in `log`.
+ */
+bool compile_shader(const std::filesystem::path& source, const std::filesystem::path& output, std::string& log, const std::vector<std::string>& extra_args = {});
+
+/*
+ * Development mode shader reloading. A background thread watches the shader
+ * source directory with inotify and, once a burst of writes has settled,
+ * recompiles each changed file into the output directory and hands the new
+ * SPIR-V to `on_compiled` on that thread. Failed compiles are logged and
+ * skipped, so a typo never takes down the running pipeline. Sources built more
+ * than once with different defines, like raytrace_rq.comp and raytrace_sg.comp
+ * from raytrace.comp, rebuild every build and report each under its own name.
+ *
+ * Only available on Linux; elsewhere the watcher logs a warning and does
+ * nothing.
+ */
+class shader_watcher {
+public:
+	using compiled_fn = std::function<void(const std::string& name, const std::vector<uint32_t>& spirv)>;
+
+	shader_watcher(std::filesystem::path source_dir, std::filesystem::path output_dir, compiled_fn on_compiled);
+	~shader_watcher();
+
+	shader_watcher(const shader_watcher&) = delete;
+	shader_watcher& operator=(const shader_watcher&) = delete;
+
+	bool active() const { return m_fd >= 0; }
+
+private:
+	void run();
+	void rebuild(const std::string& name);
+	void compile(const std::string& source, const std::string& name, const std::vector<std::string>& args);
+
+	std::filesystem::path m_source_dir;
+	std::filesystem::path m_output_dir;
+	compiled_fn m_on_compiled;
+
+	int m_fd = -1;
+	std::atomic<bool> m_running = true;
+	std::thread m_thread;
+};
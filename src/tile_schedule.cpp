@@ -0,0 +1,146 @@
+#include "tile_schedule.hpp"
+
+#include <new>
+#include <utility>
+
+namespace {
+
+uint32_t compact_bits(uint32_t v) {
+	v &= 0x55555555u;
+	v = (v | (v >> 1)) & 0x33333333u;
+	v = (v | (v >> 2)) & 0x0F0F0F0Fu;
+	v = (v | (v >> 4)) & 0x00FF00FFu;
+	v = (v | (v >> 8)) & 0x0000FFFFu;
+	return v;
+}
+
+void hilbert_point(uint32_t side, uint32_t d, uint32_t& x, uint32_t& y) {
+	x = 0;
+	y = 0;
+
+	for (uint32_t s = 1; s < side; s *= 2) {
+		const uint32_t rx = 1 & (d / 2);
+		const uint32_t ry = 1 & (d ^ rx);
+
+		if (ry == 0) {
+			if (rx == 1) {
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+
+			std::swap(x, y);
+		}
+
+		x += s * rx;
+		y += s * ry;
+		d /= 4;
+	}
+}
+
+uint64_t pack_range(uint32_t first, uint32_t last) {
+	return first | (static_cast<uint64_t>(last) << 32);
+}
+
+bool pop_front(tile_queue& queue, uint32_t& slot) {
+	uint64_t range = queue.range.load(std::memory_order_relaxed);
+	while (true) {
+		const uint32_t first = static_cast<uint32_t>(range);
+		const uint32_t last = static_cast<uint32_t>(range >> 32);
+		if (first >= last) {
+			return false;
+		}
+
+		if (queue.range.compare_exchange_weak(range, pack_range(first + 1, last), std::memory_order_acq_rel)) {
+			slot = first;
+			return true;
+		}
+	}
+}
+
+bool pop_back(tile_queue& queue, uint32_t& slot) {
+	uint64_t range = queue.range.load(std::memory_order_relaxed);
+	while (true) {
+		const uint32_t first = static_cast<uint32_t>(range);
+		const uint32_t last = static_cast<uint32_t>(range >> 32);
+		if (first >= last) {
+			return false;
+		}
+
+		if (queue.range.compare_exchange_weak(range, pack_range(first, last - 1), std::memory_order_acq_rel)) {
+			slot = last - 1;
+			return true;
+		}
+	}
+}
+
+}
+
+const char* tile_order_name(tile_order order) {
+	switch (order) {
+	case tile_order::morton: return "morton";
+	case tile_order::hilbert: return "hilbert";
+	default: return "scanline";
+	}
+}
+
+void order_tiles(tile_order order, int tiles_x, int tiles_y, uint32_t* out) {
+	if (order == tile_order::scanline) {
+		for (uint32_t i = 0; i < static_cast<uint32_t>(tiles_x * tiles_y); i++) {
+			out[i] = i;
+		}
+
+		return;
+	}
+
+	uint32_t side = 1;
+	while (side < static_cast<uint32_t>(tiles_x) || side < static_cast<uint32_t>(tiles_y)) {
+		side *= 2;
+	}
+
+	// Walk the whole curve and skip the points that fall outside the screen.
+	uint32_t count = 0;
+	for (uint32_t d = 0; d < side * side; d++) {
+		uint32_t x;
+		uint32_t y;
+
+		if (order == tile_order::morton) {
+			x = compact_bits(d);
+			y = compact_bits(d >> 1);
+		}
+		else {
+			hilbert_point(side, d, x, y);
+		}
+
+		if (x < static_cast<uint32_t>(tiles_x) && y < static_cast<uint32_t>(tiles_y)) {
+			out[count++] = x + y * static_cast<uint32_t>(tiles_x);
+		}
+	}
+}
+
+void init_tile_queues(tile_queue* queues, uint32_t queue_count, uint32_t count) {
+	for (uint32_t i = 0; i < queue_count; i++) {
+		const uint32_t first = static_cast<uint32_t>(static_cast<uint64_t>(count) * i / queue_count);
+		const uint32_t last = static_cast<uint32_t>(static_cast<uint64_t>(count) * (i + 1) / queue_count);
+		new (&queues[i]) tile_queue{ pack_range(first, last) };
+	}
+}
+
+bool take_tile(tile_queue* queues, uint32_t queue_count, uint32_t own, uint32_t& slot, bool& stolen) {
+	stolen = false;
+	if (pop_front(queues[own], slot)) {
+		return true;
+	}
+
+	stolen = true;
+	for (uint32_t distance = 1; distance < queue_count; distance++) {
+		if (own + distance < queue_count && pop_back(queues[own + distance], slot)) {
+			return true;
+		}
+
+		if (own >= distance && pop_back(queues[own - distance], slot)) {
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+enum class tile_order {
+	scanline,
+	morton,
+	hilbert,
+};
+
+const char* tile_order_name(tile_order order);
+
+/*
+ * Writes the index (x + y * tiles_x) of every tile in the given order. Morton
+ * and Hilbert orders walk a space filling curve over the smallest power of
+ * two square covering the tiles, so consecutive tiles are neighbours on
+ * screen and tend to touch the same bricks.
+ */
+void order_tiles(tile_order order, int tiles_x, int tiles_y, uint32_t* out);
+
+/*
+ * A contiguous run [first, last) of slots in an ordered tile list, packed into
+ * one word so that its owner and thieves can both claim slots with a CAS.
+ */
+struct alignas(64) tile_queue {
+	std::atomic<uint64_t> range;
+};
+
+/* Splits slots [0, count) into `queue_count` equal runs, one per queue. */
+void init_tile_queues(tile_queue* queues, uint32_t queue_count, uint32_t count);
+
+/*
+ * Takes the next slot of queue `own` from its front. Once it is empty, steals
+ * from the back of the other queues, nearest first: with a space filling
+ * order the neighbouring queues hold the neighbouring parts of the screen.
+ */
+bool take_tile(tile_queue* queues, uint32_t queue_count, uint32_t own, uint32_t& slot, bool& stolen);
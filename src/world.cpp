@@ -0,0 +1,427 @@
+#include "world.hpp"
+
+#include <algorithm>
+#include <bit>
+
+namespace {
+
+lod_cell voxel_cell(uint8_t material) {
+	return { material, glm::u8vec3(material_color(material) * 255.0f + 0.5f) };
+}
+
+/* Majority material and averaged color of the solid cells among eight children. */
+lod_cell merge_cells(const lod_cell* children, uint8_t solid) {
+	glm::vec3 color(0.0f);
+	int count = 0;
+	int best = -1;
+	int best_votes = 0;
+
+	for (int i = 0; i < 8; i++) {
+		if (!((solid >> i) & 1)) {
+			continue;
+		}
+
+		color += glm::vec3(children[i].color);
+		count++;
+
+		int votes = 0;
+		for (int j = 0; j < 8; j++) {
+			votes += ((solid >> j) & 1) && children[j].material == children[i].material;
+		}
+
+		if (votes > best_votes) {
+			best = i;
+			best_votes = votes;
+		}
+	}
+
+	if (count == 0) {
+		return { 0, glm::u8vec3(0) };
+	}
+
+	return { children[best].material, glm::u8vec3(color / static_cast<float>(count) + 0.5f) };
+}
+
+glm::ivec3 child_offset(int i) {
+	return glm::ivec3(i & 1, (i >> 1) & 1, (i >> 2) & 1);
+}
+
+/* Expands the level 1 cells of a brick into the voxel occupancy of slice z; each cell covers a 2x2 block of voxel bits. */
+uint64_t expand_slice(const brick_lod& lod, int z) {
+	uint64_t slice = 0;
+	for (uint64_t cells = (lod.occupancy_l1 >> ((z >> 1) << 4)) & 0xFFFF; cells != 0; cells &= cells - 1) {
+		const int cell = std::countr_zero(cells);
+		slice |= uint64_t(0x0303) << (((cell & 3) << 1) + ((cell >> 2) << 4));
+	}
+
+	return slice;
+}
+
+/* One pass of the separable chebyshev transform: out[i] = min over k of max(|k|, in[i + k]). */
+void distance_pass(const uint8_t* in, uint8_t* out, int count) {
+	for (int i = 0; i < count; i++) {
+		int best = in[i];
+		for (int k = 1; k < best; k++) {
+			if (i - k >= 0) {
+				best = std::min(best, std::max(k, static_cast<int>(in[i - k])));
+			}
+
+			if (i + k < count) {
+				best = std::min(best, std::max(k, static_cast<int>(in[i + k])));
+			}
+		}
+
+		out[i] = static_cast<uint8_t>(best);
+	}
+}
+
+/* Rebuilds the cells above the voxel at `local` after it changed. */
+void update_lod(brick& b, glm::ivec3 local) {
+	lod_cell children[8];
+	uint8_t solid = 0;
+
+	const glm::ivec3 cell1 = local >> 1;
+	for (int i = 0; i < 8; i++) {
+		const glm::ivec3 voxel = cell1 * 2 + child_offset(i);
+		children[i] = voxel_cell(b.materials[brick_voxel_index(voxel)]);
+		solid |= static_cast<uint8_t>(brick_is_solid(b, voxel) << i);
+	}
+
+	const uint64_t bit1 = uint64_t(1) << (cell1.x + (cell1.y << 2) + (cell1.z << 4));
+	b.lod.cells[lod_cell_index(1, cell1)] = merge_cells(children, solid);
+	b.lod.occupancy_l1 = solid ? b.lod.occupancy_l1 | bit1 : b.lod.occupancy_l1 & ~bit1;
+
+	const glm::ivec3 cell2 = local >> 2;
+	solid = 0;
+	for (int i = 0; i < 8; i++) {
+		const glm::ivec3 child = cell2 * 2 + child_offset(i);
+		children[i] = b.lod.cells[lod_cell_index(1, child)];
+		solid |= static_cast<uint8_t>(lod_is_solid(b.lod, 1, child) << i);
+	}
+
+	const uint8_t bit2 = static_cast<uint8_t>(1 << (cell2.x + (cell2.y << 1) + (cell2.z << 2)));
+	b.lod.cells[lod_cell_index(2, cell2)] = merge_cells(children, solid);
+	b.lod.occupancy_l2 = solid ? b.lod.occupancy_l2 | bit2 : b.lod.occupancy_l2 & ~bit2;
+
+	for (int i = 0; i < 8; i++) {
+		children[i] = b.lod.cells[lod_cell_index(2, child_offset(i))];
+	}
+
+	b.lod.cells[lod_cell_index(3, glm::ivec3(0))] = merge_cells(children, b.lod.occupancy_l2);
+}
+
+}
+
+glm::vec3 material_color(uint8_t material) {
+	static const glm::vec3 palette[] = {
+		glm::vec3(0.0f, 0.0f, 0.0f),
+		glm::vec3(0.36f, 0.58f, 0.25f),
+		glm::vec3(0.47f, 0.33f, 0.21f),
+		glm::vec3(0.52f, 0.52f, 0.55f),
+		glm::vec3(0.86f, 0.82f, 0.62f),
+		glm::vec3(0.95f, 0.96f, 0.98f),
+		glm::vec3(0.24f, 0.42f, 0.75f),
+		glm::vec3(0.55f, 0.36f, 0.18f),
+	};
+
+	return palette[material % (sizeof(palette) / sizeof(palette[0]))];
+}
+
+world::world(glm::ivec3 size_in_bricks)
+	: m_grid_size(size_in_bricks),
+	  m_grid(static_cast<size_t>(size_in_bricks.x) * size_in_bricks.y * size_in_bricks.z, EMPTY_BRICK),
+	  m_distance(m_grid.size(), DISTANCE_FIELD_RANGE) {
+	glm::ivec3 level_size = size_in_bricks;
+	while (true) {
+		m_occupancy_sizes.push_back(level_size);
+		m_occupancy.emplace_back(static_cast<size_t>(level_size.x) * level_size.y * level_size.z, 0);
+
+		if (level_size == glm::ivec3(1)) {
+			break;
+		}
+
+		level_size = (level_size + 1) / 2;
+	}
+}
+
+bool world::in_bounds(glm::ivec3 voxel) const {
+	const glm::ivec3 extent = size();
+	return voxel.x >= 0 && voxel.y >= 0 && voxel.z >= 0 && voxel.x < extent.x && voxel.y < extent.y && voxel.z < extent.z;
+}
+
+uint8_t world::get(glm::ivec3 voxel) const {
+	if (!in_bounds(voxel)) {
+		return 0;
+	}
+
+	const uint32_t index = brick_index(voxel >> BRICK_SHIFT);
+	if (index == EMPTY_BRICK) {
+		return 0;
+	}
+
+	if (is_coarse(index)) {
+		const brick_lod& lod = m_coarse_bricks[index & ~COARSE_BRICK];
+		const glm::ivec3 cell = (voxel & (BRICK_SIZE - 1)) >> 1;
+		return lod_is_solid(lod, 1, cell) ? lod.cells[lod_cell_index(1, cell)].material : 0;
+	}
+
+	return m_bricks[index].materials[brick_voxel_index(voxel & (BRICK_SIZE - 1))];
+}
+
+void world::set(glm::ivec3 voxel, uint8_t material) {
+	if (!in_bounds(voxel)) {
+		return;
+	}
+
+	const glm::ivec3 brick_coord = voxel >> BRICK_SHIFT;
+	const glm::ivec3 local = voxel & (BRICK_SIZE - 1);
+	uint32_t& index = m_grid[grid_index(brick_coord)];
+
+	if (index == EMPTY_BRICK) {
+		if (material == 0) {
+			return;
+		}
+
+		index = allocate_brick(brick_coord);
+		update_occupancy(brick_coord, true);
+		update_distance(brick_coord, true);
+	}
+	else if (is_coarse(index)) {
+		refine_brick(brick_coord);
+	}
+
+	brick& b = m_bricks[index];
+	const uint64_t bit = uint64_t(1) << (local.x + (local.y << BRICK_SHIFT));
+
+	b.materials[brick_voxel_index(local)] = material;
+	if (material != 0) {
+		b.occupancy[local.z] |= bit;
+		update_lod(b, local);
+		return;
+	}
+
+	b.occupancy[local.z] &= ~bit;
+	update_lod(b, local);
+	if (std::all_of(b.occupancy.begin(), b.occupancy.end(), [](uint64_t word) { return word == 0; })) {
+		m_bricks.free(index);
+		index = EMPTY_BRICK;
+		update_occupancy(brick_coord, false);
+		update_distance(brick_coord, false);
+	}
+}
+
+uint64_t world::occupancy_slice(uint32_t index, int z) const {
+	return is_coarse(index) ? expand_slice(m_coarse_bricks[index & ~COARSE_BRICK], z) : m_bricks[index].occupancy[z];
+}
+
+void world::coarsen_brick(glm::ivec3 brick_coord) {
+	uint32_t& index = m_grid[grid_index(brick_coord)];
+	if (index == EMPTY_BRICK || is_coarse(index)) {
+		return;
+	}
+
+	uint32_t coarse;
+	if (m_free_coarse_bricks.empty()) {
+		coarse = static_cast<uint32_t>(m_coarse_bricks.size());
+		m_coarse_bricks.push_back(m_bricks[index].lod);
+	}
+	else {
+		coarse = m_free_coarse_bricks.back();
+		m_free_coarse_bricks.pop_back();
+		m_coarse_bricks[coarse] = m_bricks[index].lod;
+	}
+
+	m_bricks.free(index);
+	index = coarse | COARSE_BRICK;
+}
+
+size_t world::memory_usage() const {
+	size_t bytes = m_grid.size() * sizeof(uint32_t) + m_bricks.slab_count() * BRICK_SLAB_SIZE * sizeof(brick)
+		+ m_coarse_bricks.capacity() * sizeof(brick_lod) + m_free_coarse_bricks.capacity() * sizeof(uint32_t)
+		+ m_distance.size() + m_distance_dirty.capacity() * sizeof(glm::ivec3);
+	for (const std::vector<uint8_t>& level : m_occupancy) {
+		bytes += level.size();
+	}
+
+	return bytes;
+}
+
+uint32_t world::compact_bricks(uint32_t max_moves) {
+	return m_bricks.compact(max_moves, [this](uint32_t owner, uint32_t slot) {
+		m_grid[owner] = slot;
+	});
+}
+
+uint32_t world::allocate_brick(glm::ivec3 brick_coord) {
+	const uint32_t index = m_bricks.allocate(static_cast<uint32_t>(grid_index(brick_coord)));
+	m_bricks[index].occupancy.fill(0);
+	m_bricks[index].materials.fill(0);
+	m_bricks[index].lod = {};
+	return index;
+}
+
+void world::refine_brick(glm::ivec3 brick_coord) {
+	uint32_t& index = m_grid[grid_index(brick_coord)];
+	const uint32_t coarse = index & ~COARSE_BRICK;
+	const brick_lod lod = m_coarse_bricks[coarse];
+	m_free_coarse_bricks.push_back(coarse);
+
+	// The full resolution data is gone, so every voxel takes its level 1 cell's material.
+	index = allocate_brick(brick_coord);
+	brick& b = m_bricks[index];
+	b.lod = lod;
+
+	for (int z = 0; z < BRICK_SIZE; z++) {
+		b.occupancy[z] = expand_slice(lod, z);
+		for (int y = 0; y < BRICK_SIZE; y++) {
+			for (int x = 0; x < BRICK_SIZE; x++) {
+				const glm::ivec3 local(x, y, z);
+				if (brick_is_solid(b, local)) {
+					b.materials[brick_voxel_index(local)] = lod.cells[lod_cell_index(1, local >> 1)].material;
+				}
+			}
+		}
+	}
+}
+
+void world::update_occupancy(glm::ivec3 brick_coord, bool occupied) {
+	glm::ivec3 cell = brick_coord;
+
+	for (int level = 0; level < occupancy_levels(); level++) {
+		const glm::ivec3 level_size = m_occupancy_sizes[level];
+		uint8_t& value = m_occupancy[level][cell.x + level_size.x * (cell.y + level_size.y * cell.z)];
+
+		if (occupied) {
+			if (value) {
+				return;
+			}
+
+			value = 1;
+		}
+		else {
+			if (level > 0) {
+				const glm::ivec3 first_child = cell * 2;
+				for (int i = 0; i < 8; i++) {
+					const glm::ivec3 child = first_child + glm::ivec3(i & 1, (i >> 1) & 1, (i >> 2) & 1);
+					if (is_occupied(level - 1, child)) {
+						return;
+					}
+				}
+			}
+
+			value = 0;
+		}
+
+		cell = cell / 2;
+	}
+}
+
+void world::update_distance(glm::ivec3 brick_coord, bool occupied) {
+	if (!occupied) {
+		m_distance_dirty.push_back(brick_coord);
+		return;
+	}
+
+	const glm::ivec3 lo = glm::max(brick_coord - (DISTANCE_FIELD_RANGE - 1), glm::ivec3(0));
+	const glm::ivec3 hi = glm::min(brick_coord + DISTANCE_FIELD_RANGE, m_grid_size);
+
+	for (int z = lo.z; z < hi.z; z++) {
+		for (int y = lo.y; y < hi.y; y++) {
+			for (int x = lo.x; x < hi.x; x++) {
+				const glm::ivec3 d = glm::abs(glm::ivec3(x, y, z) - brick_coord);
+				uint8_t& value = m_distance[grid_index(glm::ivec3(x, y, z))];
+				value = std::min(value, static_cast<uint8_t>(std::max(d.x, std::max(d.y, d.z))));
+			}
+		}
+	}
+}
+
+void world::update_distance_field(job_system& jobs) {
+	if (m_distance_dirty.empty()) {
+		return;
+	}
+
+	// A freed brick can raise distances up to the range away, and those depend on bricks up to the range beyond that.
+	const glm::ivec3 outer = glm::min(glm::ivec3(4 * DISTANCE_FIELD_RANGE + 1), m_grid_size);
+	if (m_distance_dirty.size() * outer.x * outer.y * outer.z >= m_grid.size()) {
+		rebuild_distance_field(jobs);
+		return;
+	}
+
+	for (glm::ivec3 brick_coord : m_distance_dirty) {
+		const glm::ivec3 inner_lo = glm::max(brick_coord - DISTANCE_FIELD_RANGE, glm::ivec3(0));
+		const glm::ivec3 inner_hi = glm::min(brick_coord + DISTANCE_FIELD_RANGE + 1, m_grid_size);
+		const glm::ivec3 lo = glm::max(inner_lo - DISTANCE_FIELD_RANGE, glm::ivec3(0));
+		const glm::ivec3 hi = glm::min(inner_hi + DISTANCE_FIELD_RANGE, m_grid_size);
+		compute_distances(lo, hi, inner_lo, inner_hi, jobs);
+	}
+
+	m_distance_dirty.clear();
+}
+
+void world::rebuild_distance_field(job_system& jobs) {
+	compute_distances(glm::ivec3(0), m_grid_size, glm::ivec3(0), m_grid_size, jobs);
+	m_distance_dirty.clear();
+}
+
+void world::compute_distances(glm::ivec3 lo, glm::ivec3 hi, glm::ivec3 inner_lo, glm::ivec3 inner_hi, job_system& jobs) {
+	const glm::ivec3 size = hi - lo;
+	std::vector<uint8_t> field(static_cast<size_t>(size.x) * size.y * size.z);
+	std::vector<uint8_t> next(field.size());
+
+	auto index = [&](glm::ivec3 cell) {
+		return cell.x + size.x * (cell.y + static_cast<size_t>(size.y) * cell.z);
+	};
+
+	for (int z = 0; z < size.z; z++) {
+		for (int y = 0; y < size.y; y++) {
+			for (int x = 0; x < size.x; x++) {
+				const glm::ivec3 cell(x, y, z);
+				field[index(cell)] = is_occupied(0, lo + cell) ? 0 : DISTANCE_FIELD_RANGE;
+			}
+		}
+	}
+
+	// One pass per axis, each line of cells along it processed independently.
+	for (int axis = 0; axis < 3; axis++) {
+		const int u_axis = (axis + 1) % 3;
+		const int v_axis = (axis + 2) % 3;
+		const int count = size[axis];
+
+		jobs.parallel_for(static_cast<uint32_t>(size[u_axis] * size[v_axis]), [&](uint32_t line, unsigned thread_index) {
+			frame_arena& arena = jobs.arena(thread_index);
+			const size_t mark = arena.mark();
+			uint8_t* in = arena.allocate<uint8_t>(count);
+			uint8_t* out = arena.allocate<uint8_t>(count);
+
+			glm::ivec3 cell(0);
+			cell[u_axis] = static_cast<int>(line) % size[u_axis];
+			cell[v_axis] = static_cast<int>(line) / size[u_axis];
+
+			for (int i = 0; i < count; i++) {
+				cell[axis] = i;
+				in[i] = field[index(cell)];
+			}
+
+			distance_pass(in, out, count);
+
+			for (int i = 0; i < count; i++) {
+				cell[axis] = i;
+				next[index(cell)] = out[i];
+			}
+
+			arena.rewind(mark);
+		});
+
+		field.swap(next);
+	}
+
+	for (int z = inner_lo.z; z < inner_hi.z; z++) {
+		for (int y = inner_lo.y; y < inner_hi.y; y++) {
+			for (int x = inner_lo.x; x < inner_hi.x; x++) {
+				const glm::ivec3 brick_coord(x, y, z);
+				m_distance[grid_index(brick_coord)] = field[index(brick_coord - lo)];
+			}
+		}
+	}
+}
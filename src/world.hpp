@@ -0,0 +1,118 @@
+#pragma once
+
+#include "brick.hpp"
+#include "brick_pool.hpp"
+#include "jobs.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+glm::vec3 material_color(uint8_t material);
+
+/* Distances in the brick distance field are capped at this many bricks, which also bounds the area an edit touches. */
+constexpr int DISTANCE_FIELD_RANGE = 8;
+
+/*
+ * Sparse voxel grid made of bricks. Empty bricks are not stored.
+ *
+ * On top of the brick grid sits an occupancy mip pyramid: level 0 has one cell
+ * per brick, and every level above halves each axis, with a cell marked as
+ * occupied if any of its 2x2x2 children are. Traversal uses it to skip large
+ * runs of empty space in a single step.
+ *
+ * Every brick also carries a level of detail chain (see brick_lod) that
+ * traversal can stop at for distant geometry. Bricks far from the viewer can
+ * be reduced to that chain alone with coarsen_brick(), dropping their full
+ * resolution voxels; they are refined again if they are edited.
+ */
+class world {
+public:
+	explicit world(glm::ivec3 size_in_bricks);
+
+	glm::ivec3 size() const { return m_grid_size * BRICK_SIZE; }
+	glm::ivec3 grid_size() const { return m_grid_size; }
+
+	bool in_bounds(glm::ivec3 voxel) const;
+
+	uint8_t get(glm::ivec3 voxel) const;
+	void set(glm::ivec3 voxel, uint8_t material);
+
+	uint32_t brick_index(glm::ivec3 brick_coord) const {
+		return m_grid[grid_index(brick_coord)];
+	}
+
+	static bool is_coarse(uint32_t index) { return index != EMPTY_BRICK && (index & COARSE_BRICK) != 0; }
+
+	/* `index` must be a full resolution brick; see is_coarse(). */
+	const brick& get_brick(uint32_t index) const { return m_bricks[index]; }
+
+	const brick_lod& get_brick_lod(uint32_t index) const {
+		return is_coarse(index) ? m_coarse_bricks[index & ~COARSE_BRICK] : m_bricks[index].lod;
+	}
+
+	/* Occupancy of one z slice of either kind of brick; coarse bricks are expanded from their level 1 cells. */
+	uint64_t occupancy_slice(uint32_t index, int z) const;
+
+	size_t brick_count() const { return m_bricks.live_count(); }
+	size_t coarse_brick_count() const { return m_coarse_bricks.size() - m_free_coarse_bricks.size(); }
+	const brick_pool& bricks() const { return m_bricks; }
+
+	/* Keeps only the level of detail chain of a brick, freeing its full resolution voxels. */
+	void coarsen_brick(glm::ivec3 brick_coord);
+
+	/* Bytes held by the grid, the brick pools and the occupancy pyramid. */
+	size_t memory_usage() const;
+
+	/*
+	 * Incremental defragmentation of the brick pool, meant to run on idle
+	 * frames. Moves at most `max_moves` bricks and patches the grid to match.
+	 */
+	uint32_t compact_bricks(uint32_t max_moves);
+
+	uint8_t brick_distance(glm::ivec3 brick_coord) const { return m_distance[grid_index(brick_coord)]; }
+
+	/* Recomputes the distance field around bricks freed since the last call, or everywhere if that is cheaper. */
+	void update_distance_field(job_system& jobs);
+
+	/* Recomputes the whole distance field with a three pass separable transform. */
+	void rebuild_distance_field(job_system& jobs);
+
+	int occupancy_levels() const { return static_cast<int>(m_occupancy.size()); }
+	glm::ivec3 occupancy_size(int level) const { return m_occupancy_sizes[level]; }
+
+	/* Out of range cells are treated as empty. */
+	bool is_occupied(int level, glm::ivec3 cell) const {
+		const glm::ivec3 size = m_occupancy_sizes[level];
+		if (cell.x < 0 || cell.y < 0 || cell.z < 0 || cell.x >= size.x || cell.y >= size.y || cell.z >= size.z) {
+			return false;
+		}
+
+		return m_occupancy[level][cell.x + size.x * (cell.y + size.y * cell.z)] != 0;
+	}
+
+private:
+	size_t grid_index(glm::ivec3 brick_coord) const {
+		return brick_coord.x + m_grid_size.x * (brick_coord.y + static_cast<size_t>(m_grid_size.y) * brick_coord.z);
+	}
+
+	uint32_t allocate_brick(glm::ivec3 brick_coord);
+	void refine_brick(glm::ivec3 brick_coord);
+	void update_occupancy(glm::ivec3 brick_coord, bool occupied);
+	void update_distance(glm::ivec3 brick_coord, bool occupied);
+	void compute_distances(glm::ivec3 lo, glm::ivec3 hi, glm::ivec3 inner_lo, glm::ivec3 inner_hi, job_system& jobs);
+
+	glm::ivec3 m_grid_size;
+	std::vector<uint32_t> m_grid;
+	brick_pool m_bricks;
+
+	std::vector<brick_lod> m_coarse_bricks;
+	std::vector<uint32_t> m_free_coarse_bricks;
+
+	std::vector<std::vector<uint8_t>> m_occupancy;
+	std::vector<glm::ivec3> m_occupancy_sizes;
+
+	std::vector<uint8_t> m_distance;
+	std::vector<glm::ivec3> m_distance_dirty;
+};